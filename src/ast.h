@@ -160,6 +160,8 @@ public:
   std::shared_ptr<ExprTerm> first = nullptr;
   std::optional<Token> op = std::nullopt;
   std::shared_ptr<Expr> rest = nullptr;
+  // the expression's type (set by the semantic checker)
+  std::optional<DataType> type = std::nullopt;
   void accept(Visitor& v) { v.visit(*this); }  
   Token first_token() {return first->first_token();}
 };
@@ -424,7 +424,7 @@ void ASTParser::expr(Expr& e)
 {
   if(match(TokenType::NOT))
   {
-    e.negated = true;
+    e.negated = !e.negated;
     advance();
     expr(e);
   }
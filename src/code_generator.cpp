@@ -31,6 +31,18 @@ void CodeGenerator::visit(Program& p)
     struct_def.accept(*this);
   for (auto& fun_def : p.fun_defs)
     fun_def.accept(*this);
+  // calls are inlined once every frame is generated, and the frames
+  // inlined into optimized again
+  inlined = inline_calls(frames, inline_threshold);
+  for(VMFrameInfo& frame : frames)
+  {
+    if(optimize_control_flow && !inlined.empty())
+    {
+      removed += ::optimize_control_flow(frame);
+    }
+    vm.add(frame);
+  }
+  frames.clear();
 }
 
 
@@ -47,22 +59,33 @@ void CodeGenerator::visit(FunDef& f)
   int param_size = f.params.size();
   VMFrameInfo frame {name, param_size};
   curr_frame = frame;
+  constant_index.clear();
+  var_table.reset_high_water_mark();
   var_table.push_environment();
+  mark(f.fun_name);
   for(int i = 0; i < f.params.size(); i++)
   {
     curr_frame.instructions.push_back(VMInstr::STORE(i));
     var_table.add(f.params[i].var_name.lexeme());
+    slot_types[i] = f.params[i].data_type;
   }
   for(auto s: f.stmts)
   {
     s->accept(*this);
   }
-  if(curr_frame.instructions.empty() || curr_frame.instructions.back().opcode() != OpCode::RET)
+  if(curr_frame.instructions.empty() ||
+     (curr_frame.instructions.back().opcode() != OpCode::RET &&
+      curr_frame.instructions.back().opcode() != OpCode::TAILCALL))
   {
     curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
     curr_frame.instructions.push_back(VMInstr::RET());
   }
-  vm.add(curr_frame);
+  curr_frame.local_count = var_table.high_water_mark();
+  if(optimize_control_flow)
+  {
+    removed += ::optimize_control_flow(curr_frame);
+  }
+  frames.push_back(curr_frame);
   var_table.pop_environment();
   next_var_index = 0;
 
@@ -70,25 +93,219 @@ void CodeGenerator::visit(FunDef& f)
 
 
 /**
- * The function stores a StructDef object in a map with the struct name as the key.
+ * Turns control flow optimization of the generated frames on or off.
+ *
+ * @param on True to optimize each frame's control flow before adding it.
+ */
+void CodeGenerator::set_control_flow_optimization(bool on)
+{
+  optimize_control_flow = on;
+}
+
+
+/**
+ * Returns the number of instructions removed by control flow optimization.
+ */
+int CodeGenerator::removed_instructions() const
+{
+  return removed;
+}
+
+
+/**
+ * Sets the size of the largest function whose calls are inlined.
+ *
+ * @param max_instructions The largest number of instructions of an
+ * inlined function (0 to not inline calls).
+ */
+void CodeGenerator::set_inline_threshold(int max_instructions)
+{
+  inline_threshold = max_instructions;
+}
+
+
+/**
+ * Returns the calls inlined, each with its caller and source line.
+ */
+const vector<VMInlinedCall>& CodeGenerator::inlined_calls() const
+{
+  return inlined;
+}
+
+
+/**
+ * The function stores a StructDef object in a map with the struct name as the key
+ * and adds the struct's layout (its fields in offset order) to the virtual machine.
  * 
  * @param s The parameter `s` is a reference to an object of type `StructDef`.
  */
 void CodeGenerator::visit(StructDef& s)
 {
   struct_defs[s.struct_name.lexeme()] = s;
+  VMStructLayout layout {s.struct_name.lexeme()};
+  for(auto& field : s.fields)
+  {
+    layout.field_names.push_back(field.var_name.lexeme());
+  }
+  vm.add(layout);
+}
+
+
+/**
+ * Returns the offset of a field within a struct type, and updates the type to
+ * the field's type.
+ * 
+ * @param type The struct type containing the field (set to the field's type).
+ * @param field_name The name of the field.
+ * @return The field's offset, or -1 if the type has no such field.
+ */
+int CodeGenerator::field_offset(DataType& type, const string& field_name)
+{
+  if(!type.is_array && struct_defs.contains(type.type_name))
+  {
+    const vector<VarDef>& fields = struct_defs[type.type_name].fields;
+    for(int i = 0; i < fields.size(); i++)
+    {
+      if(fields[i].var_name.lexeme() == field_name)
+      {
+        type = fields[i].data_type;
+        return i;
+      }
+    }
+  }
+  type = DataType();
+  return -1;
+}
+
+
+/**
+ * Returns the index of a string constant in the current frame's constant pool,
+ * adding it to the pool if needed.
+ * 
+ * @param value The string constant.
+ * @return The constant's index.
+ */
+int CodeGenerator::constant(const string& value)
+{
+  if(!constant_index.contains(value))
+  {
+    constant_index[value] = curr_frame.constants.size();
+    curr_frame.constants.push_back(value);
+  }
+  return constant_index[value];
+}
+
+
+/**
+ * Records the source position of a token as the position of the next instruction
+ * (and the instructions after it, up to the next mark) in the frame's line table.
+ * An entry no instruction has been generated for yet is replaced.
+ * 
+ * @param t The token (the first token of the statement or expression).
+ */
+void CodeGenerator::mark(const Token& t)
+{
+  vector<VMLineEntry>& lines = curr_frame.lines;
+  int pc = curr_frame.instructions.size();
+  while(!lines.empty() && lines.back().pc >= pc)
+  {
+    lines.pop_back();
+  }
+  if(lines.empty() || lines.back().line != t.line() || lines.back().column != t.column())
+  {
+    lines.push_back({pc, t.line(), t.column()});
+  }
+}
+
+
+/**
+ * Returns the concat call of an assignment of the form x = concat(x, e), where
+ * x is a local variable (without an array index).
+ * 
+ * @param s The assignment statement.
+ * @return The concat call, or nullptr if the statement has a different form.
+ */
+CallExpr* CodeGenerator::self_concat(AssignStmt& s)
+{
+  if(s.lvalue.size() != 1 || s.lvalue[0].array_expr.has_value() ||
+     s.expr.op.has_value() || s.expr.negated)
+  {
+    return nullptr;
+  }
+  auto term = dynamic_pointer_cast<SimpleTerm>(s.expr.first);
+  if(!term)
+  {
+    return nullptr;
+  }
+  auto call = dynamic_pointer_cast<CallExpr>(term->rvalue);
+  if(!call || call->fun_name.lexeme() != "concat" || call->args.size() != 2)
+  {
+    return nullptr;
+  }
+  Expr& lhs = call->args[0];
+  auto lhs_term = dynamic_pointer_cast<SimpleTerm>(lhs.first);
+  if(lhs.op.has_value() || lhs.negated || !lhs_term)
+  {
+    return nullptr;
+  }
+  auto var = dynamic_pointer_cast<VarRValue>(lhs_term->rvalue);
+  if(!var || var->path.size() != 1 || var->path[0].array_expr.has_value() ||
+     var->path[0].var_name.lexeme() != s.lvalue[0].var_name.lexeme())
+  {
+    return nullptr;
+  }
+  return call.get();
+}
+
+
+/**
+ * Returns the vm type of the operands of a binary expression, using the types
+ * inferred by the semantic checker. Both operands of an arithmetic or
+ * comparison operator have the same type, which is also the type of the right
+ * operand. Chars are strings in the vm.
+ * 
+ * @param e The binary expression.
+ * @return "int", "double", or "string", or "" if the type is unknown (e.g., if
+ * the semantic checker did not run) or is some other type.
+ */
+string CodeGenerator::operand_type(Expr& e)
+{
+  if(!e.rest || !e.rest->type.has_value() || e.rest->type.value().is_array)
+  {
+    return "";
+  }
+  string type = e.rest->type.value().type_name;
+  if(type == "char")
+  {
+    return "string";
+  }
+  if(type == "int" || type == "double" || type == "string")
+  {
+    return type;
+  }
+  return "";
 }
 
 
 /**
  * This function generates virtual machine instructions for a return statement.
+ * A return of a call to a user-defined function becomes a TAILCALL, which
+ * reuses the current frame for the call instead of returning its result.
  * 
  * @param s The parameter "s" is a reference to a ReturnStmt object.
  */
 void CodeGenerator::visit(ReturnStmt& s)
 {
   s.expr.accept(*this);
-  curr_frame.instructions.push_back(VMInstr::RET());
+  vector<VMInstr>& instrs = curr_frame.instructions;
+  if(!s.expr.op.has_value() && !s.expr.negated && !instrs.empty() &&
+     instrs.back().opcode() == OpCode::CALL)
+  {
+    string fun_name = instrs.back().operand().value().as_string();
+    instrs.back() = VMInstr::TAILCALL(fun_name);
+    return;
+  }
+  instrs.push_back(VMInstr::RET());
 }
 
 /**
@@ -131,6 +348,7 @@ void CodeGenerator::visit(WhileStmt& s)
     t->accept(*this);
   }
   var_table.pop_environment();
+  mark(s.condition.first_token());
   curr_frame.instructions.push_back(VMInstr::JMP(start));
   curr_frame.instructions.push_back(VMInstr::NOP());
   int nop = curr_frame.instructions.size() - 1;
@@ -161,6 +379,7 @@ void CodeGenerator::visit(ForStmt& s)
   var_table.pop_environment();
   s.assign_stmt.accept(*this);
   var_table.pop_environment();
+  mark(s.condition.first_token());
   curr_frame.instructions.push_back(VMInstr::JMP(start));
   curr_frame.instructions.push_back(VMInstr::NOP());
   int nop = curr_frame.instructions.size() - 1;
@@ -187,14 +406,15 @@ void CodeGenerator::visit(IfStmt& s)
     t->accept(*this);
   }
   var_table.pop_environment();
+  mark(s.if_part.condition.first_token());
   jmps.push_back(curr_frame.instructions.size());
   curr_frame.instructions.push_back(VMInstr::JMP(-1));
   jmpf.push_back(curr_frame.instructions.size());
   curr_frame.instructions.push_back(VMInstr::NOP());
   curr_frame.instructions.at(jmpf[0]).set_operand(jmpf[1]);
+  int else_counter = 2;
   for(auto e : s.else_ifs)
   {
-    int else_counter = 2;
     e.condition.accept(*this);
     jmpf.push_back(curr_frame.instructions.size());
     curr_frame.instructions.push_back(VMInstr::JMPF(-1));
@@ -204,16 +424,19 @@ void CodeGenerator::visit(IfStmt& s)
       t->accept(*this);
     }
     var_table.pop_environment();
+    mark(e.condition.first_token());
     jmps.push_back(curr_frame.instructions.size());
     curr_frame.instructions.push_back(VMInstr::JMP(-1));
     jmpf.push_back(curr_frame.instructions.size());
     curr_frame.instructions.push_back(VMInstr::NOP());
     curr_frame.instructions.at(jmpf[else_counter]).set_operand(jmpf[else_counter + 1]);
+    else_counter += 2;
   }
   for(auto p : s.else_stmts)
   {
     p->accept(*this);
   }
+  mark(s.if_part.condition.first_token());
   int end = curr_frame.instructions.size();
   curr_frame.instructions.push_back(VMInstr::NOP());
   for(auto t: jmps)
@@ -235,31 +458,56 @@ void CodeGenerator::visit(VarDeclStmt& s)
 {
   s.expr.accept(*this);
   var_table.add(s.var_def.var_name.lexeme());
-  curr_frame.instructions.push_back(VMInstr::STORE(var_table.get(s.var_def.var_name.lexeme())));
+  int index = var_table.get(s.var_def.var_name.lexeme());
+  slot_types[index] = s.var_def.data_type;
+  mark(s.var_def.var_name);
+  curr_frame.instructions.push_back(VMInstr::STORE(index));
 }
 
 void CodeGenerator::visit(AssignStmt& s)
 {
-  curr_frame.instructions.push_back(VMInstr::LOAD(var_table.get(s.lvalue[0].var_name.lexeme())));
+  int index = var_table.get(s.lvalue[0].var_name.lexeme());
+  if(CallExpr* call = self_concat(s))
+  {
+    // clear the variable before the CONCAT so the VM can append to the
+    // (then unshared) string in place
+    call->args[0].accept(*this);
+    call->args[1].accept(*this);
+    mark(s.lvalue[0].var_name);
+    curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
+    curr_frame.instructions.push_back(VMInstr::STORE(index));
+    curr_frame.instructions.push_back(VMInstr::CONCAT());
+    curr_frame.instructions.push_back(VMInstr::STORE(index));
+    return;
+  }
+  DataType type = slot_types[index];
+  int offset = -1;
+  mark(s.lvalue[0].var_name);
+  curr_frame.instructions.push_back(VMInstr::LOAD(index));
   for(int i = 0; i < s.lvalue.size(); i++)
   {
-    VarRef v = s.lvalue[i];
+    VarRef& v = s.lvalue[i];
     string name = v.var_name.lexeme();
     if(i != 0)
     {
-      curr_frame.instructions.push_back(VMInstr::GETF(name));
+      offset = field_offset(type, name);
+      mark(v.var_name);
+      curr_frame.instructions.push_back(VMInstr::GETF(name, offset));
     }
     if(v.array_expr.has_value())
     {
       v.array_expr->accept(*this);
+      mark(v.var_name);
       curr_frame.instructions.push_back(VMInstr::GETI());
+      type.is_array = false;
     }
   }
   curr_frame.instructions.pop_back();
   s.expr.accept(*this);
+  mark(s.lvalue.back().var_name);
   if(s.lvalue.size() > 1 && s.lvalue.back().array_expr == nullopt)
   {
-    curr_frame.instructions.push_back(VMInstr::SETF(s.lvalue.back().var_name.lexeme()));
+    curr_frame.instructions.push_back(VMInstr::SETF(s.lvalue.back().var_name.lexeme(), offset));
   }
   else if(s.lvalue.back().array_expr != nullopt)
   {
@@ -282,10 +530,12 @@ void CodeGenerator::visit(AssignStmt& s)
 void CodeGenerator::visit(CallExpr& e)
 {
   string fun_name = e.fun_name.lexeme();
+  mark(e.fun_name);
   for(int i = 0; i < e.args.size(); i++)
   {
     e.args[i].accept(*this);
   }
+  mark(e.fun_name);
   if(fun_name == "print")
   {
     curr_frame.instructions.push_back(VMInstr::WRITE());
@@ -341,55 +591,107 @@ void CodeGenerator::visit(CallExpr& e)
  */
 void CodeGenerator::visit(Expr& e)
 {
+  mark(e.first_token());
   e.first->accept(*this);
   if(e.op.has_value())
   {
     e.rest->accept(*this);
-    if(e.op.value().lexeme() == "+")
+    mark(e.op.value());
+    string op = e.op.value().lexeme();
+    string type = operand_type(e);
+    if(op == "+")
     {
-      curr_frame.instructions.push_back(VMInstr::ADD());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::ADDI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::ADDD());
+      else
+        curr_frame.instructions.push_back(VMInstr::ADD());
     }
-    else if(e.op.value().lexeme() == "-")
+    else if(op == "-")
     {
-      curr_frame.instructions.push_back(VMInstr::SUB());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::SUBI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::SUBD());
+      else
+        curr_frame.instructions.push_back(VMInstr::SUB());
     }
-    else if(e.op.value().lexeme() == "*")
+    else if(op == "*")
     {
-      curr_frame.instructions.push_back(VMInstr::MUL());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::MULI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::MULD());
+      else
+        curr_frame.instructions.push_back(VMInstr::MUL());
     }
-    else if(e.op.value().lexeme() == "/")
+    else if(op == "/")
     {
-      curr_frame.instructions.push_back(VMInstr::DIV());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::DIVI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::DIVD());
+      else
+        curr_frame.instructions.push_back(VMInstr::DIV());
     }
-    else if(e.op.value().lexeme() == "<")
+    else if(op == "<")
     {
-      curr_frame.instructions.push_back(VMInstr::CMPLT());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::CMPLTI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::CMPLTD());
+      else if(type == "string")
+        curr_frame.instructions.push_back(VMInstr::CMPLTS());
+      else
+        curr_frame.instructions.push_back(VMInstr::CMPLT());
     }
-    else if(e.op.value().lexeme() == "<=")
+    else if(op == "<=")
     {
-      curr_frame.instructions.push_back(VMInstr::CMPLE());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::CMPLEI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::CMPLED());
+      else if(type == "string")
+        curr_frame.instructions.push_back(VMInstr::CMPLES());
+      else
+        curr_frame.instructions.push_back(VMInstr::CMPLE());
     }
-    else if(e.op.value().lexeme() == ">")
+    else if(op == ">")
     {
-      curr_frame.instructions.push_back(VMInstr::CMPGT());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::CMPGTI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::CMPGTD());
+      else if(type == "string")
+        curr_frame.instructions.push_back(VMInstr::CMPGTS());
+      else
+        curr_frame.instructions.push_back(VMInstr::CMPGT());
     }
-    else if(e.op.value().lexeme() == ">=")
+    else if(op == ">=")
     {
-      curr_frame.instructions.push_back(VMInstr::CMPGE());
+      if(type == "int")
+        curr_frame.instructions.push_back(VMInstr::CMPGEI());
+      else if(type == "double")
+        curr_frame.instructions.push_back(VMInstr::CMPGED());
+      else if(type == "string")
+        curr_frame.instructions.push_back(VMInstr::CMPGES());
+      else
+        curr_frame.instructions.push_back(VMInstr::CMPGE());
     }
-    else if(e.op.value().lexeme() == "==")
+    else if(op == "==")
     {
       curr_frame.instructions.push_back(VMInstr::CMPEQ());
     }
-    else if(e.op.value().lexeme() == "!=")
+    else if(op == "!=")
     {
       curr_frame.instructions.push_back(VMInstr::CMPNE());
     }
-    else if(e.op.value().lexeme() == "and")
+    else if(op == "and")
     {
       curr_frame.instructions.push_back(VMInstr::AND());
     }
-    else if(e.op.value().lexeme() == "or")
+    else if(op == "or")
     {
       curr_frame.instructions.push_back(VMInstr::OR());
     }
@@ -448,7 +750,7 @@ void CodeGenerator::visit(SimpleRValue& v)
     string val = v.value.lexeme();
     replace_all(val, "\\n", "\n");
     replace_all(val, "\\t", "\t");
-    curr_frame.instructions.push_back(VMInstr::PUSH(val));
+    curr_frame.instructions.push_back(VMInstr::PUSHK(constant(val)));
   }
   else if(v.value.type() == TokenType::BOOL_VAL)
   {
@@ -462,7 +764,7 @@ void CodeGenerator::visit(SimpleRValue& v)
     string val = v.value.lexeme();
     replace_all(val, "\\n", "\n");
     replace_all(val, "\\t", "\t");
-    curr_frame.instructions.push_back(VMInstr::PUSH(val));
+    curr_frame.instructions.push_back(VMInstr::PUSHK(constant(val)));
   }
   else if (v.value.type() == TokenType::NULL_VAL) 
   {
@@ -484,45 +786,44 @@ void CodeGenerator::visit(NewRValue& v)
   if(v.array_expr.has_value())
   {
     v.array_expr->accept(*this);
+    mark(v.type);
     curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
     curr_frame.instructions.push_back(VMInstr::ALLOCA());
   }
   else
   {
-    curr_frame.instructions.push_back(VMInstr::ALLOCS());
-    for(auto& field : struct_defs[v.type.lexeme()].fields)
-    {
-      curr_frame.instructions.push_back(VMInstr::DUP());
-      curr_frame.instructions.push_back(VMInstr::ADDF(field.var_name.lexeme()));
-      curr_frame.instructions.push_back(VMInstr::DUP());
-      curr_frame.instructions.push_back(VMInstr::PUSH(nullptr));
-      curr_frame.instructions.push_back(VMInstr::SETF(field.var_name.lexeme()));
-    }
+    // the struct's layout gives it all of its fields (initially null)
+    curr_frame.instructions.push_back(VMInstr::ALLOCS(v.type.lexeme()));
   }
 }
 
 
 /**
  * This function generates virtual machine instructions for loading a variable's value and accessing
- * its fields and array elements.
+ * its fields (by offset) and array elements.
  * 
  * @param v VarRValue object that represents a variable reference in the AST (Abstract Syntax Tree).
  */
 void CodeGenerator::visit(VarRValue& v)
 {
-  curr_frame.instructions.push_back(VMInstr::LOAD(var_table.get(v.path[0].var_name.lexeme())));
+  int index = var_table.get(v.path[0].var_name.lexeme());
+  DataType type = slot_types[index];
+  curr_frame.instructions.push_back(VMInstr::LOAD(index));
   for(int i = 0; i < v.path.size(); i++)
   {
-    VarRef r = v.path[i];
+    VarRef& r = v.path[i];
     string name = r.var_name.lexeme();
     if(i != 0)
     {
-      curr_frame.instructions.push_back(VMInstr::GETF(name));
+      mark(r.var_name);
+      curr_frame.instructions.push_back(VMInstr::GETF(name, field_offset(type, name)));
     }
     if(r.array_expr.has_value())
     {
       r.array_expr->accept(*this);
+      mark(r.var_name);
       curr_frame.instructions.push_back(VMInstr::GETI());
+      type.is_array = false;
     }
   }
 }
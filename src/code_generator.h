@@ -11,9 +11,11 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 #include "ast.h"
 #include "var_table.h"
 #include "vm.h"
+#include "vm_optimizer.h"
 
 
 class CodeGenerator : public Visitor {
@@ -38,6 +40,20 @@ public:
   void visit(DeleteStructStmt& d);    
   void visit(DeleteArrayStmt& d);    
 
+  // optimize the control flow of each generated frame (removing NOPs,
+  // threading jumps, and removing unreachable code)
+  void set_control_flow_optimization(bool on);
+
+  // the number of instructions removed by control flow optimization
+  int removed_instructions() const;
+
+  // inline calls of non-recursive functions of at most max_instructions
+  // instructions (0, the default, to not inline)
+  void set_inline_threshold(int max_instructions);
+
+  // the calls inlined
+  const std::vector<VMInlinedCall>& inlined_calls() const;
+
 private:
 
   VM& vm;
@@ -45,6 +61,33 @@ private:
   int next_var_index = 0;  
   VarTable var_table;
   std::unordered_map<std::string,StructDef> struct_defs;
+  // declared types of the variables in each local slot
+  std::unordered_map<int,DataType> slot_types;
+  // indexes of the string constants in the current frame's pool
+  std::unordered_map<std::string,int> constant_index;
+  bool optimize_control_flow = false;
+  int removed = 0;
+  int inline_threshold = 0;
+  std::vector<VMInlinedCall> inlined;
+  // the generated frames (added to the vm once all are generated)
+  std::vector<VMFrameInfo> frames;
+
+  // helper to get a struct field's offset (updating type to the field's type)
+  int field_offset(DataType& type, const std::string& field_name);
+
+  // helper to get the pool index of a string constant (adding it)
+  int constant(const std::string& value);
+
+  // helper to record the token's source position as that of the next
+  // instruction (and those after it) in the frame's line table
+  void mark(const Token& t);
+
+  // helper to find the call in an assignment of the form x = concat(x, e)
+  CallExpr* self_concat(AssignStmt& s);
+
+  // helper to get the vm type of a binary expression's operands ("int",
+  // "double", "string", or "" if unknown)
+  std::string operand_type(Expr& e);
 
 };
 
@@ -0,0 +1,195 @@
+//----------------------------------------------------------------------
+// FILE: compile_cache.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: On-disk cache of compiled scripts
+//----------------------------------------------------------------------
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include "mypl_exception.h"
+#include "vm_image.h"
+#include "compile_cache.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+
+namespace {
+
+  // sha-256 (FIPS 180-4) of the data
+  string sha256(const string& data)
+  {
+    static const uint32_t k[64] = {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b,
+      0x59f111f1, 0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01,
+      0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7,
+      0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+      0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152,
+      0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+      0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+      0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819,
+      0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116, 0x1e376c08,
+      0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f,
+      0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+      0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    auto rotr = [](uint32_t x, int n) {return (x >> n) | (x << (32 - n));};
+    // pad to a multiple of 64 bytes: a 1 bit, zeros, and the bit length
+    string msg = data;
+    uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+    msg += static_cast<char>(0x80);
+    while (msg.size() % 64 != 56)
+      msg += '\0';
+    for (int i = 7; i >= 0; --i)
+      msg += static_cast<char>(bits >> (8 * i));
+    for (size_t block = 0; block < msg.size(); block += 64) {
+      uint32_t w[64];
+      for (int i = 0; i < 16; ++i) {
+        w[i] = 0;
+        for (int j = 0; j < 4; ++j)
+          w[i] = (w[i] << 8) | static_cast<uint8_t>(msg[block + 4 * i + j]);
+      }
+      for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+      }
+      uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+      uint32_t e = h[4], f = h[5], g = h[6], hh = h[7];
+      for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = hh + s1 + ch + k[i] + w[i];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+      }
+      h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+      h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    static const char* hex = "0123456789abcdef";
+    string digest;
+    for (uint32_t x : h)
+      for (int i = 28; i >= 0; i -= 4)
+        digest += hex[(x >> i) & 0xf];
+    return digest;
+  }
+
+}
+
+
+CompileCache::CompileCache(const string& dir)
+  : dir(dir)
+{
+}
+
+
+string CompileCache::default_dir()
+{
+  const char* xdg = getenv("XDG_CACHE_HOME");
+  if (xdg and *xdg)
+    return (fs::path(xdg) / "mypl").string();
+  const char* home = getenv("HOME");
+  if (home and *home)
+    return (fs::path(home) / ".cache" / "mypl").string();
+  return (fs::temp_directory_path() / "mypl").string();
+}
+
+
+string CompileCache::key(const string& source)
+{
+  // the image version is included so a format change is a miss even
+  // if the compiler version was not incremented
+  return sha256("mypl " + to_string(COMPILER_VERSION) + "." +
+                to_string(IMAGE_VERSION) + "." + to_string(OPCODE_COUNT) +
+                "\n" + source);
+}
+
+
+string CompileCache::entry_path(const string& source) const
+{
+  return (fs::path(dir) / (key(source) + ".myplc")).string();
+}
+
+
+bool CompileCache::load(const string& source, VM& vm)
+{
+  // a missing, corrupt, or out of date entry fails to load (leaving vm
+  // unchanged, see vm_image.h)
+  try {
+    load_image(vm, entry_path(source));
+  } catch (MyPLException& ex) {
+    count(false);
+    return false;
+  }
+  count(true);
+  return true;
+}
+
+
+void CompileCache::store(const string& source, const VM& vm)
+{
+  error_code ec;
+  fs::create_directories(dir, ec);
+  if (ec)
+    return;
+  // a unique temporary name in the same directory, then an atomic
+  // rename (the last of concurrent writers of an entry wins)
+  random_device rd;
+  string tmp = entry_path(source) + ".tmp" + to_string(rd()) + to_string(rd());
+  {
+    ofstream out(tmp, ios::binary);
+    if (!out)
+      return;
+    try {
+      save_image(vm, out);
+    } catch (MyPLException& ex) {
+      out.close();
+      fs::remove(tmp, ec);
+      return;
+    }
+    out.close();
+    if (!out) {
+      fs::remove(tmp, ec);
+      return;
+    }
+  }
+  fs::rename(tmp, entry_path(source), ec);
+  if (ec)
+    fs::remove(tmp, ec);
+}
+
+
+CompileCacheStats CompileCache::stats() const
+{
+  CompileCacheStats stats;
+  ifstream in(fs::path(dir) / "stats", ios::binary);
+  char c;
+  while (in.get(c)) {
+    if (c == 'h')
+      ++stats.hits;
+    else if (c == 'm')
+      ++stats.misses;
+  }
+  return stats;
+}
+
+
+void CompileCache::count(bool hit)
+{
+  // each load appends one byte (h or m) to the counts file: appends
+  // this small are atomic, so concurrent runs neither lock the file nor
+  // lose counts (on a hit the directory already exists)
+  error_code ec;
+  if (!hit)
+    fs::create_directories(dir, ec);
+  ofstream(fs::path(dir) / "stats", ios::binary | ios::app) << (hit ? 'h' : 'm');
+}
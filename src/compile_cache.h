@@ -0,0 +1,70 @@
+//----------------------------------------------------------------------
+// FILE: compile_cache.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: On-disk cache of compiled scripts (program images) keyed by
+//       the hash of their source and the compiler version
+//----------------------------------------------------------------------
+
+#ifndef COMPILE_CACHE_H
+#define COMPILE_CACHE_H
+
+#include <string>
+#include "vm.h"
+
+
+// the compiler version, part of every cache key (incremented whenever
+// the code generated for the same source changes)
+const int COMPILER_VERSION = 6;
+
+
+// hit and miss counts of a cache directory (over all processes)
+struct CompileCacheStats
+{
+  long hits = 0;
+  long misses = 0;
+};
+
+
+// Each entry is the image (see vm_image.h) of one source, named by
+// its key. Entries are written to a temporary file and renamed into
+// place, so concurrent runs never see a partial entry (and a corrupt
+// or out of date entry is a miss that gets replaced).
+class CompileCache
+{
+public:
+
+  // a cache in the given directory (created on the first miss)
+  explicit CompileCache(const std::string& dir);
+
+  // $XDG_CACHE_HOME/mypl (or ~/.cache/mypl)
+  static std::string default_dir();
+
+  // the key of the source: the hex sha-256 of the compiler version
+  // and the source bytes
+  static std::string key(const std::string& source);
+
+  // load the source's cached image into the vm, returns false (and
+  // leaves the vm unchanged) on a miss
+  bool load(const std::string& source, VM& vm);
+
+  // add the vm's image as the source's entry (errors are ignored, the
+  // cache is only an optimization)
+  void store(const std::string& source, const VM& vm);
+
+  // the hit and miss counts
+  CompileCacheStats stats() const;
+
+private:
+
+  std::string dir;
+
+  // the path of the source's entry
+  std::string entry_path(const std::string& source) const;
+
+  // append a hit or miss to the counts file (one byte per load)
+  void count(bool hit);
+};
+
+
+#endif
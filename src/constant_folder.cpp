@@ -0,0 +1,580 @@
+//----------------------------------------------------------------------
+// FILE: constant_folder.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Constant folding visitor implementation
+//----------------------------------------------------------------------
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include "vm_instr.h"
+#include "constant_folder.h"
+
+using namespace std;
+
+
+namespace {
+
+  // the value of a literal (as the code generator emits it)
+  optional<VMValue> literal_value(const Token& t)
+  {
+    string s = t.lexeme();
+    try {
+      switch (t.type()) {
+      case TokenType::INT_VAL: return VMValue(stoi(s));
+      case TokenType::DOUBLE_VAL: return VMValue(stod(s));
+      case TokenType::BOOL_VAL: return VMValue(s == "true");
+      case TokenType::NULL_VAL: return VMValue(nullptr);
+      case TokenType::STRING_VAL:
+      case TokenType::CHAR_VAL:
+        for (auto [escape, c] : {pair{"\\n", "\n"}, pair{"\\t", "\t"}})
+          for (size_t i = s.find(escape); i != string::npos; i = s.find(escape))
+            s.replace(i, 2, c);
+        return VMValue(s);
+      default: return nullopt;
+      }
+    } catch (exception& ex) {
+      return nullopt;
+    }
+  }
+
+  // a literal token (at the given position) with the value, if the
+  // value can be written as one
+  optional<Token> literal_token(const VMValue& x, const Token& at)
+  {
+    int line = at.line();
+    int column = at.column();
+    if (x.is_int())
+      return Token(TokenType::INT_VAL, to_string(x.as_int()), line, column);
+    if (x.is_double()) {
+      if (!isfinite(x.as_double()))
+        return nullopt;
+      char digits[32];
+      snprintf(digits, sizeof(digits), "%.17g", x.as_double());
+      return Token(TokenType::DOUBLE_VAL, digits, line, column);
+    }
+    if (x.is_bool())
+      return Token(TokenType::BOOL_VAL, x.as_bool() ? "true" : "false",
+                   line, column);
+    // a backslash could form an escape sequence with the next character
+    if (x.is_string() and x.as_string().find('\\') == string::npos)
+      return Token(TokenType::STRING_VAL, x.as_string(), line, column);
+    return nullopt;
+  }
+
+  // the literal of a term, if the term is one
+  optional<Token> literal(const shared_ptr<ExprTerm>& t)
+  {
+    auto term = dynamic_pointer_cast<SimpleTerm>(t);
+    if (!term)
+      return nullopt;
+    auto rvalue = dynamic_pointer_cast<SimpleRValue>(term->rvalue);
+    if (!rvalue)
+      return nullopt;
+    return rvalue->value;
+  }
+
+  // the literal of an expression, if the expression is just one
+  optional<Token> literal(const Expr& e)
+  {
+    if (e.op.has_value() or e.negated)
+      return nullopt;
+    return literal(e.first);
+  }
+
+  bool non_null(const Expr& e);
+
+  // true if the term's value is never null: a literal other than null,
+  // or a parenthesized not or operator (the vm fails on a null operand
+  // rather than computing null)
+  bool non_null(const shared_ptr<ExprTerm>& t)
+  {
+    if (auto term = dynamic_pointer_cast<ComplexTerm>(t))
+      return term->expr.negated or non_null(term->expr);
+    optional<Token> lit = literal(t);
+    return lit.has_value() and lit->type() != TokenType::NULL_VAL;
+  }
+
+  // true if the expression's value (before its not, if any) is never
+  // null
+  bool non_null(const Expr& e)
+  {
+    return e.op.has_value() or non_null(e.first);
+  }
+
+  // the value of an integer computation, if it is an int
+  optional<VMValue> int_value(long long x)
+  {
+    if (x < INT_MIN or x > INT_MAX)
+      return nullopt;
+    return VMValue(static_cast<int>(x));
+  }
+
+  // the value of x op y (as the vm computes it), if the operation
+  // succeeds
+  optional<VMValue> binary(const string& op, const VMValue& x, const VMValue& y)
+  {
+    if (op == "==" or op == "!=") {
+      bool equal;
+      if (x.is_null() or y.is_null())
+        equal = x.is_null() and y.is_null();
+      else if (x.type() != y.type())
+        return nullopt;
+      else if (x.is_int())
+        equal = x.as_int() == y.as_int();
+      else if (x.is_double())
+        equal = x.as_double() == y.as_double();
+      else if (x.is_string())
+        equal = x.as_string() == y.as_string();
+      else
+        equal = x.as_bool() == y.as_bool();
+      return VMValue(op == "==" ? equal : !equal);
+    }
+    if (x.is_null() or y.is_null() or x.type() != y.type())
+      return nullopt;
+    if (x.is_int()) {
+      long long a = x.as_int();
+      long long b = y.as_int();
+      if (op == "+") return int_value(a + b);
+      if (op == "-") return int_value(a - b);
+      if (op == "*") return int_value(a * b);
+      if (op == "/") return b ? int_value(a / b) : nullopt;
+    }
+    else if (x.is_double()) {
+      double a = x.as_double();
+      double b = y.as_double();
+      if (op == "+") return VMValue(a + b);
+      if (op == "-") return VMValue(a - b);
+      if (op == "*") return VMValue(a * b);
+      if (op == "/") return VMValue(a / b);
+    }
+    else if (x.is_bool()) {
+      if (op == "and") return VMValue(x.as_bool() and y.as_bool());
+      if (op == "or") return VMValue(x.as_bool() or y.as_bool());
+      return nullopt;
+    }
+    else if (!x.is_string())
+      return nullopt;
+    if (op == "<" or op == "<=" or op == ">" or op == ">=") {
+      int c;
+      if (x.is_int())
+        c = (x.as_int() > y.as_int()) - (x.as_int() < y.as_int());
+      else if (x.is_double()) {
+        if (isnan(x.as_double()) or isnan(y.as_double()))
+          return nullopt;
+        c = (x.as_double() > y.as_double()) - (x.as_double() < y.as_double());
+      }
+      else
+        c = x.as_string().compare(y.as_string());
+      if (op == "<") return VMValue(c < 0);
+      if (op == "<=") return VMValue(c <= 0);
+      if (op == ">") return VMValue(c > 0);
+      return VMValue(c >= 0);
+    }
+    return nullopt;
+  }
+
+  // the value of a call of a built-in function (as the vm computes
+  // it), if the function can be folded and the call succeeds
+  optional<VMValue> call(const string& fun, const vector<VMValue>& args)
+  {
+    for (const VMValue& x : args)
+      if (x.is_null())
+        return nullopt;
+    if (fun == "to_string" and args.size() == 1)
+      return VMValue(to_string(args[0]));
+    if (fun == "to_int" and args.size() == 1) {
+      const VMValue& x = args[0];
+      if (x.is_int())
+        return x;
+      if (x.is_double()) {
+        double d = x.as_double();
+        if (!(d > INT_MIN - 1.0 and d < INT_MAX + 1.0))
+          return nullopt;
+        return VMValue(static_cast<int>(d));
+      }
+      try {
+        return VMValue(stoi(x.as_string()));
+      } catch (exception& ex) {
+        return nullopt;
+      }
+    }
+    if (fun == "to_double" and args.size() == 1) {
+      const VMValue& x = args[0];
+      if (x.is_double())
+        return x;
+      if (x.is_int())
+        return VMValue(static_cast<double>(x.as_int()));
+      try {
+        return VMValue(stod(x.as_string()));
+      } catch (exception& ex) {
+        return nullopt;
+      }
+    }
+    if (fun == "concat" and args.size() == 2 and args[0].is_string() and
+        args[1].is_string())
+      return VMValue(args[0].as_string() + args[1].as_string());
+    return nullopt;
+  }
+
+  // true if the literal has the int or double value
+  bool is(const optional<Token>& t, int value)
+  {
+    optional<VMValue> x = t ? literal_value(*t) : nullopt;
+    if (!x)
+      return false;
+    if (x->is_int())
+      return x->as_int() == value;
+    return x->is_double() and x->as_double() == value and
+      !signbit(x->as_double());
+  }
+
+  // true if the literal has the bool value
+  bool is(const optional<Token>& t, bool value)
+  {
+    return t and t->type() == TokenType::BOOL_VAL and
+      (t->lexeme() == "true") == value;
+  }
+
+}
+
+
+void ConstantFolder::visit(Program& p)
+{
+  for(FunDef& f : p.fun_defs)
+  {
+    f.accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(FunDef& f)
+{
+  for(auto& s : f.stmts)
+  {
+    s->accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(StructDef& s)
+{
+}
+
+
+void ConstantFolder::visit(ReturnStmt& s)
+{
+  s.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(WhileStmt& s)
+{
+  s.condition.accept(*this);
+  for(auto& stmt : s.stmts)
+  {
+    stmt->accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(ForStmt& s)
+{
+  s.var_decl.accept(*this);
+  s.condition.accept(*this);
+  s.assign_stmt.accept(*this);
+  for(auto& stmt : s.stmts)
+  {
+    stmt->accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(IfStmt& s)
+{
+  s.if_part.condition.accept(*this);
+  for(auto& stmt : s.if_part.stmts)
+  {
+    stmt->accept(*this);
+  }
+  for(BasicIf& else_if : s.else_ifs)
+  {
+    else_if.condition.accept(*this);
+    for(auto& stmt : else_if.stmts)
+    {
+      stmt->accept(*this);
+    }
+  }
+  for(auto& stmt : s.else_stmts)
+  {
+    stmt->accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(VarDeclStmt& s)
+{
+  s.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(AssignStmt& s)
+{
+  visit(s.lvalue);
+  s.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(DeleteStructStmt& d)
+{
+  d.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(DeleteArrayStmt& d)
+{
+  d.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(CallExpr& e)
+{
+  for(Expr& arg : e.args)
+  {
+    arg.accept(*this);
+  }
+}
+
+
+/**
+ * Folds the operands of the expression, and then the expression itself
+ * if its operands are literals (or an identity like x * 1). Parentheses
+ * around a single term or around the whole expression are removed, so
+ * literals in them can be folded by the enclosing expression.
+ *
+ * @param e The expression to fold (in place).
+ */
+void ConstantFolder::visit(Expr& e)
+{
+  e.first->accept(*this);
+  if(auto term = dynamic_pointer_cast<ComplexTerm>(e.first))
+  {
+    Expr& inner = term->expr;
+    if(!e.op.has_value())
+    {
+      // (x) is x, and not (not x) is x unless x could be null (the
+      // vm reports not null)
+      if(e.negated && inner.negated && non_null(inner))
+      {
+        ++folded;
+      }
+      if(!(e.negated && inner.negated) || non_null(inner))
+      {
+        bool negated = e.negated != inner.negated;
+        optional<DataType> type = e.type;
+        Expr copy = inner;
+        e = copy;
+        e.negated = negated;
+        e.type = type;
+      }
+    }
+    else if(!inner.op.has_value() && !inner.negated)
+    {
+      e.first = inner.first;
+    }
+  }
+  if(e.op.has_value())
+  {
+    e.rest->accept(*this);
+    if(!fold_binary(e))
+    {
+      simplify(e);
+    }
+  }
+  // not of a literal
+  optional<Token> t = literal(e.first);
+  if(e.negated && !e.op.has_value() && t.has_value() &&
+     t->type() == TokenType::BOOL_VAL)
+  {
+    string value = t->lexeme() == "true" ? "false" : "true";
+    auto rvalue = make_shared<SimpleRValue>();
+    rvalue->value = Token(TokenType::BOOL_VAL, value, t->line(), t->column());
+    auto term = make_shared<SimpleTerm>();
+    term->rvalue = rvalue;
+    e.first = term;
+    e.negated = false;
+    ++folded;
+  }
+}
+
+
+/**
+ * Replaces a binary expression of two literals with its value.
+ *
+ * @param e The expression, which has an operator.
+ * @return True if the expression was folded.
+ */
+bool ConstantFolder::fold_binary(Expr& e)
+{
+  optional<Token> lhs = literal(e.first);
+  optional<Token> rhs = literal(*e.rest);
+  if(!lhs.has_value() || !rhs.has_value())
+  {
+    return false;
+  }
+  optional<VMValue> x = literal_value(lhs.value());
+  optional<VMValue> y = literal_value(rhs.value());
+  if(!x.has_value() || !y.has_value())
+  {
+    return false;
+  }
+  optional<VMValue> value = binary(e.op.value().lexeme(), x.value(), y.value());
+  optional<Token> t = value ? literal_token(value.value(), lhs.value()) : nullopt;
+  if(!t.has_value())
+  {
+    return false;
+  }
+  auto rvalue = make_shared<SimpleRValue>();
+  rvalue->value = t.value();
+  auto term = make_shared<SimpleTerm>();
+  term->rvalue = rvalue;
+  e.first = term;
+  e.op = nullopt;
+  e.rest = nullptr;
+  ++folded;
+  return true;
+}
+
+
+/**
+ * Replaces x * 1, 1 * x, x / 1, x + 0, 0 + x, x - 0, x and true,
+ * true and x, x or false, and false or x with x if x is never null
+ * (the vm reports a null x). Only an int 0 is dropped from a sum,
+ * since -0.0 + 0.0 is 0.0.
+ *
+ * @param e The expression, which has an operator.
+ * @return True if the expression was simplified.
+ */
+bool ConstantFolder::simplify(Expr& e)
+{
+  string op = e.op.value().lexeme();
+  optional<Token> lhs = literal(e.first);
+  optional<Token> rhs = literal(*e.rest);
+  auto is_int_zero = [](const optional<Token>& t) {
+    return t.has_value() && t->type() == TokenType::INT_VAL && is(t, 0);
+  };
+  bool keep_first = non_null(e.first) && (
+    ((op == "*" || op == "/") && is(rhs, 1)) ||
+    (op == "+" && is_int_zero(rhs)) ||
+    (op == "-" && is(rhs, 0)) ||
+    (op == "and" && is(rhs, true)) ||
+    (op == "or" && is(rhs, false)));
+  bool keep_rest = (e.rest->negated || non_null(*e.rest)) && (
+    (op == "*" && is(lhs, 1)) ||
+    (op == "+" && is_int_zero(lhs)) ||
+    (op == "and" && is(lhs, true)) ||
+    (op == "or" && is(lhs, false)));
+  if(keep_first)
+  {
+    e.op = nullopt;
+    e.rest = nullptr;
+  }
+  else if(keep_rest)
+  {
+    // the negation of e applies to all of the rest
+    bool negated = e.negated != e.rest->negated;
+    optional<DataType> type = e.type;
+    Expr rest = *e.rest;
+    e = rest;
+    e.negated = negated;
+    e.type = type;
+  }
+  else
+  {
+    return false;
+  }
+  ++folded;
+  return true;
+}
+
+
+/**
+ * Folds the term's rvalue, replacing a call of a built-in function on
+ * literals with its value.
+ *
+ * @param t The term to fold (in place).
+ */
+void ConstantFolder::visit(SimpleTerm& t)
+{
+  t.rvalue->accept(*this);
+  auto call_expr = dynamic_pointer_cast<CallExpr>(t.rvalue);
+  if(!call_expr)
+  {
+    return;
+  }
+  vector<VMValue> args;
+  for(Expr& arg : call_expr->args)
+  {
+    optional<Token> lit = literal(arg);
+    optional<VMValue> x = lit ? literal_value(lit.value()) : nullopt;
+    if(!x.has_value())
+    {
+      return;
+    }
+    args.push_back(x.value());
+  }
+  optional<VMValue> value = call(call_expr->fun_name.lexeme(), args);
+  optional<Token> lit = value ? literal_token(value.value(), call_expr->fun_name) : nullopt;
+  if(lit.has_value())
+  {
+    auto rvalue = make_shared<SimpleRValue>();
+    rvalue->value = lit.value();
+    t.rvalue = rvalue;
+    ++folded;
+  }
+}
+
+
+void ConstantFolder::visit(ComplexTerm& t)
+{
+  t.expr.accept(*this);
+}
+
+
+void ConstantFolder::visit(SimpleRValue& v)
+{
+}
+
+
+void ConstantFolder::visit(NewRValue& v)
+{
+  if(v.array_expr.has_value())
+  {
+    v.array_expr->accept(*this);
+  }
+}
+
+
+void ConstantFolder::visit(VarRValue& v)
+{
+  visit(v.path);
+}
+
+
+void ConstantFolder::visit(vector<VarRef>& path)
+{
+  for(VarRef& ref : path)
+  {
+    if(ref.array_expr.has_value())
+    {
+      ref.array_expr->accept(*this);
+    }
+  }
+}
+
+
+int ConstantFolder::folded_count() const
+{
+  return folded;
+}
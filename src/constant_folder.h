@@ -0,0 +1,63 @@
+//----------------------------------------------------------------------
+// FILE: constant_folder.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Interface for the constant folding visitor (run on a checked
+//       program before code generation).
+//----------------------------------------------------------------------
+
+
+#ifndef CONSTANT_FOLDER_H
+#define CONSTANT_FOLDER_H
+
+#include "ast.h"
+
+
+// Replaces expressions of literals (arithmetic, comparisons, boolean
+// operators, and to_string, to_int, to_double, and concat calls) with
+// their value, and simplifies x * 1, x / 1, x + 0, x - 0, x and true,
+// x or false, and not (not x) to x when x is never null (e.g., x is
+// itself the result of an operator). Expressions whose evaluation
+// fails (e.g., division by zero or a null operand) are left for the vm
+// to report.
+class ConstantFolder : public Visitor {
+public:
+  void visit(Program& p);
+  void visit(FunDef& f);
+  void visit(StructDef& s);
+  void visit(ReturnStmt& s);
+  void visit(WhileStmt& s);
+  void visit(ForStmt& s);
+  void visit(IfStmt& s);
+  void visit(VarDeclStmt& s);
+  void visit(AssignStmt& s);
+  void visit(CallExpr& e);
+  void visit(Expr& e);
+  void visit(SimpleTerm& t);
+  void visit(ComplexTerm& t);
+  void visit(SimpleRValue& v);
+  void visit(NewRValue& v);
+  void visit(VarRValue& v);
+  void visit(DeleteStructStmt& d);
+  void visit(DeleteArrayStmt& d);
+
+  // the number of expressions folded or simplified
+  int folded_count() const;
+
+private:
+
+  int folded = 0;
+
+  // helper to replace the expression with its value if its operands
+  // are literals
+  bool fold_binary(Expr& e);
+
+  // helper to replace an identity (e.g., x * 1) with its operand
+  bool simplify(Expr& e);
+
+  // helper to visit the array index expressions of a path
+  void visit(std::vector<VarRef>& path);
+
+};
+
+#endif
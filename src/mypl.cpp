@@ -6,13 +6,21 @@
 //----------------------------------------------------------------------
 
 #include <iostream>
+#include <climits>
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
 #include "lexer.h"
 #include "simple_parser.h"
 #include "ast_parser.h"
 #include "print_visitor.h"
 #include "semantic_checker.h"
+#include "constant_folder.h"
 #include "code_generator.h"
+#include "reg_code_generator.h"
+#include "vm_image.h"
+#include "compile_cache.h"
 
 using namespace std;
 void usage();// shows the message for help
@@ -21,19 +29,111 @@ void print(istream* input);// prints the first word of the input
 void check(istream* input);// prints the first line of the input
 void ir(istream* input);// prints the first two lines of the input
 void df(istream* input);// prints the entire file(default)
+void generate(Program& p, VM& vm);// generates code for the engine below
+void run(VM& vm);// runs the program with the vm options below
+void compile(VM& vm);// writes the program's image instead of running it
+void run_cached(istream& input);// runs the program, reusing its cached image if there is one
+bool parse_number(const string& arg, long& value, long min, long max);// reads the number after the '=' in an option
 
+// vm options (can be given with any of the other options)
+long gc_threshold = -1;// heap bytes before collecting (-1 for the default)
+bool gc_stats = false;// print garbage collector statistics after running
+string engine = "stack";// bytecode to generate and run (stack or reg)
+bool jit = true;// compile hot functions to native code (stack engine)
+bool profile = false;// print an execution profile after running (stack engine)
+string profile_file;// file to write the profile to as json (if given)
+bool sampling = false;// write sampled call stacks (folded) after running (stack engine)
+string sample_file;// file to write the folded stacks to (if given)
+int sample_hz = 1000;// call stack samples per second of cpu time
+string compile_file;// image (.myplc) file to compile the program to
+bool cache = true;// reuse compiled scripts from the compile cache (stack engine)
+bool cache_stats = false;// print the compile cache hit and miss counts after running
+bool fold = true;// fold constant expressions before generating code
+bool cfg_opt = true;// remove NOPs, jump chains, and unreachable code from generated code
+const int default_inline_threshold = 16;// the size (in instructions) of the largest inlined function
+int inline_threshold = default_inline_threshold;// inline calls of non-recursive functions up to this size (0 for none)
+bool verbose = false;// print what the optimizations did
 
 
 int main(int argc, char* argv[])
 { 
   istream* input = &cin; 
 
-  // changes char inputs to string
-  string args[argc];
+  // changes char inputs to string (taking out the vm options)
+  vector<string> args;
   for(int i = 0; i < argc; ++i)
   {
-	args[i] = string(argv[i]);
+	string arg = argv[i];
+	long value = 0;
+	if(arg.starts_with("--gc-threshold="))
+	{
+		if(!parse_number(arg, value, 1, LONG_MAX))
+			return 1;
+		gc_threshold = value;
+	}
+	else if(arg == "--gc-stats")
+		gc_stats = true;
+	else if(arg.starts_with("--engine="))
+	{
+		engine = arg.substr(9);
+		if(engine != "stack" && engine != "reg")
+		{
+			cout << "ERROR:  Unknown engine '" << engine << "' (expecting stack or reg)" << endl;
+			usage();
+			return 1;
+		}
+	}
+	else if(arg == "--jit" || arg == "--no-jit")
+		jit = (arg == "--jit");
+	else if(arg == "--profile" || arg.starts_with("--profile="))
+	{
+		profile = true;
+		if(arg.size() > 10)
+			profile_file = arg.substr(10);
+	}
+	else if(arg.starts_with("--sample-hz="))
+	{
+		if(!parse_number(arg, value, 1, INT_MAX))
+			return 1;
+		sample_hz = value;
+	}
+	else if(arg == "--compile" && i + 1 < argc)
+		compile_file = argv[++i];
+	else if(arg.starts_with("--compile="))
+		compile_file = arg.substr(10);
+	else if(arg == "--cache" || arg == "--no-cache")
+		cache = (arg == "--cache");
+	else if(arg == "--cache-stats")
+		cache_stats = true;
+	else if(arg == "--fold" || arg == "--no-fold")
+		fold = (arg == "--fold");
+	else if(arg == "--cfg-opt" || arg == "--no-cfg-opt")
+		cfg_opt = (arg == "--cfg-opt");
+	else if(arg.starts_with("--inline-threshold="))
+	{
+		if(!parse_number(arg, value, 0, INT_MAX))
+			return 1;
+		inline_threshold = value;
+	}
+	else if(arg == "--verbose" || arg == "-v")
+		verbose = true;
+	else if(arg == "--sample" || arg.starts_with("--sample="))
+	{
+		sampling = true;
+		if(arg.size() > 9)
+			sample_file = arg.substr(9);
+	}
+	else
+		args.push_back(arg);
+  }
+  if(engine == "reg" && (profile || sampling))// the profilers only see the stack engine
+  {
+	cout << "ERROR:  --profile and --sample cannot be used with --engine=reg" << endl;
+	usage();
+	return 1;
   }
+  argc = args.size();
+  args.push_back("");
 
  // If statement checks which command it is and if it has a file
   if((args[1] == "--help") || (argc > 3))
@@ -42,10 +142,10 @@ int main(int argc, char* argv[])
   {
 	if(argc == 3)// checks if it has a file
 	{
-		input = new ifstream(argv[2]);// sets the file to input
+		input = new ifstream(args[2]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[2] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[2] << "'" << endl;
 		}
 		else
 		{
@@ -82,10 +182,10 @@ int main(int argc, char* argv[])
   {
 	if(argc == 3)// checks if it has a file
 	{
-		input = new ifstream(argv[2]);// sets the file to input
+		input = new ifstream(args[2]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[2] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[2] << "'" << endl;
 		}
 		else
 			try {
@@ -112,10 +212,10 @@ int main(int argc, char* argv[])
   {
 	if(argc == 3)// checks if it has a file
 	{
-		input = new ifstream(argv[2]);// sets the file to input
+		input = new ifstream(args[2]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[2] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[2] << "'" << endl;
 		}
 		else
 			try {
@@ -146,10 +246,10 @@ int main(int argc, char* argv[])
   {
 	if(argc == 3)// checks if it has a file
 	{
-		input = new ifstream(argv[2]);// sets the file to input
+		input = new ifstream(args[2]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[2] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[2] << "'" << endl;
 		}
 		else
 			try {
@@ -180,10 +280,10 @@ int main(int argc, char* argv[])
   {
 	if(argc == 3)// checks if it has a file
 	{
-		input = new ifstream(argv[2]);// sets the file to input
+		input = new ifstream(args[2]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[2] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[2] << "'" << endl;
 		}
 		else
 			try {
@@ -193,8 +293,7 @@ int main(int argc, char* argv[])
 					SemanticChecker t;
 					p.accept(t);
 					VM vm;
-					CodeGenerator g(vm);
-					p.accept(g);
+					generate(p, vm);
 					cout << to_string(vm) << endl;
 				} catch (MyPLException& ex) {
 					cerr << ex.what() << endl;
@@ -210,8 +309,7 @@ int main(int argc, char* argv[])
 			SemanticChecker t;
 			p.accept(t);
 			VM vm;
-			CodeGenerator g(vm);
-			p.accept(g);
+			generate(p, vm);
 			cout << to_string(vm) << endl;
 			} catch (MyPLException& ex) {
 			cerr << ex.what() << endl;
@@ -220,12 +318,32 @@ int main(int argc, char* argv[])
   }
   else
   {
-	if(argc == 2)// checks if it has a file
+	if(argc == 2 && compile_file.empty() && is_image_file(args[1]))// runs a precompiled program
+	{
+		try {
+			VM vm;
+			load_image(vm, args[1]);
+			run(vm);
+		} catch (MyPLException& ex) {
+			cerr << ex.what() << endl;
+		}
+	}
+	else if(argc == 2 && compile_file.empty() && engine != "reg" && fold && cfg_opt && inline_threshold == default_inline_threshold && cache)// runs the file through the compile cache
+	{
+		input = new ifstream(args[1], ios::binary);// sets the file to input
+		if(input -> fail())// checks if the file fails
+		{
+			cout << "ERROR:  Unable to open file '" << args[1] << "'" << endl;
+		}
+		else
+			run_cached(*input);
+	}
+	else if(argc == 2)// checks if it has a file
 	{
-		input = new ifstream(argv[1]);// sets the file to input
+		input = new ifstream(args[1]);// sets the file to input
 		if(input -> fail())// checks if the file fails
 		{
-			cout << "ERROR:  Unable to open file '" << argv[1] << "'" << endl;
+			cout << "ERROR:  Unable to open file '" << args[1] << "'" << endl;
 		}
 		else
 			try {
@@ -235,9 +353,11 @@ int main(int argc, char* argv[])
 				SemanticChecker t;
 				p.accept(t);
 				VM vm;
-				CodeGenerator g(vm);
-				p.accept(g);
-				vm.run();
+				generate(p, vm);
+				if(compile_file.empty())
+					run(vm);
+				else
+					compile(vm);
 				} catch (MyPLException& ex) {
 				cerr << ex.what() << endl;
 				}
@@ -252,9 +372,11 @@ int main(int argc, char* argv[])
 			SemanticChecker t;
 			p.accept(t);
 			VM vm;
-			CodeGenerator g(vm);
-			p.accept(g);
-			vm.run();
+			generate(p, vm);
+			if(compile_file.empty())
+				run(vm);
+			else
+				compile(vm);
 			} catch (MyPLException& ex) {
 			cerr << ex.what() << endl;
 			}
@@ -274,6 +396,161 @@ int main(int argc, char* argv[])
 		cout << " --print	pretty prints program" << endl;
 		cout << " --check	statically checks program" << endl;
 		cout << " --ir		print intermediate (code) representation" << endl;
+		cout << " --compile FILE	compile the program to an image (run with ./mypl FILE)" << endl;
+		cout << "VM options: " << endl;
+		cout << " --gc-threshold=N	collect garbage once the heap holds N bytes" << endl;
+		cout << " --gc-stats	print garbage collector statistics" << endl;
+		cout << " --engine=E	run stack (default) or reg (register) bytecode" << endl;
+		cout << " --jit, --no-jit	turn compiling hot functions to native code on (default) or off" << endl;
+		cout << " --profile[=FILE]	print an execution profile (or write it to FILE as json)" << endl;
+		cout << " --sample[=FILE]	print sampled call stacks in folded format (or write them to FILE)" << endl;
+		cout << " --sample-hz=N	take N (at least 1) call stack samples per second (default 1000)" << endl;
+		cout << " --cache, --no-cache	turn reusing compiled scripts from " << CompileCache::default_dir() << " on (default) or off" << endl;
+		cout << " --cache-stats	print the compile cache hit and miss counts" << endl;
+		cout << " --fold, --no-fold	turn folding constant expressions on (default) or off" << endl;
+		cout << " --cfg-opt, --no-cfg-opt	turn removing NOPs, jump chains, and unreachable code on (default) or off" << endl;
+		cout << " --inline-threshold=N	inline calls of non-recursive functions of at most N instructions (default " << default_inline_threshold << ", 0 for none)" << endl;
+		cout << " -v, --verbose	print what the optimizations did (and the inlined calls)" << endl;
+	}
+
+	void generate(Program& p, VM& vm)
+	{
+		if(fold)
+		{
+			ConstantFolder f;
+			p.accept(f);
+			if(verbose)
+				cerr << "constant folding: " << f.folded_count() << " expressions folded" << endl;
+		}
+		if(engine == "reg" && compile_file.empty())
+		{
+			RegCodeGenerator g(vm);
+			p.accept(g);
+		}
+		else
+		{
+			CodeGenerator g(vm);
+			g.set_control_flow_optimization(cfg_opt);
+			g.set_inline_threshold(inline_threshold);
+			p.accept(g);
+			if(verbose && cfg_opt)
+				cerr << "control flow optimization: " << g.removed_instructions() << " instructions removed" << endl;
+			if(verbose && inline_threshold > 0)
+			{
+				cerr << "inlining: " << g.inlined_calls().size() << " calls inlined" << endl;
+				for(const VMInlinedCall& call : g.inlined_calls())
+					cerr << "  inlined " << call.callee << " into " << call.caller << " at line " << call.line << endl;
+			}
+		}
+	}
+
+	void run(VM& vm)
+	{
+		if(gc_threshold >= 0)
+			vm.set_gc_threshold(gc_threshold);
+		vm.set_jit(jit);
+		vm.set_profiling(profile);
+		if(sampling)
+			vm.set_sampling(sample_hz);
+		if(engine == "reg")
+			vm.run_registers();
+		else
+			vm.run();
+		if(profile && vm.profile())
+		{
+			if(profile_file.empty())
+				vm.profile()->report(cerr);
+			else
+			{
+				ofstream out(profile_file);
+				if(!out)
+					cerr << "ERROR:  Unable to open file '" << profile_file << "'" << endl;
+				else
+					vm.profile()->write_json(out);
+			}
+		}
+		if(sampling && vm.samples())
+		{
+			if(sample_file.empty())
+				vm.samples()->write_folded(cerr);
+			else
+			{
+				ofstream out(sample_file);
+				if(!out)
+					cerr << "ERROR:  Unable to open file '" << sample_file << "'" << endl;
+				else
+					vm.samples()->write_folded(out);
+			}
+		}
+		if(gc_stats)
+		{
+			const VMGCStats& stats = vm.gc_stats();
+			cerr << "gc collections: " << stats.collections << endl;
+			cerr << "gc objects freed: " << stats.objects_freed << endl;
+			cerr << "gc bytes freed: " << stats.bytes_freed << endl;
+			cerr << "gc total pause: " << stats.total_pause_ms << " ms" << endl;
+			cerr << "gc max pause: " << stats.max_pause_ms << " ms" << endl;
+		}
+	}
+
+	void compile(VM& vm)
+	{
+		ofstream out(compile_file, ios::binary);
+		if(!out)
+		{
+			cout << "ERROR:  Unable to open file '" << compile_file << "'" << endl;
+			return;
+		}
+		save_image(vm, out);
+	}
+
+	void run_cached(istream& input)
+	{
+		ostringstream buffer;
+		buffer << input.rdbuf();
+		string source = buffer.str();
+		CompileCache compile_cache(CompileCache::default_dir());
+		try {
+			VM vm;
+			if(!compile_cache.load(source, vm))// compiles and caches the program on a miss
+			{
+				istringstream in(source);
+				Lexer lexer(in);
+				ASTParser parser(lexer);
+				Program p = parser.parse();
+				SemanticChecker t;
+				p.accept(t);
+				generate(p, vm);
+				compile_cache.store(source, vm);
+			}
+			run(vm);
+		} catch (MyPLException& ex) {
+			cerr << ex.what() << endl;
+		}
+		if(cache_stats)
+		{
+			CompileCacheStats stats = compile_cache.stats();
+			cerr << "cache hits: " << stats.hits << endl;
+			cerr << "cache misses: " << stats.misses << endl;
+		}
+	}
+
+	bool parse_number(const string& arg, long& value, long min, long max)
+	{
+		size_t start = arg.find('=') + 1;
+		size_t end = 0;
+		try {
+			value = stol(arg.substr(start), &end);
+		} catch (logic_error&) {// not a number (invalid_argument) or too large (out_of_range)
+			end = 0;
+		}
+		if(end == 0 || start + end != arg.size() || value < min || value > max)
+		{
+			cout << "ERROR:  Invalid number '" << arg.substr(start) << "' in option '" << arg.substr(0, start - 1) << "'" << endl;
+			usage();
+			return false;
+		}
+		return true;
 	}
 
 	void parse(istream* input)
@@ -12,6 +12,7 @@ enum class OpCode {
 
   // consts/vars
   PUSH,         // [operand] push v onto stack
+  PUSHK,        // [operand] push constant v of the frame's constant pool
   POP,          // pop value off of stack
   LOAD,         // [operand] push value at memory address v onto stack
   STORE,        // [operand] pop x, store x at memory address v
@@ -35,12 +36,37 @@ enum class OpCode {
   CMPEQ,        // pop x and y off stack, push (y == x)  
   CMPNE,        // pop x and y off stack, push (y != x)
 
+  // type-specialized operations (emitted when the operand types are
+  // known statically, fall back to the generic operation otherwise)
+  ADDI,         // ADD with int operands
+  ADDD,         // ADD with double operands
+  SUBI,         // SUB with int operands
+  SUBD,         // SUB with double operands
+  MULI,         // MUL with int operands
+  MULD,         // MUL with double operands
+  DIVI,         // DIV with int operands
+  DIVD,         // DIV with double operands
+  CMPLTI,       // CMPLT with int operands
+  CMPLTD,       // CMPLT with double operands
+  CMPLTS,       // CMPLT with string operands
+  CMPLEI,       // CMPLE with int operands
+  CMPLED,       // CMPLE with double operands
+  CMPLES,       // CMPLE with string operands
+  CMPGTI,       // CMPGT with int operands
+  CMPGTD,       // CMPGT with double operands
+  CMPGTS,       // CMPGT with string operands
+  CMPGEI,       // CMPGE with int operands
+  CMPGED,       // CMPGE with double operands
+  CMPGES,       // CMPGE with string operands
+
   // jump
   JMP,          // [operand] jump to given instruction v
   JMPF,         // [operand] pop x, if x is false jump to instruction v
 
   // functions
   CALL,         // [operand] call function v (pop and push args)
+  TAILCALL,     // [operand] call function v in place of the current
+                // function (its frame is reused for the call)
   RET,          // return from current function
 
   // built-ins
@@ -67,8 +93,27 @@ enum class OpCode {
     
   // special
   DUP,          // pop x, push x, push x
+
+  // superinstructions (only set as the executed opcode of the first
+  // instruction of the sequence they stand for, see vm_optimizer.h)
+  INCL,         // LOAD i, PUSH c, ADD (or ADDI), STORE i
+  CMPLT_JMPF,   // CMPLT, JMPF v
+  CMPLE_JMPF,   // CMPLE, JMPF v
+  CMPGT_JMPF,   // CMPGT, JMPF v
+  CMPGE_JMPF,   // CMPGE, JMPF v
+  CMPEQ_JMPF,   // CMPEQ, JMPF v
+  CMPNE_JMPF,   // CMPNE, JMPF v
+  LOADL_GETF,   // LOAD i, GETF v
+
+  // quickened forms (only set by the vm as the executed opcode of an
+  // instruction after it runs, see VM::quicken)
+  GETF_Q,       // GETF v using the instruction's cached layout and offset
+
   NOP           // has no effect (for jumping over code segments)
 
 };
 
+// number of opcodes (NOP must remain the last opcode)
+const int OPCODE_COUNT = static_cast<int>(OpCode::NOP) + 1;
+
 #endif
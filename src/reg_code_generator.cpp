@@ -0,0 +1,602 @@
+//----------------------------------------------------------------------
+// FILE: reg_code_generator.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Register code generator. Each expression is evaluated into a
+// register: variables are read in place from their own registers and
+// other values are computed into temporaries, so x = a + b is a single
+// ADD instead of four stack instructions.
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include "reg_code_generator.h"
+
+using namespace std;
+
+
+// helper function to replace the escape sequences of a literal
+static string unescape(string s)
+{
+  for (auto [old_str, new_str] : {pair{"\\n", "\n"}, pair{"\\t", "\t"}}) {
+    size_t i = s.find(old_str);
+    while (i != string::npos) {
+      s.replace(i, 2, new_str);
+      i = s.find(old_str, i + 1);
+    }
+  }
+  return s;
+}
+
+
+RegCodeGenerator::RegCodeGenerator(VM& vm)
+  : vm(vm)
+{
+}
+
+
+/**
+ * Frees the temporaries of the previous statement. Temporaries start above the
+ * highest variable register used so far in the function, so they never overlap
+ * a variable in scope.
+ */
+void RegCodeGenerator::reset_temps()
+{
+  temp_base = var_table.high_water_mark();
+  next_temp = temp_base;
+}
+
+
+/**
+ * Allocates a new temporary register for the current statement.
+ *
+ * @return The register index.
+ */
+int RegCodeGenerator::new_temp()
+{
+  int reg = next_temp++;
+  curr_frame.register_count = max(curr_frame.register_count, next_temp);
+  return reg;
+}
+
+
+/**
+ * Generates the statements of a block, each starting with no temporaries.
+ *
+ * @param stmts The statements.
+ */
+void RegCodeGenerator::block(vector<shared_ptr<Stmt>>& stmts)
+{
+  for(auto& s : stmts)
+  {
+    reset_temps();
+    s->accept(*this);
+  }
+}
+
+
+/**
+ * Generates code for an expression (or term or rvalue).
+ *
+ * @param e The expression.
+ * @return The register holding the expression's value.
+ */
+int RegCodeGenerator::eval(ASTNode& e)
+{
+  e.accept(*this);
+  return curr_reg;
+}
+
+
+/**
+ * Copies the value of one register into another. A temporary computed by the
+ * last instruction is instead computed directly into the destination.
+ *
+ * @param dst The destination register.
+ * @param src The register holding the value.
+ */
+void RegCodeGenerator::move(int dst, int src)
+{
+  if(dst == src)
+  {
+    return;
+  }
+  vector<RegInstr>& instrs = curr_frame.instructions;
+  if(src >= temp_base && !instrs.empty() && instrs.back().has_dst() &&
+     instrs.back().a() == src)
+  {
+    instrs.back().set_a(dst);
+  }
+  else
+  {
+    instrs.push_back(RegInstr::MOV(dst, src));
+  }
+}
+
+
+/**
+ * Returns the index of a literal's constant in the current frame's constant
+ * pool, adding it to the pool if needed.
+ *
+ * @param token The literal's token (equal tokens share a constant).
+ * @param value The literal's value.
+ * @return The constant's index.
+ */
+int RegCodeGenerator::constant(const Token& token, const VMValue& value)
+{
+  string key = to_string(static_cast<int>(token.type())) + ":" + token.lexeme();
+  if(!constant_index.contains(key))
+  {
+    constant_index[key] = curr_frame.constants.size();
+    curr_frame.constants.push_back(value);
+  }
+  return constant_index[key];
+}
+
+
+/**
+ * Returns the offset of a field within a struct type, and updates the type to
+ * the field's type.
+ *
+ * @param type The struct type containing the field (set to the field's type).
+ * @param field_name The name of the field.
+ * @return The field's offset, or -1 if the type has no such field.
+ */
+int RegCodeGenerator::field_offset(DataType& type, const string& field_name)
+{
+  if(!type.is_array && struct_defs.contains(type.type_name))
+  {
+    const vector<VarDef>& fields = struct_defs[type.type_name].fields;
+    for(int i = 0; i < fields.size(); i++)
+    {
+      if(fields[i].var_name.lexeme() == field_name)
+      {
+        type = fields[i].data_type;
+        return i;
+      }
+    }
+  }
+  type = DataType();
+  return -1;
+}
+
+
+void RegCodeGenerator::visit(Program& p)
+{
+  for (auto& struct_def : p.struct_defs)
+    struct_def.accept(*this);
+  for (auto& fun_def : p.fun_defs)
+    fun_def.accept(*this);
+}
+
+
+/**
+ * Generates the register frame of a function definition and adds it to the
+ * virtual machine. The parameters are held in the first registers.
+ *
+ * @param f The function definition.
+ */
+void RegCodeGenerator::visit(FunDef& f)
+{
+  curr_frame = RegFrameInfo {f.fun_name.lexeme(), (int) f.params.size()};
+  constant_index.clear();
+  slot_types.clear();
+  var_table.reset_high_water_mark();
+  var_table.push_environment();
+  for(int i = 0; i < f.params.size(); i++)
+  {
+    var_table.add(f.params[i].var_name.lexeme());
+    slot_types[i] = f.params[i].data_type;
+  }
+  block(f.stmts);
+  if(curr_frame.instructions.empty() ||
+     curr_frame.instructions.back().opcode() != RegOpCode::RET)
+  {
+    reset_temps();
+    int reg = new_temp();
+    Token null_token(TokenType::NULL_VAL, "null", 0, 0);
+    curr_frame.instructions.push_back(RegInstr::LOADK(reg, constant(null_token, nullptr)));
+    curr_frame.instructions.push_back(RegInstr::RET(reg));
+  }
+  curr_frame.register_count = max(curr_frame.register_count, var_table.high_water_mark());
+  vm.add(curr_frame);
+  var_table.pop_environment();
+}
+
+
+/**
+ * Stores the struct definition (for field offsets) and adds the struct's
+ * layout to the virtual machine.
+ *
+ * @param s The struct definition.
+ */
+void RegCodeGenerator::visit(StructDef& s)
+{
+  struct_defs[s.struct_name.lexeme()] = s;
+  VMStructLayout layout {s.struct_name.lexeme()};
+  for(auto& field : s.fields)
+  {
+    layout.field_names.push_back(field.var_name.lexeme());
+  }
+  vm.add(layout);
+}
+
+
+void RegCodeGenerator::visit(ReturnStmt& s)
+{
+  curr_frame.instructions.push_back(RegInstr::RET(eval(s.expr)));
+}
+
+
+void RegCodeGenerator::visit(DeleteStructStmt& d)
+{
+  curr_frame.instructions.push_back(RegInstr::DELS(eval(d.expr)));
+}
+
+
+void RegCodeGenerator::visit(DeleteArrayStmt& d)
+{
+  curr_frame.instructions.push_back(RegInstr::DELAR(eval(d.expr)));
+}
+
+
+/**
+ * Generates code for a while loop (the JMPF exits to the instruction after the
+ * loop's closing JMP).
+ *
+ * @param s The while statement.
+ */
+void RegCodeGenerator::visit(WhileStmt& s)
+{
+  int start = curr_frame.instructions.size();
+  int cond = eval(s.condition);
+  int jmpf = curr_frame.instructions.size();
+  curr_frame.instructions.push_back(RegInstr::JMPF(cond, -1));
+  var_table.push_environment();
+  block(s.stmts);
+  var_table.pop_environment();
+  curr_frame.instructions.push_back(RegInstr::JMP(start));
+  curr_frame.instructions[jmpf].set_b(curr_frame.instructions.size());
+}
+
+
+/**
+ * Generates code for a for loop (the loop variable is scoped to the loop).
+ *
+ * @param s The for statement.
+ */
+void RegCodeGenerator::visit(ForStmt& s)
+{
+  var_table.push_environment();
+  reset_temps();
+  s.var_decl.accept(*this);
+  int start = curr_frame.instructions.size();
+  reset_temps();
+  int cond = eval(s.condition);
+  int jmpf = curr_frame.instructions.size();
+  curr_frame.instructions.push_back(RegInstr::JMPF(cond, -1));
+  var_table.push_environment();
+  block(s.stmts);
+  var_table.pop_environment();
+  reset_temps();
+  s.assign_stmt.accept(*this);
+  var_table.pop_environment();
+  curr_frame.instructions.push_back(RegInstr::JMP(start));
+  curr_frame.instructions[jmpf].set_b(curr_frame.instructions.size());
+}
+
+
+/**
+ * Generates code for an if statement. Each branch but the last ends with a
+ * JMP past the remaining branches.
+ *
+ * @param s The if statement.
+ */
+void RegCodeGenerator::visit(IfStmt& s)
+{
+  vector<BasicIf*> branches = {&s.if_part};
+  for(auto& e : s.else_ifs)
+  {
+    branches.push_back(&e);
+  }
+  vector<int> jmps;
+  for(int i = 0; i < branches.size(); i++)
+  {
+    reset_temps();
+    int cond = eval(branches[i]->condition);
+    int jmpf = curr_frame.instructions.size();
+    curr_frame.instructions.push_back(RegInstr::JMPF(cond, -1));
+    var_table.push_environment();
+    block(branches[i]->stmts);
+    var_table.pop_environment();
+    if(i + 1 < branches.size() || !s.else_stmts.empty())
+    {
+      jmps.push_back(curr_frame.instructions.size());
+      curr_frame.instructions.push_back(RegInstr::JMP(-1));
+    }
+    curr_frame.instructions[jmpf].set_b(curr_frame.instructions.size());
+  }
+  var_table.push_environment();
+  block(s.else_stmts);
+  var_table.pop_environment();
+  for(int jmp : jmps)
+  {
+    curr_frame.instructions[jmp].set_a(curr_frame.instructions.size());
+  }
+}
+
+
+/**
+ * Generates code for a variable declaration, computing the value directly into
+ * the variable's register where possible.
+ *
+ * @param s The variable declaration.
+ */
+void RegCodeGenerator::visit(VarDeclStmt& s)
+{
+  int value = eval(s.expr);
+  var_table.add(s.var_def.var_name.lexeme());
+  int reg = var_table.get(s.var_def.var_name.lexeme());
+  slot_types[reg] = s.var_def.data_type;
+  curr_frame.register_count = max(curr_frame.register_count, reg + 1);
+  move(reg, value);
+}
+
+
+/**
+ * Generates code for an assignment to a variable, struct field, or array
+ * element.
+ *
+ * @param s The assignment statement.
+ */
+void RegCodeGenerator::visit(AssignStmt& s)
+{
+  int reg = var_table.get(s.lvalue[0].var_name.lexeme());
+  if(s.lvalue.size() == 1 && !s.lvalue[0].array_expr.has_value())
+  {
+    move(reg, eval(s.expr));
+    return;
+  }
+  // the struct or array holding the assigned field or element
+  DataType type = slot_types[reg];
+  int offset = -1;
+  int index = -1;
+  for(int i = 0; i < s.lvalue.size(); i++)
+  {
+    VarRef& v = s.lvalue[i];
+    bool last = i + 1 == s.lvalue.size();
+    if(i != 0)
+    {
+      offset = field_offset(type, v.var_name.lexeme());
+      if(last && !v.array_expr.has_value())
+      {
+        break;
+      }
+      int field = new_temp();
+      curr_frame.instructions.push_back(RegInstr::GETF(field, reg, v.var_name.lexeme(), offset));
+      reg = field;
+    }
+    if(v.array_expr.has_value())
+    {
+      int i_reg = eval(v.array_expr.value());
+      if(last)
+      {
+        index = i_reg;
+        break;
+      }
+      int elem = new_temp();
+      curr_frame.instructions.push_back(RegInstr::GETI(elem, reg, i_reg));
+      reg = elem;
+      type.is_array = false;
+    }
+  }
+  int value = eval(s.expr);
+  if(index >= 0)
+  {
+    curr_frame.instructions.push_back(RegInstr::SETI(reg, index, value));
+  }
+  else
+  {
+    curr_frame.instructions.push_back(RegInstr::SETF(reg, s.lvalue.back().var_name.lexeme(), value, offset));
+  }
+}
+
+
+/**
+ * Generates code for a built-in or user-defined function call. The args of a
+ * user-defined function are computed into consecutive temporaries.
+ *
+ * @param e The call expression.
+ */
+void RegCodeGenerator::visit(CallExpr& e)
+{
+  string fun_name = e.fun_name.lexeme();
+  vector<RegInstr>& instrs = curr_frame.instructions;
+  if(fun_name == "print")
+  {
+    curr_reg = eval(e.args[0]);
+    instrs.push_back(RegInstr::WRITE(curr_reg));
+  }
+  else if(fun_name == "input")
+  {
+    curr_reg = new_temp();
+    instrs.push_back(RegInstr::READ(curr_reg));
+  }
+  else if(fun_name == "concat" || fun_name == "get")
+  {
+    int x = eval(e.args[0]);
+    int y = eval(e.args[1]);
+    curr_reg = new_temp();
+    if(fun_name == "concat")
+      instrs.push_back(RegInstr::CONCAT(curr_reg, x, y));
+    else
+      instrs.push_back(RegInstr::GETC(curr_reg, x, y));
+  }
+  else if(fun_name == "to_string" || fun_name == "to_int" || fun_name == "to_double" ||
+          fun_name == "length" || fun_name == "array_length")
+  {
+    int x = eval(e.args[0]);
+    curr_reg = new_temp();
+    if(fun_name == "to_string")
+      instrs.push_back(RegInstr::TOSTR(curr_reg, x));
+    else if(fun_name == "to_int")
+      instrs.push_back(RegInstr::TOINT(curr_reg, x));
+    else if(fun_name == "to_double")
+      instrs.push_back(RegInstr::TODBL(curr_reg, x));
+    else if(fun_name == "length")
+      instrs.push_back(RegInstr::SLEN(curr_reg, x));
+    else
+      instrs.push_back(RegInstr::ALEN(curr_reg, x));
+  }
+  else
+  {
+    int first = next_temp;
+    for(int i = 0; i < e.args.size(); i++)
+    {
+      new_temp();
+    }
+    for(int i = 0; i < e.args.size(); i++)
+    {
+      move(first + i, eval(e.args[i]));
+    }
+    curr_reg = new_temp();
+    instrs.push_back(RegInstr::CALL(curr_reg, fun_name, first, e.args.size()));
+  }
+}
+
+
+/**
+ * Generates code for an expression, computing each operator's result into a
+ * new temporary.
+ *
+ * @param e The expression.
+ */
+void RegCodeGenerator::visit(Expr& e)
+{
+  int x = eval(*e.first);
+  curr_reg = x;
+  if(e.op.has_value())
+  {
+    int y = eval(*e.rest);
+    string op = e.op.value().lexeme();
+    curr_reg = new_temp();
+    vector<RegInstr>& instrs = curr_frame.instructions;
+    if(op == "+")
+      instrs.push_back(RegInstr::ADD(curr_reg, x, y));
+    else if(op == "-")
+      instrs.push_back(RegInstr::SUB(curr_reg, x, y));
+    else if(op == "*")
+      instrs.push_back(RegInstr::MUL(curr_reg, x, y));
+    else if(op == "/")
+      instrs.push_back(RegInstr::DIV(curr_reg, x, y));
+    else if(op == "<")
+      instrs.push_back(RegInstr::CMPLT(curr_reg, x, y));
+    else if(op == "<=")
+      instrs.push_back(RegInstr::CMPLE(curr_reg, x, y));
+    else if(op == ">")
+      instrs.push_back(RegInstr::CMPGT(curr_reg, x, y));
+    else if(op == ">=")
+      instrs.push_back(RegInstr::CMPGE(curr_reg, x, y));
+    else if(op == "==")
+      instrs.push_back(RegInstr::CMPEQ(curr_reg, x, y));
+    else if(op == "!=")
+      instrs.push_back(RegInstr::CMPNE(curr_reg, x, y));
+    else if(op == "and")
+      instrs.push_back(RegInstr::AND(curr_reg, x, y));
+    else if(op == "or")
+      instrs.push_back(RegInstr::OR(curr_reg, x, y));
+  }
+  if(e.negated)
+  {
+    int x = curr_reg;
+    curr_reg = new_temp();
+    curr_frame.instructions.push_back(RegInstr::NOT(curr_reg, x));
+  }
+}
+
+
+void RegCodeGenerator::visit(SimpleTerm& t)
+{
+  t.rvalue->accept(*this);
+}
+
+
+void RegCodeGenerator::visit(ComplexTerm& t)
+{
+  t.expr.accept(*this);
+}
+
+
+/**
+ * Loads a literal from the frame's constant pool into a new temporary.
+ *
+ * @param v The literal.
+ */
+void RegCodeGenerator::visit(SimpleRValue& v)
+{
+  VMValue value;
+  if(v.value.type() == TokenType::INT_VAL)
+    value = stoi(v.value.lexeme());
+  else if(v.value.type() == TokenType::DOUBLE_VAL)
+    value = stod(v.value.lexeme());
+  else if(v.value.type() == TokenType::STRING_VAL || v.value.type() == TokenType::CHAR_VAL)
+    value = unescape(v.value.lexeme());
+  else if(v.value.type() == TokenType::BOOL_VAL)
+    value = v.value.lexeme() == "true";
+  curr_reg = new_temp();
+  curr_frame.instructions.push_back(RegInstr::LOADK(curr_reg, constant(v.value, value)));
+}
+
+
+/**
+ * Generates code for creating a new struct (with its layout's fields) or array
+ * (of nulls).
+ *
+ * @param v The new expression.
+ */
+void RegCodeGenerator::visit(NewRValue& v)
+{
+  if(v.array_expr.has_value())
+  {
+    int size = eval(v.array_expr.value());
+    curr_reg = new_temp();
+    curr_frame.instructions.push_back(RegInstr::ALLOCA(curr_reg, size));
+  }
+  else
+  {
+    curr_reg = new_temp();
+    curr_frame.instructions.push_back(RegInstr::ALLOCS(curr_reg, v.type.lexeme()));
+  }
+}
+
+
+/**
+ * Generates code for a variable's value (its own register) and accessing its
+ * fields (by offset) and array elements.
+ *
+ * @param v The variable reference.
+ */
+void RegCodeGenerator::visit(VarRValue& v)
+{
+  int reg = var_table.get(v.path[0].var_name.lexeme());
+  DataType type = slot_types[reg];
+  for(int i = 0; i < v.path.size(); i++)
+  {
+    VarRef& r = v.path[i];
+    string name = r.var_name.lexeme();
+    if(i != 0)
+    {
+      int field = new_temp();
+      curr_frame.instructions.push_back(RegInstr::GETF(field, reg, name, field_offset(type, name)));
+      reg = field;
+    }
+    if(r.array_expr.has_value())
+    {
+      int index = eval(r.array_expr.value());
+      int elem = new_temp();
+      curr_frame.instructions.push_back(RegInstr::GETI(elem, reg, index));
+      reg = elem;
+      type.is_array = false;
+    }
+  }
+  curr_reg = reg;
+}
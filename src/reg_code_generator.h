@@ -0,0 +1,87 @@
+//----------------------------------------------------------------------
+// FILE: reg_code_generator.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Interface for the register code generator visitor (generates
+// register frames, see reg_instr.h, instead of stack frames)
+//----------------------------------------------------------------------
+
+
+#ifndef REG_CODE_GENERATOR_H
+#define REG_CODE_GENERATOR_H
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.h"
+#include "var_table.h"
+#include "vm.h"
+
+
+class RegCodeGenerator : public Visitor {
+public:
+  RegCodeGenerator(VM& vm);
+  void visit(Program& p);
+  void visit(FunDef& f);
+  void visit(StructDef& s);
+  void visit(ReturnStmt& s);
+  void visit(WhileStmt& s);
+  void visit(ForStmt& s);
+  void visit(IfStmt& s);
+  void visit(VarDeclStmt& s);
+  void visit(AssignStmt& s);
+  void visit(CallExpr& e);
+  void visit(Expr& e);
+  void visit(SimpleTerm& t);
+  void visit(ComplexTerm& t);
+  void visit(SimpleRValue& v);
+  void visit(NewRValue& v);
+  void visit(VarRValue& v);
+  void visit(DeleteStructStmt& d);
+  void visit(DeleteArrayStmt& d);
+
+private:
+
+  VM& vm;
+  RegFrameInfo curr_frame;
+  VarTable var_table;
+  std::unordered_map<std::string,StructDef> struct_defs;
+  // declared types of the variables in each register
+  std::unordered_map<int,DataType> slot_types;
+  // indexes of the constants in the current frame's pool (by token)
+  std::unordered_map<std::string,int> constant_index;
+
+  // the register holding the value of the last visited expression
+  int curr_reg = -1;
+
+  // temporaries of the current statement are allocated upward from
+  // temp_base, above every variable register used so far
+  int temp_base = 0;
+  int next_temp = 0;
+
+  // helper to start a statement (freeing the temporaries)
+  void reset_temps();
+
+  // helper to allocate a temporary register
+  int new_temp();
+
+  // helper to generate the statements of a block
+  void block(std::vector<std::shared_ptr<Stmt>>& stmts);
+
+  // helper to evaluate an expression, returning its register
+  int eval(ASTNode& e);
+
+  // helper to copy a value into a register (retargeting the
+  // instruction that computed it when the value is a temporary)
+  void move(int dst, int src);
+
+  // helper to get the pool index of a constant (adding it)
+  int constant(const Token& token, const VMValue& value);
+
+  // helper to get a struct field's offset (updating type to the field's type)
+  int field_offset(DataType& type, const std::string& field_name);
+
+};
+
+#endif
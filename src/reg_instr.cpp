@@ -0,0 +1,356 @@
+//----------------------------------------------------------------------
+// FILE: reg_instr.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: MyPL register VM instructions
+//----------------------------------------------------------------------
+
+
+#include <unordered_map>
+#include "vm_instr.h"
+#include "reg_instr.h"
+
+using namespace std;
+
+
+RegInstr::RegInstr(RegOpCode opcode, int a, int b, int c)
+  : instr_opcode(opcode), instr_a(a), instr_b(b), instr_c(c)
+{}
+
+
+RegOpCode RegInstr::opcode() const
+{
+  return instr_opcode;
+}
+
+
+int RegInstr::a() const
+{
+  return instr_a;
+}
+
+
+int RegInstr::b() const
+{
+  return instr_b;
+}
+
+
+int RegInstr::c() const
+{
+  return instr_c;
+}
+
+
+void RegInstr::set_a(int value)
+{
+  instr_a = value;
+}
+
+
+void RegInstr::set_b(int value)
+{
+  instr_b = value;
+}
+
+
+bool RegInstr::has_dst() const
+{
+  switch (instr_opcode) {
+  case RegOpCode::JMP: case RegOpCode::JMPF: case RegOpCode::RET:
+  case RegOpCode::WRITE: case RegOpCode::SETF: case RegOpCode::SETI:
+  case RegOpCode::DELS: case RegOpCode::DELAR: case RegOpCode::NOP:
+    return false;
+  default:
+    return true;
+  }
+}
+
+
+const std::optional<VMValue>& RegInstr::operand() const
+{
+  return instr_operand;
+}
+
+
+int RegInstr::resolved() const
+{
+  return instr_resolved;
+}
+
+
+void RegInstr::set_resolved(int value)
+{
+  instr_resolved = value;
+}
+
+
+//----------------------------------------------------------------------
+// Static creation functions
+//----------------------------------------------------------------------
+
+RegInstr RegInstr::MOV(int dst, int src)
+{
+  return RegInstr(RegOpCode::MOV, dst, src);
+}
+
+RegInstr RegInstr::LOADK(int dst, int constant_index)
+{
+  return RegInstr(RegOpCode::LOADK, dst, constant_index);
+}
+
+RegInstr RegInstr::ADD(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::ADD, dst, x, y);
+}
+
+RegInstr RegInstr::SUB(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::SUB, dst, x, y);
+}
+
+RegInstr RegInstr::MUL(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::MUL, dst, x, y);
+}
+
+RegInstr RegInstr::DIV(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::DIV, dst, x, y);
+}
+
+RegInstr RegInstr::AND(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::AND, dst, x, y);
+}
+
+RegInstr RegInstr::OR(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::OR, dst, x, y);
+}
+
+RegInstr RegInstr::NOT(int dst, int x)
+{
+  return RegInstr(RegOpCode::NOT, dst, x);
+}
+
+RegInstr RegInstr::CMPLT(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPLT, dst, x, y);
+}
+
+RegInstr RegInstr::CMPLE(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPLE, dst, x, y);
+}
+
+RegInstr RegInstr::CMPGT(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPGT, dst, x, y);
+}
+
+RegInstr RegInstr::CMPGE(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPGE, dst, x, y);
+}
+
+RegInstr RegInstr::CMPEQ(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPEQ, dst, x, y);
+}
+
+RegInstr RegInstr::CMPNE(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CMPNE, dst, x, y);
+}
+
+RegInstr RegInstr::JMP(int instruction_index)
+{
+  return RegInstr(RegOpCode::JMP, instruction_index);
+}
+
+RegInstr RegInstr::JMPF(int x, int instruction_index)
+{
+  return RegInstr(RegOpCode::JMPF, x, instruction_index);
+}
+
+RegInstr RegInstr::CALL(int dst, const string& function, int first_arg,
+                        int arg_count)
+{
+  RegInstr instr(RegOpCode::CALL, dst, first_arg, arg_count);
+  instr.instr_operand = function;
+  return instr;
+}
+
+RegInstr RegInstr::RET(int x)
+{
+  return RegInstr(RegOpCode::RET, x);
+}
+
+RegInstr RegInstr::WRITE(int x)
+{
+  return RegInstr(RegOpCode::WRITE, x);
+}
+
+RegInstr RegInstr::READ(int dst)
+{
+  return RegInstr(RegOpCode::READ, dst);
+}
+
+RegInstr RegInstr::SLEN(int dst, int x)
+{
+  return RegInstr(RegOpCode::SLEN, dst, x);
+}
+
+RegInstr RegInstr::ALEN(int dst, int x)
+{
+  return RegInstr(RegOpCode::ALEN, dst, x);
+}
+
+RegInstr RegInstr::GETC(int dst, int index, int str)
+{
+  return RegInstr(RegOpCode::GETC, dst, index, str);
+}
+
+RegInstr RegInstr::TOINT(int dst, int x)
+{
+  return RegInstr(RegOpCode::TOINT, dst, x);
+}
+
+RegInstr RegInstr::TODBL(int dst, int x)
+{
+  return RegInstr(RegOpCode::TODBL, dst, x);
+}
+
+RegInstr RegInstr::TOSTR(int dst, int x)
+{
+  return RegInstr(RegOpCode::TOSTR, dst, x);
+}
+
+RegInstr RegInstr::CONCAT(int dst, int x, int y)
+{
+  return RegInstr(RegOpCode::CONCAT, dst, x, y);
+}
+
+RegInstr RegInstr::ALLOCS(int dst, const string& struct_name)
+{
+  RegInstr instr(RegOpCode::ALLOCS, dst);
+  instr.instr_operand = struct_name;
+  return instr;
+}
+
+RegInstr RegInstr::ALLOCA(int dst, int size)
+{
+  return RegInstr(RegOpCode::ALLOCA, dst, size);
+}
+
+RegInstr RegInstr::GETF(int dst, int obj, const string& field, int offset)
+{
+  RegInstr instr(RegOpCode::GETF, dst, obj);
+  instr.instr_operand = field;
+  instr.instr_resolved = offset;
+  return instr;
+}
+
+RegInstr RegInstr::SETF(int obj, const string& field, int x, int offset)
+{
+  RegInstr instr(RegOpCode::SETF, obj, x);
+  instr.instr_operand = field;
+  instr.instr_resolved = offset;
+  return instr;
+}
+
+RegInstr RegInstr::GETI(int dst, int array, int index)
+{
+  return RegInstr(RegOpCode::GETI, dst, array, index);
+}
+
+RegInstr RegInstr::SETI(int array, int index, int x)
+{
+  return RegInstr(RegOpCode::SETI, array, index, x);
+}
+
+RegInstr RegInstr::DELS(int x)
+{
+  return RegInstr(RegOpCode::DELS, x);
+}
+
+RegInstr RegInstr::DELAR(int x)
+{
+  return RegInstr(RegOpCode::DELAR, x);
+}
+
+RegInstr RegInstr::NOP()
+{
+  return RegInstr(RegOpCode::NOP);
+}
+
+
+//----------------------------------------------------------------------
+// Printing
+//----------------------------------------------------------------------
+
+std::string to_string(RegOpCode op)
+{
+  static const std::unordered_map<RegOpCode, string> os = {
+    {RegOpCode::MOV, "MOV"}, {RegOpCode::LOADK, "LOADK"},
+    {RegOpCode::ADD, "ADD"}, {RegOpCode::SUB, "SUB"},
+    {RegOpCode::MUL, "MUL"}, {RegOpCode::DIV, "DIV"},
+    {RegOpCode::AND, "AND"}, {RegOpCode::OR, "OR"},
+    {RegOpCode::NOT, "NOT"}, {RegOpCode::CMPLT, "CMPLT"},
+    {RegOpCode::CMPLE, "CMPLE"}, {RegOpCode::CMPGT, "CMPGT"},
+    {RegOpCode::CMPGE, "CMPGE"}, {RegOpCode::CMPEQ, "CMPEQ"},
+    {RegOpCode::CMPNE, "CMPNE"}, {RegOpCode::JMP, "JMP"},
+    {RegOpCode::JMPF, "JMPF"}, {RegOpCode::CALL, "CALL"},
+    {RegOpCode::RET, "RET"}, {RegOpCode::WRITE, "WRITE"},
+    {RegOpCode::READ, "READ"}, {RegOpCode::SLEN, "SLEN"},
+    {RegOpCode::ALEN, "ALEN"}, {RegOpCode::GETC, "GETC"},
+    {RegOpCode::TOINT, "TOINT"}, {RegOpCode::TODBL, "TODBL"},
+    {RegOpCode::TOSTR, "TOSTR"}, {RegOpCode::CONCAT, "CONCAT"},
+    {RegOpCode::ALLOCS, "ALLOCS"}, {RegOpCode::ALLOCA, "ALLOCA"},
+    {RegOpCode::GETF, "GETF"}, {RegOpCode::SETF, "SETF"},
+    {RegOpCode::GETI, "GETI"}, {RegOpCode::SETI, "SETI"},
+    {RegOpCode::DELS, "DELS"}, {RegOpCode::DELAR, "DELAR"},
+    {RegOpCode::NOP, "NOP"}
+  };
+  return os.at(op);
+}
+
+
+std::string to_string(const RegInstr& instr)
+{
+  auto r = [](int i) {return "r" + to_string(i);};
+  string name = "";
+  if (instr.instr_operand.has_value())
+    name = to_string(instr.instr_operand.value());
+  string args;
+  switch (instr.instr_opcode) {
+  case RegOpCode::LOADK:
+    args = r(instr.instr_a) + ", k" + to_string(instr.instr_b);
+    break;
+  case RegOpCode::JMP:
+    args = to_string(instr.instr_a);
+    break;
+  case RegOpCode::JMPF:
+    args = r(instr.instr_a) + ", " + to_string(instr.instr_b);
+    break;
+  case RegOpCode::CALL:
+    args = r(instr.instr_a) + ", " + name + ", " + r(instr.instr_b) + ", " +
+      to_string(instr.instr_c);
+    break;
+  case RegOpCode::ALLOCS:
+    args = r(instr.instr_a) + ", " + name;
+    break;
+  case RegOpCode::GETF:
+    args = r(instr.instr_a) + ", " + r(instr.instr_b) + ", " + name;
+    break;
+  case RegOpCode::SETF:
+    args = r(instr.instr_a) + ", " + name + ", " + r(instr.instr_b);
+    break;
+  default:
+    for (int x : {instr.instr_a, instr.instr_b, instr.instr_c})
+      if (x >= 0)
+        args += (args.empty() ? "" : ", ") + r(x);
+  }
+  return to_string(instr.instr_opcode) + "(" + args + ")";
+}
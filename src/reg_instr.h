@@ -0,0 +1,177 @@
+//----------------------------------------------------------------------
+// FILE: reg_instr.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: MyPL register VM instructions (an alternative to the stack
+// instructions of vm_instr.h)
+//----------------------------------------------------------------------
+
+
+#ifndef REG_INSTR_H
+#define REG_INSTR_H
+
+#include <optional>
+#include <string>
+#include "vm_value.h"
+
+
+// Register instructions name their operands by register (a slot of
+// the function's register window, with the parameters in the first
+// registers followed by the local variables and then temporaries)
+// instead of popping them off of an operand stack. The a, b, and c
+// operands below are register indexes unless noted otherwise.
+enum class RegOpCode {
+
+  // moves
+  MOV,          // r[a] = r[b]
+  LOADK,        // r[a] = constant b of the frame's constant pool
+
+  // operations
+  ADD,          // r[a] = r[b] + r[c]
+  SUB,          // r[a] = r[b] - r[c]
+  MUL,          // r[a] = r[b] * r[c]
+  DIV,          // r[a] = r[b] / r[c]
+  AND,          // r[a] = r[b] and r[c]
+  OR,           // r[a] = r[b] or r[c]
+  NOT,          // r[a] = not r[b]
+  CMPLT,        // r[a] = r[b] < r[c]
+  CMPLE,        // r[a] = r[b] <= r[c]
+  CMPGT,        // r[a] = r[b] > r[c]
+  CMPGE,        // r[a] = r[b] >= r[c]
+  CMPEQ,        // r[a] = r[b] == r[c]
+  CMPNE,        // r[a] = r[b] != r[c]
+
+  // jump
+  JMP,          // jump to instruction a
+  JMPF,         // if r[a] is false jump to instruction b
+
+  // functions
+  CALL,         // [operand] r[a] = v(r[b], ..., r[b+c-1])
+  RET,          // return r[a]
+
+  // built-ins
+  WRITE,        // write r[a] to stdout
+  READ,         // r[a] = line read from stdin
+  SLEN,         // r[a] = size of string r[b]
+  ALEN,         // r[a] = length of array r[b]
+  GETC,         // r[a] = character r[b] of string r[c]
+  TOINT,        // r[a] = r[b] as an integer
+  TODBL,        // r[a] = r[b] as a double
+  TOSTR,        // r[a] = r[b] as a string
+  CONCAT,       // r[a] = r[b] + r[c] (in place if a is b)
+
+  // heap
+  ALLOCS,       // [operand] r[a] = new struct v (with its layout's fields)
+  ALLOCA,       // r[a] = new array of r[b] nulls
+  GETF,         // [operand] r[a] = field v of struct r[b]
+  SETF,         // [operand] field v of struct r[a] = r[b]
+  GETI,         // r[a] = element r[c] of array r[b]
+  SETI,         // element r[b] of array r[a] = r[c]
+  DELS,         // delete struct r[a]
+  DELAR,        // delete array r[a]
+
+  NOP           // has no effect (for jumping over code segments)
+
+};
+
+// function to get the name of a register opcode
+std::string to_string(RegOpCode op);
+
+
+class RegInstr
+{
+public:
+
+  // static creation functions for the various types of instructions
+  static RegInstr MOV(int dst, int src);
+  static RegInstr LOADK(int dst, int constant_index);
+  static RegInstr ADD(int dst, int x, int y);
+  static RegInstr SUB(int dst, int x, int y);
+  static RegInstr MUL(int dst, int x, int y);
+  static RegInstr DIV(int dst, int x, int y);
+  static RegInstr AND(int dst, int x, int y);
+  static RegInstr OR(int dst, int x, int y);
+  static RegInstr NOT(int dst, int x);
+  static RegInstr CMPLT(int dst, int x, int y);
+  static RegInstr CMPLE(int dst, int x, int y);
+  static RegInstr CMPGT(int dst, int x, int y);
+  static RegInstr CMPGE(int dst, int x, int y);
+  static RegInstr CMPEQ(int dst, int x, int y);
+  static RegInstr CMPNE(int dst, int x, int y);
+  static RegInstr JMP(int instruction_index);
+  static RegInstr JMPF(int x, int instruction_index);
+  static RegInstr CALL(int dst, const std::string& function, int first_arg,
+                       int arg_count);
+  static RegInstr RET(int x);
+  static RegInstr WRITE(int x);
+  static RegInstr READ(int dst);
+  static RegInstr SLEN(int dst, int x);
+  static RegInstr ALEN(int dst, int x);
+  static RegInstr GETC(int dst, int index, int str);
+  static RegInstr TOINT(int dst, int x);
+  static RegInstr TODBL(int dst, int x);
+  static RegInstr TOSTR(int dst, int x);
+  static RegInstr CONCAT(int dst, int x, int y);
+  static RegInstr ALLOCS(int dst, const std::string& struct_name);
+  static RegInstr ALLOCA(int dst, int size);
+  static RegInstr GETF(int dst, int obj, const std::string& field,
+                       int offset = -1);
+  static RegInstr SETF(int obj, const std::string& field, int x,
+                       int offset = -1);
+  static RegInstr GETI(int dst, int array, int index);
+  static RegInstr SETI(int array, int index, int x);
+  static RegInstr DELS(int x);
+  static RegInstr DELAR(int x);
+  static RegInstr NOP();
+
+  // returns the instruction's opcode
+  RegOpCode opcode() const;
+
+  // returns the instruction's a, b, and c operands (-1 if unused)
+  int a() const;
+  int b() const;
+  int c() const;
+
+  // set the a or b operand (e.g., to patch a jump target)
+  void set_a(int value);
+  void set_b(int value);
+
+  // true if the instruction stores a result in register a
+  bool has_dst() const;
+
+  // returns the name operand for those instructions with one
+  const std::optional<VMValue>& operand() const;
+
+  // returns the resolved (integer) form of the operand, e.g., the
+  // function index of a CALL, or -1 if the operand is not resolved
+  int resolved() const;
+
+  // set the resolved form of the operand
+  void set_resolved(int value);
+
+  // pretty print the instruction
+  friend std::string to_string(const RegInstr& instr);
+
+private:
+
+  // each instruction has an opcode
+  RegOpCode instr_opcode;
+
+  // register (or instruction or constant) operands
+  int instr_a = -1;
+  int instr_b = -1;
+  int instr_c = -1;
+
+  // function, struct, or field name (for CALL, ALLOCS, GETF, and SETF)
+  std::optional<VMValue> instr_operand;
+
+  // resolved form of the name operand
+  int instr_resolved = -1;
+
+  // helper for use by static construction methods
+  RegInstr(RegOpCode opcode, int a = -1, int b = -1, int c = -1);
+
+};
+
+
+#endif
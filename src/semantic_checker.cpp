@@ -615,7 +615,7 @@ void SemanticChecker::visit(Expr& e)
       curr_type.type_name = "bool";
     }
   }
-
+  e.type = curr_type;
 }
 
 
@@ -5,6 +5,7 @@
 // DESC: Var table implementation
 //----------------------------------------------------------------------
 
+#include <algorithm>
 #include "var_table.h"
 
 
@@ -34,8 +35,10 @@ bool VarTable::empty() const
 
 void VarTable::add(const string& name)
 {
-  if (!empty())
+  if (!empty()) {
     environments.back()[name] = next_index++;
+    max_index = max(max_index, next_index);
+  }
 }
 
 
@@ -49,6 +52,18 @@ int VarTable::get(const string& name) const
 }
 
 
+int VarTable::high_water_mark() const
+{
+  return max_index;
+}
+
+
+void VarTable::reset_high_water_mark()
+{
+  max_index = next_index;
+}
+
+
 string to_string(const VarTable& var_table)
 {
   string str = "";
@@ -32,6 +32,13 @@ public:
   // return index for most recent name (or -1 if the name doesn't exist)
   int get(const std::string& name) const;
 
+  // return the largest number of variables in scope at once since
+  // the last reset (i.e., the number of slots needed to hold them)
+  int high_water_mark() const;
+
+  // restart tracking the high-water mark from the current size
+  void reset_high_water_mark();
+
   // pretty print the table for debugging
   friend std::string to_string(const VarTable& var_table);
 
@@ -41,6 +48,9 @@ private:
   std::vector<std::unordered_map<std::string,int>> environments;
 
   int next_index = 0;
+
+  // largest next_index value since the last reset
+  int max_index = 0;
   
 };
 
@@ -5,8 +5,11 @@
 // DESC: 
 //----------------------------------------------------------------------
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include "vm.h"
+#include "vm_optimizer.h"
 #include "mypl_exception.h"
 
 
@@ -21,11 +24,18 @@ void VM::error(string msg) const
 
 void VM::error(string msg, const VMFrame& frame) const
 {
-  int pc = frame.pc - 1;
-  VMInstr instr = frame.info.instructions[pc];
-  string name = frame.info.function_name;
-  msg += " (in " + name + " at " + to_string(pc) + ": " +
+  error(msg, *frame.info, frame.pc - 1);
+}
+
+
+void VM::error(string msg, const VMFrameInfo& info, int pc) const
+{
+  const VMInstr& instr = info.instructions[pc];
+  msg += " (in " + info.function_name + " at " + to_string(pc) + ": " +
     to_string(instr) + ")";
+  if (const VMLineEntry* pos = source_position(info, pc))
+    msg += " at line " + to_string(pos->line) + ", column " +
+      to_string(pos->column);
   throw MyPLException::VMError(msg);
 }
 
@@ -33,698 +43,1518 @@ void VM::error(string msg, const VMFrame& frame) const
 string to_string(const VM& vm)
 {
   string s = "";
-  for (const auto& entry : vm.frame_info) {
-    const string& name = entry.first;
-    s += "\nFrame '" + name + "'\n";
-    const VMFrameInfo& frame = entry.second;
+  for (const VMStructLayout& layout : vm.struct_layouts) {
+    s += "\nStruct '" + layout.struct_name + "'\n";
+    for (int i = 0; i < layout.field_names.size(); ++i)
+      s += "  " + to_string(i) + ": " + layout.field_names[i] + "\n";
+  }
+  for (const VMFrameInfo& frame : vm.frame_info) {
+    s += "\nFrame '" + frame.function_name + "'\n";
+    for (int i = 0; i < frame.constants.size(); ++i)
+      s += "  k" + to_string(i) + ": " + to_string(frame.constants[i]) + "\n";
     for (int i = 0; i < frame.instructions.size(); ++i) {
-      VMInstr instr = frame.instructions[i];
+      const VMInstr& instr = frame.instructions[i];
       s += "  " + to_string(i) + ": " + to_string(instr) + "\n"; 
     }
   }
+  for (const RegFrameInfo& frame : vm.reg_frame_info) {
+    s += "\nRegister frame '" + frame.function_name + "' (" +
+      to_string(frame.register_count) + " registers)\n";
+    for (int i = 0; i < frame.constants.size(); ++i)
+      s += "  k" + to_string(i) + ": " + to_string(frame.constants[i]) + "\n";
+    for (int i = 0; i < frame.instructions.size(); ++i)
+      s += "  " + to_string(i) + ": " + to_string(frame.instructions[i]) + "\n";
+  }
   return s;
 }
 
 
 void VM::add(const VMFrameInfo& frame)
 {
-  frame_info[frame.function_name] = frame;
+  if (!function_index.contains(frame.function_name)) {
+    function_index[frame.function_name] = frame_info.size();
+    frame_info.push_back(frame);
+  }
+  else
+    frame_info[function_index[frame.function_name]] = frame;
+  linked = false;
+  VMFrameInfo& info = frame_info[function_index[frame.function_name]];
+  intern(info.constants);
+  verify(info);
+}
+
+
+void VM::intern(vector<VMValue>& constants)
+{
+  // share each string constant with every equal one (so they can be
+  // compared by pointer)
+  for (VMValue& constant : constants) {
+    if (!constant.is_string())
+      continue;
+    auto it = interned_strings.find(constant.as_string());
+    if (it == interned_strings.end())
+      interned_strings.emplace(constant.as_string(), constant);
+    else
+      constant = it->second;
+  }
+}
+
+
+void VM::verify(VMFrameInfo& info) const
+{
+  int size = info.instructions.size();
+  // frames built without a local count (e.g., by hand) are sized from
+  // their highest LOAD/STORE index (params occupy the first slots)
+  if (info.local_count == 0) {
+    for (const VMInstr& instr : info.instructions) {
+      OpCode op = instr.opcode();
+      if ((op == OpCode::LOAD or op == OpCode::STORE) and
+          instr.operand().has_value() and instr.operand()->is_int())
+        info.local_count = max(info.local_count, instr.operand()->as_int() + 1);
+    }
+  }
+  info.local_count = max(info.local_count, info.arg_count);
+  // the run loop relies on the following without checking them
+  for (int i = 0; i < size; ++i) {
+    const VMInstr& instr = info.instructions[i];
+    OpCode op = instr.opcode();
+    const optional<VMValue>& operand = instr.operand();
+    if (op == OpCode::LOAD or op == OpCode::STORE) {
+      if (!operand.has_value() or !operand->is_int() or
+          operand->as_int() < 0 or operand->as_int() >= info.local_count)
+        error("invalid variable index", info, i);
+    }
+    else if (op == OpCode::PUSHK) {
+      if (instr.resolved() < 0 or instr.resolved() >= info.constants.size())
+        error("invalid constant index", info, i);
+    }
+    else if (op == OpCode::JMP or op == OpCode::JMPF) {
+      if (!operand.has_value() or !operand->is_int() or
+          operand->as_int() < 0 or operand->as_int() > size)
+        error("invalid jump target", info, i);
+    }
+  }
+}
+
+
+void VM::verify_stack(const VMFrameInfo& info,
+                      const unordered_map<string,int>& arg_counts) const
+{
+  const vector<VMInstr>& instrs = info.instructions;
+  int size = instrs.size();
+  // the operand stack depth before each instruction (-1 if not yet
+  // reached), starting with the args (running off the end of a frame
+  // ends the run)
+  vector<int> depth(size, -1);
+  vector<int> work;
+  auto reach = [&](int from, int target, int d) {
+    if (target == size)
+      return;
+    if (depth[target] == -1) {
+      depth[target] = d;
+      work.push_back(target);
+    }
+    else if (depth[target] != d)
+      error("inconsistent stack depth", info, from);
+  };
+  if (size > 0)
+    reach(0, 0, info.arg_count);
+  while (!work.empty()) {
+    int i = work.back();
+    work.pop_back();
+    const VMInstr& instr = instrs[i];
+    OpCode op = instr.opcode();
+    int pops = 0;
+    int pushes = 0;
+    if (op == OpCode::CALL or op == OpCode::TAILCALL) {
+      const string& name = instr.operand().value().as_string();
+      if (!arg_counts.contains(name))
+        error("undefined function '" + name + "'", info, i);
+      pops = arg_counts.at(name);
+      pushes = 1;
+    }
+    else if (op == OpCode::RET)
+      pops = 1;
+    else if (!stack_effect(op, pops, pushes))
+      error("invalid instruction", info, i);
+    if (depth[i] < pops)
+      error("stack underflow", info, i);
+    int d = depth[i] - pops + pushes;
+    if (op == OpCode::JMP or op == OpCode::JMPF)
+      reach(i, instr.operand()->as_int(), d);
+    if (op != OpCode::JMP and op != OpCode::RET and op != OpCode::TAILCALL)
+      reach(i, i + 1, d);
+  }
+}
+
+
+void VM::link()
+{
+  // resolve each CALL (and TAILCALL) to the index of its function and
+  // each ALLOCS of a named struct to the index of its layout
+  for (VMFrameInfo& info : frame_info) {
+    if (superinstructions)
+      fuse_superinstructions(info);
+    else
+      unfuse_superinstructions(info);
+    for (int i = 0; i < info.instructions.size(); ++i) {
+      VMInstr& instr = info.instructions[i];
+      if (instr.opcode() == OpCode::CALL or
+          instr.opcode() == OpCode::TAILCALL) {
+        const string& fun_name = instr.operand().value().as_string();
+        if (!function_index.contains(fun_name))
+          error("undefined function '" + fun_name + "'", info, i);
+        instr.set_resolved(function_index.at(fun_name));
+      }
+      else if (instr.opcode() == OpCode::ALLOCS and instr.operand()) {
+        const string& struct_name = instr.operand().value().as_string();
+        if (!struct_index.contains(struct_name))
+          error("undefined struct '" + struct_name + "'", info, i);
+        instr.set_resolved(struct_index.at(struct_name));
+      }
+    }
+  }
+  unordered_map<string,int> arg_counts;
+  for (const VMFrameInfo& info : frame_info)
+    arg_counts[info.function_name] = info.arg_count;
+  for (const VMFrameInfo& info : frame_info)
+    verify_stack(info, arg_counts);
+  linked = true;
+}
+
+
+void VM::add(const VMStructLayout& layout)
+{
+  if (!struct_index.contains(layout.struct_name)) {
+    struct_index[layout.struct_name] = struct_layouts.size();
+    struct_layouts.push_back(layout);
+  }
+  else
+    struct_layouts[struct_index[layout.struct_name]] = layout;
+  linked = false;
+}
+
+
+int VM::field_offset(const VMObject& obj, const string& field_name) const
+{
+  const vector<string>& names =
+    obj.layout >= 0 ? struct_layouts[obj.layout].field_names : obj.names;
+  for (int i = 0; i < names.size(); ++i)
+    if (names[i] == field_name)
+      return i;
+  return -1;
+}
+
+
+void VM::set_superinstructions(bool enabled)
+{
+  superinstructions = enabled;
+  linked = false;
+}
+
+
+void VM::set_quickening(bool enabled)
+{
+  // relinking resets any quickened instructions
+  quickening = enabled;
+  linked = false;
+}
+
+
+void VM::set_jit(bool enabled)
+{
+  jit = enabled;
+}
+
+
+void VM::set_jit_threshold(int threshold)
+{
+  jit_threshold = threshold;
+}
+
+
+void VM::set_jit_defaults(bool enabled, int threshold)
+{
+  default_jit = enabled;
+  default_jit_threshold = threshold;
+}
+
+
+int VM::jit_compiled_count() const
+{
+  return jit_compiler.compiled_count();
+}
+
+
+void VM::set_profiling(bool enabled)
+{
+  if (!enabled)
+    profiler.reset();
+  else if (!profiler)
+    profiler = make_unique<VMProfiler>();
+}
+
+
+const VMProfiler* VM::profile() const
+{
+  return profiler.get();
+}
+
+
+void VM::set_sampling(int hz)
+{
+  if (hz <= 0)
+    sampler.reset();
+  else
+    sampler = make_unique<VMSampler>(hz);
+}
+
+
+const VMSampler* VM::samples() const
+{
+  return sampler.get();
+}
+
+
+void VM::run_native(VMFrame& frame)
+{
+  VMFrameInfo& info = *frame.info;
+  if (!info.native) {
+    // each frame is compiled at most once, when it first gets hot
+    if (info.hotness > jit_threshold or ++info.hotness <= jit_threshold)
+      return;
+    info.native = jit_compiler.compile(info);
+    if (!info.native)
+      return;
+  }
+  VMValue* top = value_stack.data() + sp;
+  frame.pc = info.native(value_stack.data() + frame.bp, &top, frame.pc,
+                         value_stack.data() + max_stack_size);
+  sp = top - value_stack.data();
+}
+
+
+void VM::set_max_stack_size(int size)
+{
+  max_stack_size = size;
+}
+
+
+void VM::set_max_call_depth(int depth)
+{
+  max_call_depth = depth;
+}
+
+
+void VM::set_gc_threshold(size_t bytes)
+{
+  heap.set_gc_threshold(bytes);
+}
+
+
+const VMGCStats& VM::gc_stats() const
+{
+  return heap.gc_stats();
+}
+
+
+void VM::collect_garbage()
+{
+  // the locals and operands of every active frame are the only roots
+  heap.collect(value_stack.data(), sp);
+}
+
+
+void VM::push(const VMValue& x)
+{
+  if (sp == max_stack_size)
+    error("stack overflow", call_stack[call_depth - 1]);
+  value_stack[sp++] = x;
+}
+
+
+void VM::push(VMValue&& x)
+{
+  if (sp == max_stack_size)
+    error("stack overflow", call_stack[call_depth - 1]);
+  value_stack[sp++] = std::move(x);
+}
+
+
+VMValue VM::pop()
+{
+  return std::move(value_stack[--sp]);
+}
+
+
+VMFrame& VM::push_frame(VMFrameInfo& info)
+{
+  // frames are only allocated when the call stack grows past its
+  // previous maximum depth
+  if (call_depth == (int) call_stack.size()) {
+    call_stack_growing = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    call_stack.emplace_back();
+    atomic_signal_fence(memory_order_seq_cst);
+    call_stack_growing = 0;
+  }
+  // the frame is set before it becomes active (for the sampler)
+  VMFrame& frame = call_stack[call_depth];
+  frame.info = &info;
+  frame.pc = 0;
+  frame.bp = 0;
+  atomic_signal_fence(memory_order_release);
+  ++call_depth;
+  return frame;
+}
+
+
+//----------------------------------------------------------------------
+// Instruction dispatch
+//
+// The handler bodies in VM::run are written once and wrapped in the
+// macros below so the same loop can be built with one of three
+// dispatch engines (selected with MYPL_DISPATCH in CMakeLists.txt):
+//
+//   threaded: GCC/Clang computed goto, each handler jumps to the
+//             next handler through a label table
+//   switch:   a dense switch over the opcode
+//   legacy:   the original if/else-if chain (kept for A/B timing)
+//----------------------------------------------------------------------
+
+#if defined(MYPL_DISPATCH_THREADED) && defined(__GNUC__)
+#define MYPL_USE_THREADED
+#endif
+
+// fetch the next instruction of the current frame (or stop running)
+#define FETCH()                                                         \
+  if (call_depth == 0 or                                                \
+      frame->pc >= (int) frame->info->instructions.size())              \
+    goto done;                                                          \
+  instr = &frame->info->instructions[frame->pc];                        \
+  ++frame->pc;                                                          \
+  if (tracing)                                                          \
+    trace(*frame, *instr, DEBUG);
+
+#if defined(MYPL_USE_THREADED)
+
+// handlers leave their block with a plain goto to the shared fetch
+// (a computed goto out of a block does not run the destructors of the
+// block's locals, e.g., popped string values)
+#define LABEL(op) labels[static_cast<int>(OpCode::op)] = &&L_##op;
+#define DISPATCH_NEXT next_instr:
+#define DISPATCH_BEGIN goto *labels[static_cast<int>(instr->exec_opcode())];
+#define CASE(op) L_##op:
+#define NEXT goto next_instr
+#define DISPATCH_DEFAULT L_UNSUPPORTED:
+#define DISPATCH_END
+
+#elif defined(MYPL_DISPATCH_LEGACY)
+
+#define DISPATCH_NEXT
+#define DISPATCH_BEGIN if (false) {}
+#define CASE(op) else if (instr->exec_opcode() == OpCode::op)
+#define NEXT continue
+#define DISPATCH_DEFAULT else
+#define DISPATCH_END
+
+#else
+
+#define DISPATCH_NEXT
+#define DISPATCH_BEGIN switch (instr->exec_opcode()) {
+#define CASE(op) case OpCode::op:
+#define NEXT continue
+#define DISPATCH_DEFAULT default:
+#define DISPATCH_END }
+
+#endif
+
+
+void VM::debug(const VMFrame& frame, const VMInstr& instr) const
+{
+  cerr << endl << endl;
+  cerr << "\t FRAME.........: " << frame.info->function_name << endl;
+  cerr << "\t PC............: " << (frame.pc - 1) << endl;
+  cerr << "\t INSTR.........: " << to_string(instr) << endl;
+  cerr << "\t NEXT OPERAND..: ";
+  if (sp > frame.bp + frame.info->local_count)
+    cerr << to_string(value_stack[sp - 1]) << endl;
+  else
+    cerr << "empty" << endl;
+  cerr << "\t NEXT FUNCTION.: ";
+  if (call_depth > 0)
+    cerr << call_stack[call_depth - 1].info->function_name << endl;
+  else
+    cerr << "empty" << endl;
+}
+
+
+void VM::trace(const VMFrame& frame, const VMInstr& instr, bool DEBUG)
+{
+  if (DEBUG)
+    debug(frame, instr);
+  if (profiler)
+    profiler->count(*frame.info, frame.pc - 1, instr.exec_opcode());
 }
 
 
 void VM::run(bool DEBUG)
 {
   // grab the "main" frame if it exists
-  if (!frame_info.contains("main"))
+  if (!function_index.contains("main"))
     error("No 'main' function");
-  shared_ptr<VMFrame> frame = make_shared<VMFrame>();
-  frame->info = frame_info["main"];
-  call_stack.push(frame);
+  if (!linked)
+    link();
+  call_depth = 0;
+  VMFrame* frame = &push_frame(frame_info[function_index["main"]]);
+
+  // preallocate the value stack and reserve main's local variables
+  value_stack.assign(max_stack_size, VMValue());
+  sp = 0;
+  if (frame->info->local_count > max_stack_size)
+    error("stack overflow");
+  sp = frame->info->local_count;
+
+  // the sampler (if on) reads the call stack until run returns
+  VMSamplingScope sampling(sampler.get(), call_stack, call_depth,
+                           call_stack_growing);
+
+  // each instruction is traced (one check per instruction) when
+  // debugging or profiling
+  bool tracing = DEBUG or profiler;
+  if (profiler)
+    profiler->start();
+
+  // frames switch to native code (when hot) on calls, returns, and
+  // loop back edges
+  bool use_jit = jit and !tracing and VMJit::supported();
+  if (use_jit)
+    run_native(*frame);
+
+  // the instruction currently being executed
+  VMInstr* instr = nullptr;
+
+#if defined(MYPL_USE_THREADED)
+  // label table indexed by opcode (unset entries are unsupported)
+  void* labels[OPCODE_COUNT];
+  for (int i = 0; i < OPCODE_COUNT; ++i)
+    labels[i] = &&L_UNSUPPORTED;
+  LABEL(PUSH) LABEL(PUSHK) LABEL(POP) LABEL(STORE) LABEL(LOAD)
+  LABEL(ADD) LABEL(SUB) LABEL(MUL) LABEL(DIV)
+  LABEL(AND) LABEL(OR) LABEL(NOT)
+  LABEL(CMPLT) LABEL(CMPLE) LABEL(CMPGT) LABEL(CMPGE)
+  LABEL(CMPEQ) LABEL(CMPNE)
+  LABEL(ADDI) LABEL(ADDD) LABEL(SUBI) LABEL(SUBD)
+  LABEL(MULI) LABEL(MULD) LABEL(DIVI) LABEL(DIVD)
+  LABEL(CMPLTI) LABEL(CMPLTD) LABEL(CMPLTS)
+  LABEL(CMPLEI) LABEL(CMPLED) LABEL(CMPLES)
+  LABEL(CMPGTI) LABEL(CMPGTD) LABEL(CMPGTS)
+  LABEL(CMPGEI) LABEL(CMPGED) LABEL(CMPGES)
+  LABEL(JMP) LABEL(JMPF) LABEL(CALL) LABEL(TAILCALL) LABEL(RET)
+  LABEL(WRITE) LABEL(READ) LABEL(SLEN) LABEL(ALEN)
+  LABEL(TOINT) LABEL(TODBL) LABEL(TOSTR) LABEL(CONCAT) LABEL(GETC)
+  LABEL(ALLOCS) LABEL(ADDF) LABEL(SETF) LABEL(GETF)
+  LABEL(ALLOCA) LABEL(SETI) LABEL(GETI) LABEL(DELAR) LABEL(DELS)
+  LABEL(DUP) LABEL(NOP)
+  LABEL(INCL) LABEL(LOADL_GETF) LABEL(GETF_Q)
+  LABEL(CMPLT_JMPF) LABEL(CMPLE_JMPF) LABEL(CMPGT_JMPF) LABEL(CMPGE_JMPF)
+  LABEL(CMPEQ_JMPF) LABEL(CMPNE_JMPF)
+#endif
 
   // run loop (keep going until we run out of instructions)
-  while (!call_stack.empty() and frame->pc < frame->info.instructions.size()) {
-
-    // get the next instruction
-    VMInstr& instr = frame->info.instructions[frame->pc];
-
-    // increment the program counter
-    ++frame->pc;
-
-    // for debugging
-    if (DEBUG) {
-      // TODO
-      cerr << endl << endl;
-      cerr << "\t FRAME.........: " << frame->info.function_name << endl;
-      cerr << "\t PC............: " << (frame->pc - 1) << endl;
-      cerr << "\t INSTR.........: " << to_string(instr) << endl;
-      cerr << "\t NEXT OPERAND..: ";
-      if (!frame->operand_stack.empty())
-        cerr << to_string(frame->operand_stack.top()) << endl;
-      else
-        cerr << "empty" << endl;
-      cerr << "\t NEXT FUNCTION.: ";
-      if (!call_stack.empty())
-        cerr << call_stack.top()->info.function_name << endl;
-      else
-        cerr << "empty" << endl;
-    }
+#if !defined(MYPL_USE_THREADED)
+  while (true)
+#endif
+  {
+
+    // get the next instruction and increment the program counter
+    DISPATCH_NEXT
+    FETCH();
+
+    DISPATCH_BEGIN
 
     //----------------------------------------------------------------------
     // Literals and Variables
     //----------------------------------------------------------------------
 
-    if (instr.opcode() == OpCode::PUSH) {
-      frame->operand_stack.push(instr.operand().value());
+    CASE(PUSH) {
+      push(instr->operand().value());
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::POP) {
-      frame->operand_stack.pop();
+    CASE(PUSHK) {
+      push(frame->info->constants[instr->resolved()]);
+      NEXT;
     }
 
-    
-    else if(instr.opcode() == OpCode::STORE) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      int index = get<int>(instr.operand().value());
-      if(index >= frame->variables.size())
-      {
-        frame->variables.push_back(x);
-      }
-      else
-      {
-        frame->variables.at(index) = x;
-      }
-      
+    CASE(POP) {
+      pop();
+      NEXT;
     }
-    
-    else if(instr.opcode() == OpCode::LOAD) {
-      VMValue x = frame->variables.at(get<int>(instr.operand().value()));
-      frame->operand_stack.push(x);
+
+    CASE(STORE) {
+      int index = instr->operand().value().as_int();
+      value_stack[frame->bp + index] = pop();
+      NEXT;
     }
     
-    // TODO: Finish LOAD and STORE
+    CASE(LOAD) {
+      push(value_stack[frame->bp + instr->operand().value().as_int()]);
+      NEXT;
+    }
 
-    
     //----------------------------------------------------------------------
     // Operations
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::ADD) {
-      VMValue x = frame->operand_stack.top();
+    CASE(ADD) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(add(y, x));
+      quicken(*instr, y);
+      push(add(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::SUB) {
-      VMValue x = frame->operand_stack.top();
+    CASE(SUB) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(sub(y, x));
+      quicken(*instr, y);
+      push(sub(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::MUL) {
-      VMValue x = frame->operand_stack.top();
+    CASE(MUL) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(mul(y, x));
+      quicken(*instr, y);
+      push(mul(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::DIV) {
-      VMValue x = frame->operand_stack.top();
+    CASE(DIV) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(div(y, x));
+      quicken(*instr, y);
+      push(div(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::AND) {
-      VMValue x = frame->operand_stack.top();
+    CASE(AND) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(an(y, x));
+      push(an(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::OR) {
-      VMValue x = frame->operand_stack.top();
+    CASE(OR) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(orr(y, x));
+      push(orr(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::NOT) {
-      VMValue x = frame->operand_stack.top();
+    CASE(NOT) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(nt(x));
+      push(nt(x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPLT) {
-      VMValue x = frame->operand_stack.top();
+    CASE(CMPLT) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(lt(y, x));
+      quicken(*instr, y);
+      push(lt(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPLE) {
-      VMValue x = frame->operand_stack.top();
+    CASE(CMPLE) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(le(y, x));
+      quicken(*instr, y);
+      push(le(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPGT) {
-      VMValue x = frame->operand_stack.top();
+    CASE(CMPGT) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(gt(y, x));
+      quicken(*instr, y);
+      push(gt(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPGE) {
-      VMValue x = frame->operand_stack.top();
+    CASE(CMPGE) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(ge(y, x));
+      quicken(*instr, y);
+      push(ge(y, x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CMPEQ) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(eq(y, x));
+    CASE(CMPEQ) {
+      VMValue x = pop();
+      VMValue y = pop();
+      push(eq(y, x));
+      NEXT;
     }
     
-    else if (instr.opcode() == OpCode::CMPNE) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(neq(y, x));
+    CASE(CMPNE) {
+      VMValue x = pop();
+      VMValue y = pop();
+      push(neq(y, x));
+      NEXT;
     }
     
+    //----------------------------------------------------------------------
+    // Type-specialized operations
+    //----------------------------------------------------------------------
+
+// apply op directly if both operands have the expected type (else use
+// the generic operation, which also reports null operands, undoing any
+// quickening)
+#define TYPED_BINARY(is_t, as_t, op, generic)                           \
+      VMValue x = pop();                                                \
+      VMValue& y = value_stack[sp - 1];                                 \
+      if (x.is_t() and y.is_t())                                        \
+        y = y.as_t() op x.as_t();                                       \
+      else {                                                            \
+        dequicken(*instr);                                              \
+        VMValue z = pop();                                              \
+        ensure_not_null(*frame, x);                                     \
+        ensure_not_null(*frame, z);                                     \
+        push(generic(z, x));                                            \
+      }
+
+    CASE(ADDI) {
+      TYPED_BINARY(is_int, as_int, +, add);
+      NEXT;
+    }
+
+    CASE(ADDD) {
+      TYPED_BINARY(is_double, as_double, +, add);
+      NEXT;
+    }
+
+    CASE(SUBI) {
+      TYPED_BINARY(is_int, as_int, -, sub);
+      NEXT;
+    }
+
+    CASE(SUBD) {
+      TYPED_BINARY(is_double, as_double, -, sub);
+      NEXT;
+    }
+
+    CASE(MULI) {
+      TYPED_BINARY(is_int, as_int, *, mul);
+      NEXT;
+    }
+
+    CASE(MULD) {
+      TYPED_BINARY(is_double, as_double, *, mul);
+      NEXT;
+    }
+
+    CASE(DIVI) {
+      TYPED_BINARY(is_int, as_int, /, div);
+      NEXT;
+    }
+
+    CASE(DIVD) {
+      TYPED_BINARY(is_double, as_double, /, div);
+      NEXT;
+    }
+
+    CASE(CMPLTI) {
+      TYPED_BINARY(is_int, as_int, <, lt);
+      NEXT;
+    }
+
+    CASE(CMPLTD) {
+      TYPED_BINARY(is_double, as_double, <, lt);
+      NEXT;
+    }
+
+    CASE(CMPLTS) {
+      TYPED_BINARY(is_string, as_string, <, lt);
+      NEXT;
+    }
+
+    CASE(CMPLEI) {
+      TYPED_BINARY(is_int, as_int, <=, le);
+      NEXT;
+    }
+
+    CASE(CMPLED) {
+      TYPED_BINARY(is_double, as_double, <=, le);
+      NEXT;
+    }
+
+    CASE(CMPLES) {
+      TYPED_BINARY(is_string, as_string, <=, le);
+      NEXT;
+    }
+
+    CASE(CMPGTI) {
+      TYPED_BINARY(is_int, as_int, >, gt);
+      NEXT;
+    }
+
+    CASE(CMPGTD) {
+      TYPED_BINARY(is_double, as_double, >, gt);
+      NEXT;
+    }
+
+    CASE(CMPGTS) {
+      TYPED_BINARY(is_string, as_string, >, gt);
+      NEXT;
+    }
+
+    CASE(CMPGEI) {
+      TYPED_BINARY(is_int, as_int, >=, ge);
+      NEXT;
+    }
+
+    CASE(CMPGED) {
+      TYPED_BINARY(is_double, as_double, >=, ge);
+      NEXT;
+    }
+
+    CASE(CMPGES) {
+      TYPED_BINARY(is_string, as_string, >=, ge);
+      NEXT;
+    }
+
+#undef TYPED_BINARY
+
     //----------------------------------------------------------------------
     // Branching
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::JMP) {
-      int index = get<int>(instr.operand().value());
+    CASE(JMP) {
+      int index = instr->operand().value().as_int();
+      bool back_edge = index < frame->pc;
       frame->pc = index;
+      if (use_jit and back_edge)
+        run_native(*frame);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::JMPF) {
-      VMValue checker = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      int index = get<int>(instr.operand().value());
-      if(holds_alternative<bool>(checker))
+    CASE(JMPF) {
+      VMValue checker = pop();
+      int index = instr->operand().value().as_int();
+      if(checker.is_bool())
       {
-        if(!get<bool>(checker))
+        if(!checker.as_bool())
         {
           frame->pc = index;
         }
       }
+      NEXT;
     }
     
-    
     //----------------------------------------------------------------------
     // Functions
     //----------------------------------------------------------------------
     
-    else if (instr.opcode() == OpCode::CALL)
-    {
-      string fun_name = get<string>(instr.operand().value());
-      shared_ptr<VMFrame> new_frame = make_shared<VMFrame>();
-      new_frame -> info = frame_info[fun_name];
-      call_stack.push(new_frame);
-      for(int i = 0; i < frame_info[fun_name].arg_count; i++)
+    CASE(CALL) {
+      VMFrameInfo& info = frame_info[instr->resolved()];
+      // the args on top of the caller's operands start the new window,
+      // and are moved (last arg first) onto the callee's operands
+      int arg_count = info.arg_count;
+      int local_count = info.local_count;
+      int bp = sp - arg_count;
+      if (bp + local_count + arg_count > max_stack_size)
+        error("stack overflow", *frame);
+      if (call_depth >= max_call_depth)
+        error("call depth exceeded", *frame);
+      for(int i = 0; i < arg_count; i++)
       {
-        VMValue x = frame -> operand_stack.top();
-        new_frame -> operand_stack.push(x);
-        frame -> operand_stack.pop();
+        value_stack[bp + local_count + i] =
+          std::move(value_stack[sp - 1 - i]);
       }
-      frame = new_frame;
+      sp = bp + local_count + arg_count;
+      frame = &push_frame(info);
+      frame->bp = bp;
+      if (use_jit)
+        run_native(*frame);
+      NEXT;
     }
     
-    else if (instr.opcode() == OpCode::RET)
-    {
-      VMValue v = frame -> operand_stack.top();
-      call_stack.pop();
-      if(!call_stack.empty())
+    CASE(TAILCALL) {
+      VMFrameInfo& info = frame_info[instr->resolved()];
+      // the args replace the current frame's window, which then starts
+      // the call the same way as CALL (so tail calls do not grow the
+      // call stack)
+      int arg_count = info.arg_count;
+      int local_count = info.local_count;
+      int bp = frame->bp;
+      if (bp + local_count + arg_count > max_stack_size)
+        error("stack overflow", *frame);
+      tail_args.clear();
+      for(int i = 0; i < arg_count; i++)
+      {
+        tail_args.push_back(std::move(value_stack[--sp]));
+      }
+      while (sp > bp)
+        value_stack[--sp] = VMValue();
+      for(int i = 0; i < arg_count; i++)
       {
-        frame = call_stack.top();
-        frame -> operand_stack.push(v);
+        value_stack[bp + local_count + i] = std::move(tail_args[i]);
       }
+      sp = bp + local_count + arg_count;
+      frame->info = &info;
+      frame->pc = 0;
+      if (use_jit)
+        run_native(*frame);
+      NEXT;
+    }
+
+    CASE(RET) {
+      VMValue v = pop();
+      // release the frame's window (slots above sp are always null)
+      while (sp > frame->bp)
+        value_stack[--sp] = VMValue();
+      --call_depth;
+      if(call_depth > 0)
+      {
+        frame = &call_stack[call_depth - 1];
+        push(std::move(v));
+        if (use_jit and frame->info->native)
+          run_native(*frame);
+      }
+      NEXT;
     }
 
-    
     //----------------------------------------------------------------------
     // Built in functions
     //----------------------------------------------------------------------
 
-
-    else if (instr.opcode() == OpCode::WRITE) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
+    CASE(WRITE) {
+      VMValue x = pop();
       cout << to_string(x);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::READ) {
+    CASE(READ) {
       string val = "";
       getline(cin, val);
-      frame->operand_stack.push(val);
+      push(val);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::SLEN) {
-      VMValue x1 = frame->operand_stack.top();
+    CASE(SLEN) {
+      VMValue x1 = pop();
       ensure_not_null(*frame, x1);
-      string x = get<string>(x1);
-      frame->operand_stack.pop();
-      int length = x.size();
-      frame->operand_stack.push(length);
+      int length = x1.as_string().size();
+      push(length);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::ALEN) {
-      VMValue x1 = frame->operand_stack.top();
+    CASE(ALEN) {
+      VMValue x1 = pop();
       ensure_not_null(*frame, x1);
-      int x = get<int>(x1);
-      frame->operand_stack.pop();
-      vector<VMValue> val = array_heap[x];
-      int length = val.size();
-      frame->operand_stack.push(length);
+      VMObject* array = heap.get(x1.as_handle(), VMObjectKind::ARRAY);
+      if (!array)
+        error("array does not exist", *frame);
+      push(array->length);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::TOINT) {
-      VMValue x = frame->operand_stack.top();
+    CASE(TOINT) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(to_int(x));
+      VMValue y = to_int(x);
+      if (y.is_null())
+        error("cannot convert string to int", *frame);
+      push(std::move(y));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::TODBL) {
-      VMValue x = frame->operand_stack.top();
+    CASE(TODBL) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(to_dbl(x));
+      VMValue y = to_dbl(x);
+      if (y.is_null())
+        error("cannot convert string to double", *frame);
+      push(std::move(y));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::TOSTR) {
-      VMValue x = frame->operand_stack.top();
+    CASE(TOSTR) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(to_string(x));
+      push(to_string(x));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::CONCAT) {
-      VMValue x = frame->operand_stack.top();
+    CASE(CONCAT) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      frame->operand_stack.push(con_cat(y,x));
+      y.append(x.as_string());
+      push(std::move(y));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::GETC) {
-      VMValue x = frame->operand_stack.top();
+    CASE(GETC) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      string word = get<string>(x);
-      frame->operand_stack.pop();
-      x = frame->operand_stack.top();
-      ensure_not_null(*frame, x);
-      int index = get<int>(x);
-      frame->operand_stack.pop();
+      VMValue y = pop();
+      ensure_not_null(*frame, y);
+      int index = y.as_int();
+      const string& word = x.as_string();
       if(index >= word.size())
       {
-        error("out-of-bounds string index (in main at 2: GETC())");
+        error("out-of-bounds string index", *frame);
       }
       else if(index < 0)
       {
-        error("out-of-bounds string index (in main at 2: GETC())");
+        error("out-of-bounds string index", *frame);
       }
       else
       {
         string ch;
         ch.push_back(word[index]);
-        frame->operand_stack.push(ch);
+        push(ch);
       }
+      NEXT;
     }
     
-    
     //----------------------------------------------------------------------
     // heap
     //----------------------------------------------------------------------
 
-    else if (instr.opcode() == OpCode::ALLOCS) {
-      struct_heap[next_obj_id] = {};
-      frame->operand_stack.push(next_obj_id);
-      ++next_obj_id;
+    CASE(ALLOCS) {
+      if (heap.collection_due())
+        collect_garbage();
+      // structs with a layout start with all of their fields (as null)
+      int layout = instr->resolved();
+      int field_count = 0;
+      if (layout >= 0)
+        field_count = struct_layouts[layout].field_names.size();
+      int oid = heap.alloc_struct(layout, field_count);
+      if (oid == -1)
+        error("out of heap memory", *frame);
+      push(VMValue::handle(oid));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::ADDF) {
-      VMValue x = frame->operand_stack.top();
+    CASE(ADDF) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      int oid = get<int>(x);
-      struct_heap[oid][get<string>(instr.operand().value())];
+      VMObject* obj = heap.get(x.as_handle(), VMObjectKind::STRUCT);
+      if (!obj)
+        error("struct does not exist", *frame);
+      const string& name = instr->operand().value().as_string();
+      if (field_offset(*obj, name) == -1) {
+        if (obj->layout >= 0) {
+          obj->names = struct_layouts[obj->layout].field_names;
+          obj->layout = -1;
+        }
+        obj->names.push_back(name);
+        heap.append(*obj);
+      }
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::SETF) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+    CASE(SETF) {
+      VMValue x = pop();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      int oid = get<int>(y);
-      struct_heap[oid][get<string>(instr.operand().value())] = x;
+      VMObject* obj = heap.get(y.as_handle(), VMObjectKind::STRUCT);
+      if (!obj)
+        error("struct does not exist", *frame);
+      int offset = instr->resolved();
+      if (offset < 0)
+        offset = field_offset(*obj, instr->operand().value().as_string());
+      if (offset < 0 or offset >= obj->length)
+        error("struct does not have field", *frame);
+      obj->values[offset] = std::move(x);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::GETF) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      ensure_not_null(*frame, x);
-      int oid = get<int>(x);
-      if(struct_heap[oid].empty())
-      {
-        error("struct does not exist (in main at 1: GETF(a))");
-      }
-      else
-      {
-        frame->operand_stack.push(struct_heap[oid][get<string>(instr.operand().value())]);
+    CASE(GETF) {
+      VMValue x = pop();
+      push(get_field(*frame, *instr, x));
+      quicken_field(*instr, x);
+      NEXT;
+    }
+
+    CASE(GETF_Q) {
+      // the struct has the cached layout (else run as a generic GETF)
+      VMValue& x = value_stack[sp - 1];
+      VMObject* obj = nullptr;
+      if (x.is_handle())
+        obj = heap.get(x.as_handle(), VMObjectKind::STRUCT);
+      if (obj and obj->layout == instr->cache_key())
+        x = obj->values[instr->cache_value()];
+      else {
+        dequicken(*instr);
+        VMValue y = pop();
+        push(get_field(*frame, *instr, y));
       }
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::ALLOCA) {
-      VMValue val = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      int size = get<int>(frame->operand_stack.top());
-      frame->operand_stack.pop();
-      array_heap[next_obj_id] = vector<VMValue>(size,val);
-      frame->operand_stack.push(next_obj_id);
-      ++next_obj_id;
+    CASE(ALLOCA) {
+      // collect while the fill value is still on the stack
+      if (heap.collection_due())
+        collect_garbage();
+      VMValue val = pop();
+      int size = pop().as_int();
+      if (size < 0)
+        error("negative array size", *frame);
+      int oid = heap.alloc_array(size, val);
+      if (oid == -1)
+        error("out of heap memory", *frame);
+      push(VMValue::handle(oid));
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::SETI) {
-      VMValue x = frame->operand_stack.top();
+    CASE(SETI) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      VMValue z = frame->operand_stack.top();
+      VMValue z = pop();
       ensure_not_null(*frame, z);
-      frame->operand_stack.pop();
-      if(array_heap[get<int>(z)].empty())
-      {
-        error("array does not exist (in main at 5: SETI())");
-      }
-      else if(get<int>(y) < array_heap[get<int>(z)].size())
+      VMObject* array = heap.get(z.as_handle(), VMObjectKind::ARRAY);
+      if(!array)
       {
-        if(get<int>(y) < 0)
-        {
-          error("out-of-bounds array index (in main at 5: SETI())");
-        }
-        array_heap[get<int>(z)][get<int>(y)] = x;
+        error("array does not exist", *frame);
       }
-      else
+      int index = y.as_int();
+      if(index < 0 or index >= array->length)
       {
-        error("out-of-bounds array index (in main at 5: SETI())");
+        error("out-of-bounds array index", *frame);
       }
+      array->values[index] = std::move(x);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::GETI) {
-      VMValue x = frame->operand_stack.top();
+    CASE(GETI) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      VMValue y = frame->operand_stack.top();
+      VMValue y = pop();
       ensure_not_null(*frame, y);
-      frame->operand_stack.pop();
-      if(array_heap[get<int>(y)].empty())
+      VMObject* array = heap.get(y.as_handle(), VMObjectKind::ARRAY);
+      if(!array)
       {
-        error("array does not exist (in main at 4: GETI())");
+        error("array does not exist", *frame);
       }
-      else if(get<int>(x) < array_heap[get<int>(y)].size())
-      {
-        if(get<int>(y) < 0)
-        {
-          error("out-of-bounds array index (in main at 4: GETI())");
-        }
-        frame->operand_stack.push(array_heap[get<int>(y)][get<int>(x)]);
-      }
-      else
+      int index = x.as_int();
+      if(index < 0 or index >= array->length)
       {
-        error("out-of-bounds array index (in main at 4: GETI())");
+        error("out-of-bounds array index", *frame);
       }
+      push(array->values[index]);
+      NEXT;
     }
     
-    else if (instr.opcode() == OpCode::DELAR) {
-      VMValue x = frame->operand_stack.top();
+    CASE(DELAR) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      array_heap.erase(get<int>(x));
+      heap.free(x.as_handle(), VMObjectKind::ARRAY);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::DELS) {
-      VMValue x = frame->operand_stack.top();
+    CASE(DELS) {
+      VMValue x = pop();
       ensure_not_null(*frame, x);
-      frame->operand_stack.pop();
-      struct_heap.erase(get<int>(x));
+      heap.free(x.as_handle(), VMObjectKind::STRUCT);
+      NEXT;
     }
+
     //----------------------------------------------------------------------
     // special
     //----------------------------------------------------------------------
-
     
-    else if (instr.opcode() == OpCode::DUP) {
-      VMValue x = frame->operand_stack.top();
-      frame->operand_stack.pop();
-      frame->operand_stack.push(x);
-      frame->operand_stack.push(x);      
+    CASE(DUP) {
+      VMValue x = pop();
+      push(x);
+      push(x);      
+      NEXT;
+    }
+
+    //----------------------------------------------------------------------
+    // superinstructions (the error location of each part is its own
+    // instruction, which is still in place after the first)
+    //----------------------------------------------------------------------
+
+    CASE(INCL) {
+      // LOAD i, PUSH c, ADD, STORE i
+      VMValue& x = value_stack[frame->bp + instr->operand().value().as_int()];
+      const VMValue& c = instr[1].operand().value();
+      if (x.is_int())
+        x = x.as_int() + c.as_int();
+      else {
+        frame->pc += 2;
+        ensure_not_null(*frame, x);
+        x = add(x, c);
+        frame->pc -= 2;
+      }
+      frame->pc += 3;
+      NEXT;
+    }
+
+    CASE(LOADL_GETF) {
+      // LOAD i, GETF f
+      ++frame->pc;
+      const VMValue& x = value_stack[frame->bp + instr->operand().value().as_int()];
+      push(get_field(*frame, instr[1], x));
+      NEXT;
+    }
+
+#define CMP_JMPF(cmp, op)                                               \
+      VMValue x = pop();                                                \
+      VMValue y = pop();                                                \
+      bool result;                                                      \
+      if (x.is_int() and y.is_int())                                    \
+        result = y.as_int() op x.as_int();                              \
+      else {                                                            \
+        ensure_not_null(*frame, x);                                     \
+        ensure_not_null(*frame, y);                                     \
+        result = cmp(y, x).as_bool();                                   \
+      }                                                                 \
+      if (result)                                                       \
+        ++frame->pc;                                                    \
+      else                                                              \
+        frame->pc = instr[1].operand().value().as_int();
+
+    CASE(CMPLT_JMPF) {
+      CMP_JMPF(lt, <);
+      NEXT;
+    }
+
+    CASE(CMPLE_JMPF) {
+      CMP_JMPF(le, <=);
+      NEXT;
+    }
+
+    CASE(CMPGT_JMPF) {
+      CMP_JMPF(gt, >);
+      NEXT;
+    }
+
+    CASE(CMPGE_JMPF) {
+      CMP_JMPF(ge, >=);
+      NEXT;
     }
 
-    else if (instr.opcode() == OpCode::NOP) {
+    CASE(CMPEQ_JMPF) {
+      VMValue x = pop();
+      VMValue y = pop();
+      if (eq(y, x).as_bool())
+        ++frame->pc;
+      else
+        frame->pc = instr[1].operand().value().as_int();
+      NEXT;
+    }
+
+    CASE(CMPNE_JMPF) {
+      VMValue x = pop();
+      VMValue y = pop();
+      if (neq(y, x).as_bool())
+        ++frame->pc;
+      else
+        frame->pc = instr[1].operand().value().as_int();
+      NEXT;
+    }
+
+#undef CMP_JMPF
+
+    CASE(NOP) {
       // do nothing
+      NEXT;
     }
     
-    else {
-      error("unsupported operation " + to_string(instr));
+    DISPATCH_DEFAULT {
+      error("unsupported operation " + to_string(*instr));
     }
+
+    DISPATCH_END
+  }
+
+ done:
+  if (profiler)
+    profiler->stop();
+}
+
+
+VMValue VM::get_field(const VMFrame& f, const VMInstr& instr, const VMValue& x)
+{
+  ensure_not_null(f, x);
+  VMObject* obj = heap.get(x.as_handle(), VMObjectKind::STRUCT);
+  if(!obj)
+  {
+    error("struct does not exist", f);
+  }
+  int offset = instr.resolved();
+  if (offset < 0)
+    offset = field_offset(*obj, instr.operand().value().as_string());
+  if (offset < 0 or offset >= obj->length)
+    return nullptr;
+  return obj->values[offset];
+}
+
+
+void VM::quicken(VMInstr& instr, const VMValue& x)
+{
+  if (not quickening or instr.quicken_misses() >= MAX_QUICKEN_MISSES)
+    return;
+  bool i = x.is_int();
+  bool d = x.is_double();
+  bool s = x.is_string();
+  OpCode op = instr.opcode();
+  switch (op) {
+  case OpCode::ADD: op = i ? OpCode::ADDI : d ? OpCode::ADDD : op; break;
+  case OpCode::SUB: op = i ? OpCode::SUBI : d ? OpCode::SUBD : op; break;
+  case OpCode::MUL: op = i ? OpCode::MULI : d ? OpCode::MULD : op; break;
+  case OpCode::DIV: op = i ? OpCode::DIVI : d ? OpCode::DIVD : op; break;
+  case OpCode::CMPLT:
+    op = i ? OpCode::CMPLTI : d ? OpCode::CMPLTD : s ? OpCode::CMPLTS : op;
+    break;
+  case OpCode::CMPLE:
+    op = i ? OpCode::CMPLEI : d ? OpCode::CMPLED : s ? OpCode::CMPLES : op;
+    break;
+  case OpCode::CMPGT:
+    op = i ? OpCode::CMPGTI : d ? OpCode::CMPGTD : s ? OpCode::CMPGTS : op;
+    break;
+  case OpCode::CMPGE:
+    op = i ? OpCode::CMPGEI : d ? OpCode::CMPGED : s ? OpCode::CMPGES : op;
+    break;
+  default:
+    break;
+  }
+  instr.set_exec_opcode(op);
+}
+
+
+void VM::quicken_field(VMInstr& instr, const VMValue& x)
+{
+  // only fields looked up by name, in structs with a declared layout
+  if (not quickening or instr.resolved() >= 0 or
+      instr.quicken_misses() >= MAX_QUICKEN_MISSES)
+    return;
+  VMObject* obj = heap.get(x.as_handle(), VMObjectKind::STRUCT);
+  if (not obj or obj->layout < 0)
+    return;
+  int offset = field_offset(*obj, instr.operand().value().as_string());
+  if (offset < 0 or offset >= obj->length)
+    return;
+  instr.set_cache(obj->layout, offset);
+  instr.set_exec_opcode(OpCode::GETF_Q);
+}
+
+
+void VM::dequicken(VMInstr& instr)
+{
+  if (instr.exec_opcode() != instr.opcode()) {
+    instr.set_exec_opcode(instr.opcode());
+    instr.add_quicken_miss();
   }
 }
 
 
 void VM::ensure_not_null(const VMFrame& f, const VMValue& x) const
 {
-  if (holds_alternative<nullptr_t>(x))
+  if (x.is_null())
     error("null reference", f);
 }
 
 
 VMValue VM::add(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) + get<int>(y);
+  if (x.is_int()) 
+    return x.as_int() + y.as_int();
   else
-    return get<double>(x) + get<double>(y);
+    return x.as_double() + y.as_double();
 }
 
 VMValue VM::sub(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) - get<int>(y);
+  if (x.is_int()) 
+    return x.as_int() - y.as_int();
   else
-    return get<double>(x) - get<double>(y);
+    return x.as_double() - y.as_double();
 }
 
 VMValue VM::mul(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) * get<int>(y);
+  if (x.is_int()) 
+    return x.as_int() * y.as_int();
   else
-    return get<double>(x) * get<double>(y);
+    return x.as_double() * y.as_double();
 }
 
 VMValue VM::div(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) / get<int>(y);
+  if (x.is_int()) 
+    return x.as_int() / y.as_int();
   else
-    return get<double>(x) / get<double>(y);
+    return x.as_double() / y.as_double();
 }
 
 VMValue VM::an(const VMValue& x, const VMValue& y) const
 { 
-    return get<bool>(x) && get<bool>(y);
+    return x.as_bool() && y.as_bool();
 }
 
 VMValue VM::orr(const VMValue& x, const VMValue& y) const
 { 
-    return get<bool>(x) || get<bool>(y);
+    return x.as_bool() || y.as_bool();
 }
 
 VMValue VM::nt(const VMValue& x) const
 { 
-    return !get<bool>(x);
+    return !x.as_bool();
 }
 
 VMValue VM::eq(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<nullptr_t>(x) and not holds_alternative<nullptr_t>(y)) 
+  if (x.is_null() and not y.is_null()) 
     return false;
-  else if (not holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (not x.is_null() and y.is_null())
     return false;
-  else if (holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (x.is_null() and y.is_null())
     return true;
-  else if (holds_alternative<int>(x)) 
-    return get<int>(x) == get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) == get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) == get<string>(y);
+  else if (x.is_int() or x.is_handle())
+    return x.as_int() == y.as_int();
+  else if (x.is_double())
+    return x.as_double() == y.as_double();
+  else if (x.is_string())
+    return x.string_ref() == y.string_ref() or x.as_string() == y.as_string();
   else
-    return get<bool>(x) == get<bool>(y);
+    return x.as_bool() == y.as_bool();
 }
 
 VMValue VM::neq(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<nullptr_t>(x) and not holds_alternative<nullptr_t>(y)) 
+  if (x.is_null() and not y.is_null()) 
     return true;
-  else if (not holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (not x.is_null() and y.is_null())
     return true;
-  else if (holds_alternative<nullptr_t>(x) and holds_alternative<nullptr_t>(y))
+  else if (x.is_null() and y.is_null())
     return false;
-  else if (holds_alternative<int>(x)) 
-    return get<int>(x) != get<int>(y);
-  else if (holds_alternative<double>(x))
-    return get<double>(x) != get<double>(y);
-  else if (holds_alternative<string>(x))
-    return get<string>(x) != get<string>(y);
+  else if (x.is_int() or x.is_handle())
+    return x.as_int() != y.as_int();
+  else if (x.is_double())
+    return x.as_double() != y.as_double();
+  else if (x.is_string())
+    return x.string_ref() != y.string_ref() and x.as_string() != y.as_string();
   else
-    return get<bool>(x) != get<bool>(y);
+    return x.as_bool() != y.as_bool();
 }
 
 // TODO: Finish the rest of the comparison operators
 
 VMValue VM::lt(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) < get<int>(y);
-  else if(holds_alternative<double>(x))
-    return get<double>(x) < get<double>(y);
+  if (x.is_int()) 
+    return x.as_int() < y.as_int();
+  else if(x.is_double())
+    return x.as_double() < y.as_double();
   else
-    return get<string>(x) < get<string>(y);
+    return x.as_string() < y.as_string();
 }
 
 VMValue VM::le(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) <= get<int>(y);
-  else if(holds_alternative<double>(x))
-    return get<double>(x) <= get<double>(y);
+  if (x.is_int()) 
+    return x.as_int() <= y.as_int();
+  else if(x.is_double())
+    return x.as_double() <= y.as_double();
   else
-    return get<string>(x) <= get<string>(y);
+    return x.as_string() <= y.as_string();
 }
 
 VMValue VM::gt(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) > get<int>(y);
-  else if(holds_alternative<double>(x))
-    return get<double>(x) > get<double>(y);
+  if (x.is_int()) 
+    return x.as_int() > y.as_int();
+  else if(x.is_double())
+    return x.as_double() > y.as_double();
   else
-    return get<string>(x) > get<string>(y);
+    return x.as_string() > y.as_string();
 }
 
 VMValue VM::ge(const VMValue& x, const VMValue& y) const
 {
-  if (holds_alternative<int>(x)) 
-    return get<int>(x) >= get<int>(y);
-  else if(holds_alternative<double>(x))
-    return get<double>(x) >= get<double>(y);
+  if (x.is_int()) 
+    return x.as_int() >= y.as_int();
+  else if(x.is_double())
+    return x.as_double() >= y.as_double();
   else
-    return get<string>(x) >= get<string>(y);
+    return x.as_string() >= y.as_string();
 }
 
 VMValue VM::to_int(const VMValue& x) const
 {
-  if (holds_alternative<double>(x)) 
+  if (x.is_double()) 
   {
-    int y = (int) get<double>(x);
+    int y = (int) x.as_double();
     return y;
   }
-  else if(holds_alternative<string>(x))
+  else if(x.is_string())
   {
     try{
-      int y = stoi(get<string>(x));
+      int y = stoi(x.as_string());
       return y;
     }
     catch(exception &err){
-      error("cannot convert string to int (in main at 1: TOINT())");
     }
   }
+  else if(x.is_int())
+    return x;
+  return nullptr;
 }
 
 VMValue VM::to_dbl(const VMValue& x) const
 {
-  if (holds_alternative<int>(x)) 
+  if (x.is_int()) 
   {
-    double y = (double) get<int>(x);
+    double y = (double) x.as_int();
     return y;
   }
-  else if(holds_alternative<string>(x))
+  else if(x.is_string())
   {
     try{
-      double y = stod(get<string>(x));
+      double y = stod(x.as_string());
       return y;
     }
     catch(exception &err){
-      error("cannot convert string to double (in main at 1: TODBL())");
     }
   }
+  else if(x.is_double())
+    return x;
+  return nullptr;
 }
 
 VMValue VM::to_str(const VMValue& x) const
 {
-  if (holds_alternative<int>(x)) 
-  {
-    return get<string>(x);
-  }
-  else if(holds_alternative<double>(x))
-  {
-    return get<string>(x);
-  }
-}
-
-VMValue VM::con_cat(const VMValue& x, const VMValue& y) const
-{
-  return get<string>(x) + get<string>(y);
+  return to_string(x);
 }
 
@@ -9,12 +9,15 @@
 #define VM_H
 
 #include <memory>
-#include <stack>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include "vm_instr.h"
 #include "vm_frame.h"
+#include "vm_heap.h"
+#include "vm_jit.h"
+#include "vm_profiler.h"
+#include "vm_sampler.h"
 
 
 class VM
@@ -24,33 +27,223 @@ public:
   // add a new frame type to the vm
   void add(const VMFrameInfo& frame);
 
+  // add a new struct layout to the vm
+  void add(const VMStructLayout& layout);
+
+  // add a new register frame type to the vm (see reg_instr.h)
+  void add(const RegFrameInfo& frame);
+
+  // resolve each CALL to its function index (reports calls to
+  // undefined functions) and fuse superinstructions, done by run if
+  // not called after the last add
+  void link();
+
+  // turn superinstruction fusion on or off (on by default)
+  void set_superinstructions(bool enabled);
+
+  // turn quickening on or off (on by default): generic arithmetic,
+  // comparison, and GETF instructions rewrite themselves into a
+  // type-specialized form after running, which falls back to the
+  // generic form if its type guard fails
+  void set_quickening(bool enabled);
+
+  // turn the jit on or off (on by default where supported, see
+  // vm_jit.h): a frame is compiled to native code once its hotness
+  // (calls plus loop iterations) passes the jit threshold
+  void set_jit(bool enabled);
+  void set_jit_threshold(int threshold);
+
+  // jit settings of vms created afterwards (e.g., to run a test suite
+  // with every frame compiled on its first call)
+  static void set_jit_defaults(bool enabled, int threshold);
+
+  // number of frames compiled by the jit
+  int jit_compiled_count() const;
+
+  // turn profiling on or off (off by default): run counts each
+  // instruction it executes (see vm_profiler.h), the jit is not used
+  // while profiling
+  void set_profiling(bool enabled);
+
+  // the profile of the last run (null if profiling is off)
+  const VMProfiler* profile() const;
+
+  // turn the sampling profiler on with the given number of samples per
+  // second of cpu time, or off for 0 (see vm_sampler.h)
+  void set_sampling(int hz);
+
+  // the call stack samples of the last run (null if sampling is off)
+  const VMSampler* samples() const;
+
   // run the virtual machine
   void run(bool DEBUG = false);
 
+  // run the register frames (starting with the register frame of
+  // main) instead of the stack frames
+  void run_registers();
+
+  // set the maximum number of values (locals and operands of all
+  // active frames) the vm stack can hold
+  void set_max_stack_size(int size);
+
+  // set the maximum number of active frames (nested calls) the vm
+  // call stack can hold
+  void set_max_call_depth(int depth);
+
+  // run the garbage collector (on allocation) once the heap holds the
+  // given number of bytes
+  void set_gc_threshold(std::size_t bytes);
+
+  // garbage collector statistics
+  const VMGCStats& gc_stats() const;
+
   // to print the instructions for each VM frame
   friend std::string to_string(const VM& vm);
 
+  // to write the struct layouts and frames as an image, and to verify
+  // the frames of an image before adding them (see vm_image.h)
+  friend void save_image(const VM& vm, std::ostream& out);
+  friend void load_image(VM& vm, const char* data, std::size_t size);
+
   
 private:
 
-  // heap for struct objects mapping oid's to field values
-  std::unordered_map<int, std::unordered_map<std::string, VMValue>> struct_heap;
+  // struct and array objects
+  VMHeap heap;
+
+  // struct layouts indexed by layout index
+  std::vector<VMStructLayout> struct_layouts;
+
+  // mapping from struct names to layout indexes
+  std::unordered_map<std::string, int> struct_index;
+
+  // collection of frame "templates" indexed by function index
+  std::vector<VMFrameInfo> frame_info;
+
+  // one shared value for each distinct string constant
+  std::unordered_map<std::string, VMValue> interned_strings;
+
+  // mapping from function names to function indexes
+  std::unordered_map<std::string, int> function_index;
+
+  // register frame templates and their function indexes
+  std::vector<RegFrameInfo> reg_frame_info;
+  std::unordered_map<std::string, int> reg_function_index;
+
+  // true if each register CALL (and ALLOCS) has been resolved
+  bool reg_linked = false;
 
-  // heap for array objects
-  std::unordered_map<int, std::vector<VMValue>> array_heap;
+  // register VM call stack (the top frame is the current frame)
+  std::vector<RegFrame> reg_call_stack;
 
-  // next available object id 
-  int next_obj_id = 2023;
+  // true if each CALL (and ALLOCS) has been resolved to its index
+  bool linked = false;
 
-  // collection of frame "templates" identified by function name
-  std::unordered_map<std::string, VMFrameInfo> frame_info;
+  // true if frames are run with superinstructions
+  bool superinstructions = true;
 
-  // VM function call stack
-  std::stack<std::shared_ptr<VMFrame>> call_stack;
+  // true if instructions are quickened as they run
+  bool quickening = true;
+
+  // number of type guard failures after which an instruction is no
+  // longer quickened
+  static const int MAX_QUICKEN_MISSES = 4;
+
+  // the jit settings and compiler (the jit is not used in DEBUG mode)
+  static inline bool default_jit = true;
+  static inline int default_jit_threshold = 1000;
+  bool jit = default_jit;
+  int jit_threshold = default_jit_threshold;
+  VMJit jit_compiler;
+
+  // the execution profile (only allocated while profiling)
+  std::unique_ptr<VMProfiler> profiler;
+
+  // the call stack sampler (only allocated while sampling)
+  std::unique_ptr<VMSampler> sampler;
+
+  // the args of a TAILCALL while they are moved into the reused frame
+  std::vector<VMValue> tail_args;
+
+  // VM function call stack (frames are pooled: only the first
+  // call_depth frames are active, the rest are reused by later calls)
+  std::vector<VMFrame> call_stack;
+  int call_depth = 0;
+
+  // set while the call stack is reallocated (the sampler skips
+  // samples taken then)
+  volatile std::sig_atomic_t call_stack_growing = 0;
+
+  // VM-wide value stack: each frame's locals start at its base pointer
+  // followed by its operands (slots at or above sp are always null)
+  std::vector<VMValue> value_stack;
+
+  // index of the next free value stack slot
+  int sp = 0;
+
+  // maximum size of the value stack
+  int max_stack_size = 256 * 1024;
+
+  // maximum number of active frames (bounds recursion that uses no
+  // value stack slots, e.g., functions without args or locals)
+  int max_call_depth = 256 * 1024;
+
+  // value stack helpers (push reports a stack overflow error)
+  void push(const VMValue& x);
+  void push(VMValue&& x);
+  VMValue pop();
+
+  // collect the heap objects not reachable from the value stack
+  void collect_garbage();
+
+  // activate a pooled frame for the given function
+  VMFrame& push_frame(VMFrameInfo& info);
+
+  // count a hotness event of the frame (compiling the frame once it is
+  // hot) and run its native code, if any, from the frame's pc
+  void run_native(VMFrame& frame);
 
   // helper functions to report VM errors
   void error(std::string msg) const;
   void error(std::string msg, const VMFrame& f) const;
+  void error(std::string msg, const VMFrameInfo& info, int pc) const;
+
+  // check that each LOAD/STORE index and jump target of the frame is in
+  // range (computing the frame's local count if it was not given)
+  void verify(VMFrameInfo& info) const;
+
+  // check that no path through the frame pops more operands than it
+  // has and that paths joining at an instruction agree on the operand
+  // stack depth (given the arg counts of the functions it calls)
+  void verify_stack(const VMFrameInfo& info,
+                    const std::unordered_map<std::string,int>& arg_counts) const;
+
+  // share each string constant of the pool with every equal one
+  void intern(std::vector<VMValue>& constants);
+
+  // register frame versions of error, verify, and link
+  void error(std::string msg, const RegFrameInfo& info, int pc) const;
+  void verify(RegFrameInfo& info) const;
+  void link_registers();
+
+  // helper function to print the current instruction (DEBUG mode)
+  void debug(const VMFrame& f, const VMInstr& instr) const;
+
+  // helper function to print and/or profile the current instruction
+  // (DEBUG mode or profiling)
+  void trace(const VMFrame& f, const VMInstr& instr, bool DEBUG);
+
+  // helper function to find the offset of a named struct field (or -1)
+  int field_offset(const VMObject& obj, const std::string& field_name) const;
+
+  // helper function to get the value of a struct field (for GETF)
+  VMValue get_field(const VMFrame& f, const VMInstr& instr, const VMValue& x);
+
+  // quickening helpers: rewrite a generic instruction into its form
+  // specialized for operand x, and reset it after a type guard fails
+  void quicken(VMInstr& instr, const VMValue& x);
+  void quicken_field(VMInstr& instr, const VMValue& x);
+  void dequicken(VMInstr& instr);
 
   // helper function to check for null values (throws mypl exception)
   void ensure_not_null(const VMFrame& f, const VMValue& x) const;
@@ -69,10 +262,10 @@ private:
   VMValue orr(const VMValue& x, const VMValue& y) const;
   VMValue nt(const VMValue& x) const;
   VMValue neq(const VMValue& x, const VMValue& y) const;
+  // (the conversions are null if x cannot be converted)
   VMValue to_int(const VMValue& x) const;
   VMValue to_dbl(const VMValue& x) const;
   VMValue to_str(const VMValue& x) const;
-  VMValue con_cat(const VMValue& x, const VMValue& y) const;
 };
 
 #endif
@@ -9,15 +9,34 @@
 #ifndef VM_FRAME_H
 #define VM_FRAME_H
 
-#include <stack>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "vm_instr.h"
+#include "reg_instr.h"
 
 
 // The following are plain-old-data classes
 
 
+// native code of a frame compiled by the jit (see vm_jit.h): runs the
+// frame from instruction pc given its locals and the top of its
+// operands (updated as it pushes and pops, up to limit), and returns
+// the pc the interpreter continues from
+using VMNativeCode = int (*)(VMValue* locals, VMValue** top, int pc,
+                             VMValue* limit);
+
+
+// a source line table entry: the source position of the instructions
+// from pc up to the next entry's pc
+struct VMLineEntry
+{
+  int pc;
+  int line;
+  int column;
+};
+
+
 class VMFrameInfo
 {
 public:
@@ -31,6 +50,71 @@ public:
   // the program instructions
   std::vector<VMInstr> instructions;  
 
+  // the constant pool used by PUSHK (string constants are interned
+  // across frames when the frame is added to the vm)
+  std::vector<VMValue> constants;
+
+  // the number of local variable slots including parameters (set by
+  // the code generator, computed by the vm if left as 0)
+  int local_count = 0;
+
+  // the source line table in pc order (set by the code generator, only
+  // holding an entry where the source position changes, and empty for
+  // frames not generated from source)
+  std::vector<VMLineEntry> lines;
+
+  // calls and loop iterations counted by the vm toward compiling the
+  // frame with the jit, and the frame's native code once compiled
+  int hotness = 0;
+  VMNativeCode native = nullptr;
+
+};
+
+
+// the source position of the instruction at pc (null if unknown)
+inline const VMLineEntry* source_position(const VMFrameInfo& info, int pc)
+{
+  auto entry = std::upper_bound(info.lines.begin(), info.lines.end(), pc,
+    [](int pc, const VMLineEntry& e) {return pc < e.pc;});
+  if (entry == info.lines.begin())
+    return nullptr;
+  return &*(entry - 1);
+}
+
+
+class RegFrameInfo
+{
+public:
+
+  // the name of the function associated with the frame
+  std::string function_name;
+
+  // the number of parameters (held in the first registers)
+  int arg_count;
+
+  // the register program instructions
+  std::vector<RegInstr> instructions;
+
+  // the constant pool used by LOADK (string constants are interned
+  // across frames when the frame is added to the vm)
+  std::vector<VMValue> constants;
+
+  // the number of registers (parameters, locals, and temporaries)
+  int register_count = 0;
+
+};
+
+
+class VMStructLayout
+{
+public:
+
+  // the name of the struct
+  std::string struct_name;
+
+  // the field names, in field offset order
+  std::vector<std::string> field_names;
+
 };
 
 
@@ -38,18 +122,34 @@ class VMFrame
 {
 public:
 
-  // the type of the current frame
-  VMFrameInfo info;
+  // the type of the current frame (shared, never copied per call, and
+  // mutable so the vm can quicken its instructions)
+  VMFrameInfo* info = nullptr;
   
   // the program counter
   int pc = 0;
 
-  // the internal memory of the function
-  std::vector<VMValue> variables;
+  // index of the frame's first local variable in the vm value stack
+  // (the frame's operands follow its locals)
+  int bp = 0;
 
-  // the operand stack
-  std::stack<VMValue> operand_stack;
+};
+
+
+class RegFrame
+{
+public:
+
+  // the type of the current frame (shared, never copied per call)
+  const RegFrameInfo* info = nullptr;
+
+  // the program counter
+  int pc = 0;
+
+  // index of the frame's first register in the vm value stack
+  int bp = 0;
 
 };
 
+
 #endif
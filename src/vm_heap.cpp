@@ -0,0 +1,210 @@
+//----------------------------------------------------------------------
+// FILE: vm_heap.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: MyPL VM object heap implementation
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include "vm_heap.h"
+
+
+using namespace std;
+
+
+int VMHeap::alloc_struct(int layout, int field_count)
+{
+  int handle = alloc(VMObjectKind::STRUCT, field_count);
+  if (handle != -1)
+    get(handle, VMObjectKind::STRUCT)->layout = layout;
+  return handle;
+}
+
+
+int VMHeap::alloc_array(int length, const VMValue& fill)
+{
+  int handle = alloc(VMObjectKind::ARRAY, length);
+  if (handle != -1) {
+    VMValue* values = get(handle, VMObjectKind::ARRAY)->values;
+    for (int i = 0; i < length; ++i)
+      values[i] = fill;
+  }
+  return handle;
+}
+
+
+bool VMHeap::free(int handle, VMObjectKind kind)
+{
+  int i = slot(handle);
+  if (i == -1 or objects[i].kind != kind)
+    return false;
+  release(i);
+  return true;
+}
+
+
+void VMHeap::append(VMObject& obj)
+{
+  if (obj.length == (1 << obj.size_class)) {
+    int cell = 0;
+    VMValue* values = alloc_cell(obj.size_class + 1, cell);
+    for (int i = 0; i < obj.length; ++i)
+      values[i] = std::move(obj.values[i]);
+    free_cell(obj.size_class, obj.cell, 0);
+    live_bytes += sizeof(VMValue) << obj.size_class;
+    obj.values = values;
+    obj.cell = cell;
+    ++obj.size_class;
+  }
+  ++obj.length;
+}
+
+
+int VMHeap::alloc(VMObjectKind kind, int length)
+{
+  // the smallest size class that fits the object
+  int size_class = 0;
+  while ((1L << size_class) < length)
+    ++size_class;
+  if (size_class > 30)
+    return -1;
+  int slot = 0;
+  if (!free_slots.empty()) {
+    slot = free_slots.back();
+    free_slots.pop_back();
+  }
+  else if (objects.size() < MAX_SLOTS) {
+    slot = objects.size();
+    objects.emplace_back();
+  }
+  else
+    return -1;
+  VMObject& obj = objects[slot];
+  obj.kind = kind;
+  obj.length = length;
+  obj.size_class = size_class;
+  obj.values = alloc_cell(size_class, obj.cell);
+  ++live_count;
+  live_bytes += sizeof(VMValue) << size_class;
+  return FIRST_HANDLE + ((obj.generation << SLOT_BITS) | slot);
+}
+
+
+void VMHeap::release(int slot)
+{
+  VMObject& obj = objects[slot];
+  free_cell(obj.size_class, obj.cell, obj.length);
+  live_bytes -= sizeof(VMValue) << obj.size_class;
+  obj.kind = VMObjectKind::FREE;
+  obj.layout = -1;
+  obj.length = 0;
+  obj.values = nullptr;
+  obj.names.clear();
+  // a slot is retired (never reused) after its last generation, so a
+  // stale handle can never match a later object
+  if (obj.generation < MAX_GENERATION) {
+    ++obj.generation;
+    free_slots.push_back(slot);
+  }
+  --live_count;
+}
+
+
+void VMHeap::set_gc_threshold(size_t bytes)
+{
+  gc_threshold = bytes;
+  next_collection = max(gc_threshold, 2 * live_bytes);
+}
+
+
+void VMHeap::collect(const VMValue* roots, int count)
+{
+  auto start = chrono::steady_clock::now();
+  // mark everything reachable from the roots
+  for (int i = 0; i < count; ++i)
+    mark(roots[i]);
+  while (!gray_slots.empty()) {
+    const VMObject& obj = objects[gray_slots.back()];
+    gray_slots.pop_back();
+    for (int i = 0; i < obj.length; ++i)
+      mark(obj.values[i]);
+  }
+  // sweep the rest
+  size_t bytes_before = live_bytes;
+  int count_before = live_count;
+  for (int i = 0; i < objects.size(); ++i) {
+    VMObject& obj = objects[i];
+    if (obj.kind == VMObjectKind::FREE)
+      continue;
+    if (obj.marked)
+      obj.marked = false;
+    else
+      release(i);
+  }
+  next_collection = max(gc_threshold, 2 * live_bytes);
+  auto end = chrono::steady_clock::now();
+  double ms = chrono::duration<double, milli>(end - start).count();
+  ++stats.collections;
+  stats.objects_freed += count_before - live_count;
+  stats.bytes_freed += bytes_before - live_bytes;
+  stats.total_pause_ms += ms;
+  stats.max_pause_ms = max(stats.max_pause_ms, ms);
+}
+
+
+void VMHeap::mark(const VMValue& x)
+{
+  if (!x.is_handle())
+    return;
+  int i = slot(x.as_handle());
+  if (i == -1 or objects[i].marked)
+    return;
+  objects[i].marked = true;
+  gray_slots.push_back(i);
+}
+
+
+int VMHeap::cells_per_slab(int size_class)
+{
+  return (1 << size_class) >= SLAB_SIZE ? 1 : SLAB_SIZE >> size_class;
+}
+
+
+VMValue* VMHeap::alloc_cell(int size_class, int& cell)
+{
+  if (arenas.size() <= size_class)
+    arenas.resize(size_class + 1);
+  Arena& arena = arenas[size_class];
+  int per_slab = cells_per_slab(size_class);
+  if (!arena.free_cells.empty()) {
+    cell = arena.free_cells.back();
+    arena.free_cells.pop_back();
+  }
+  else {
+    cell = arena.cell_count++;
+    if (cell % per_slab == 0)
+      arena.slabs.emplace_back();
+  }
+  unique_ptr<VMValue[]>& slab = arena.slabs[cell / per_slab];
+  // single cell slabs are released when their cell is freed
+  if (!slab)
+    slab = make_unique<VMValue[]>(per_slab << size_class);
+  return slab.get() + ((cell % per_slab) << size_class);
+}
+
+
+void VMHeap::free_cell(int size_class, int cell, int length)
+{
+  Arena& arena = arenas[size_class];
+  int per_slab = cells_per_slab(size_class);
+  unique_ptr<VMValue[]>& slab = arena.slabs[cell / per_slab];
+  if (per_slab == 1)
+    slab.reset();
+  else {
+    VMValue* values = slab.get() + ((cell % per_slab) << size_class);
+    for (int i = 0; i < length; ++i)
+      values[i] = nullptr;
+  }
+  arena.free_cells.push_back(cell);
+}
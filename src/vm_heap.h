@@ -0,0 +1,204 @@
+//----------------------------------------------------------------------
+// FILE: vm_heap.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: MyPL VM object heap: a handle table with generation counters
+//       over size-class slab arenas of values
+//----------------------------------------------------------------------
+
+#ifndef VM_HEAP_H
+#define VM_HEAP_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "vm_value.h"
+
+
+// the kinds of heap objects (FREE marks an unused handle slot)
+enum class VMObjectKind : unsigned char {FREE, STRUCT, ARRAY};
+
+
+// A handle table entry. The object's values live in a slab cell with
+// room for 2^size_class values, the first length of which are in use
+// (the rest are always null).
+struct VMObject
+{
+  // incremented each time the slot is freed, so stale handles (to
+  // deleted objects) no longer match (see VMHeap::MAX_GENERATION)
+  int generation = 0;
+
+  VMObjectKind kind = VMObjectKind::FREE;
+
+  // struct layout index (or -1 for structs built field by field)
+  int layout = -1;
+
+  // number of values (array length or struct field count)
+  int length = 0;
+
+  // the values of the object
+  VMValue* values = nullptr;
+
+  // field names of structs without a layout
+  std::vector<std::string> names;
+
+  // the size class and index of the cell holding the values
+  int size_class = 0;
+  int cell = 0;
+
+  // set for reachable objects during garbage collection
+  bool marked = false;
+};
+
+
+// garbage collection statistics (bytes are heap value cell bytes)
+struct VMGCStats
+{
+  int collections = 0;
+  long objects_freed = 0;
+  long bytes_freed = 0;
+  double total_pause_ms = 0;
+  double max_pause_ms = 0;
+};
+
+
+class VMHeap
+{
+public:
+
+  // the first handle given out (handles are ints in MyPL programs)
+  static const int FIRST_HANDLE = 2023;
+
+  // number of handle bits used for the slot index (the rest hold the
+  // slot's generation, which stops before the handle of the last slot
+  // would overflow an int: a slot freed at MAX_GENERATION is retired)
+  static const int SLOT_BITS = 24;
+  static const int MAX_SLOTS = 1 << SLOT_BITS;
+  static const int MAX_GENERATION =
+    (0x7fffffff - FIRST_HANDLE - (MAX_SLOTS - 1)) >> SLOT_BITS;
+
+  // number of values in a slab (slabs of larger size classes hold
+  // a single cell)
+  static const int SLAB_SIZE = 1024;
+
+  VMHeap() = default;
+  VMHeap(const VMHeap&) = delete;
+  VMHeap& operator=(const VMHeap&) = delete;
+
+  // allocate a new object returning its handle, or -1 if there are no
+  // handles left; array values are set to fill, struct fields to null
+  int alloc_struct(int layout, int field_count);
+  int alloc_array(int length, const VMValue& fill);
+
+  // the live object of the given kind for a handle (else nullptr)
+  VMObject* get(int handle, VMObjectKind kind);
+
+  // free the object of the given kind, returns false if no such object
+  bool free(int handle, VMObjectKind kind);
+
+  // add a null value to the end of the object (moving it to a larger
+  // cell as needed)
+  void append(VMObject& obj);
+
+  // number of live objects
+  int size() const {return live_count;}
+
+  // number of bytes held by live objects
+  std::size_t size_in_bytes() const {return live_bytes;}
+
+  // true if the heap has grown enough for another collection
+  bool collection_due() const {return live_bytes >= next_collection;}
+
+  // collect once the heap holds the given number of bytes (after a
+  // collection, the next one is due once the live bytes double)
+  void set_gc_threshold(std::size_t bytes);
+
+  // mark-and-sweep collection freeing each object not reachable from
+  // the count root values starting at roots
+  void collect(const VMValue* roots, int count);
+
+  // statistics over all collections
+  const VMGCStats& gc_stats() const {return stats;}
+
+private:
+
+  // a size class arena: cells of 2^size_class values carved out of
+  // slabs, with freed cells reused first
+  struct Arena
+  {
+    std::vector<std::unique_ptr<VMValue[]>> slabs;
+    std::vector<int> free_cells;
+    int cell_count = 0;
+  };
+
+  // handle table indexed by slot
+  std::vector<VMObject> objects;
+
+  // freed slots available for reuse
+  std::vector<int> free_slots;
+
+  // arenas indexed by size class
+  std::vector<Arena> arenas;
+
+  int live_count = 0;
+  std::size_t live_bytes = 0;
+
+  // garbage collection state
+  std::size_t gc_threshold = 4 * 1024 * 1024;
+  std::size_t next_collection = gc_threshold;
+  std::vector<int> gray_slots;
+  VMGCStats stats;
+
+  // the slot of a live object (any kind), or -1
+  int slot(int handle) const;
+
+  // create a handle table entry of the given kind and length
+  int alloc(VMObjectKind kind, int length);
+
+  // free the object in the slot
+  void release(int slot);
+
+  // mark the object referred to by the value (if any) as reachable
+  void mark(const VMValue& x);
+
+  // number of cells in each slab of a size class
+  static int cells_per_slab(int size_class);
+
+  // get or release a cell of the given size class
+  VMValue* alloc_cell(int size_class, int& cell);
+  void free_cell(int size_class, int cell, int length);
+
+};
+
+static_assert((long) VMHeap::FIRST_HANDLE +
+              (((long) VMHeap::MAX_GENERATION << VMHeap::SLOT_BITS) |
+               (VMHeap::MAX_SLOTS - 1)) <= 0x7fffffff,
+              "the largest VMHeap handle should fit in an int");
+
+
+inline int VMHeap::slot(int handle) const
+{
+  if (handle < FIRST_HANDLE)
+    return -1;
+  int slot = (handle - FIRST_HANDLE) & (MAX_SLOTS - 1);
+  int generation = (handle - FIRST_HANDLE) >> SLOT_BITS;
+  if (slot >= objects.size())
+    return -1;
+  const VMObject& obj = objects[slot];
+  if (obj.kind == VMObjectKind::FREE or obj.generation != generation)
+    return -1;
+  return slot;
+}
+
+
+inline VMObject* VMHeap::get(int handle, VMObjectKind kind)
+{
+  int i = slot(handle);
+  if (i == -1 or objects[i].kind != kind)
+    return nullptr;
+  return &objects[i];
+}
+
+
+#endif
@@ -0,0 +1,384 @@
+//----------------------------------------------------------------------
+// FILE: vm_image.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Precompiled (.myplc) program images
+//----------------------------------------------------------------------
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include "mypl_exception.h"
+#include "vm_image.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MYPL_IMAGE_MMAP
+#endif
+
+using namespace std;
+
+
+namespace {
+
+  const char MAGIC[8] = {'M', 'Y', 'P', 'L', 'C', '\r', '\n', '\x1a'};
+
+  // the type byte of a missing operand
+  const uint8_t NO_OPERAND = 0xff;
+
+
+  //--------------------------------------------------------------------
+  // Writing
+  //--------------------------------------------------------------------
+
+  class Writer
+  {
+  public:
+
+    Writer(ostream& out) : out(out) {}
+
+    void u8(uint8_t x)
+    {
+      out.put(static_cast<char>(x));
+    }
+
+    void u32(uint32_t x)
+    {
+      for (int i = 0; i < 4; ++i)
+        u8(static_cast<uint8_t>(x >> (8 * i)));
+    }
+
+    void i32(int x)
+    {
+      u32(static_cast<uint32_t>(x));
+    }
+
+    void f64(double x)
+    {
+      uint64_t bits;
+      memcpy(&bits, &x, sizeof(bits));
+      for (int i = 0; i < 8; ++i)
+        u8(static_cast<uint8_t>(bits >> (8 * i)));
+    }
+
+    void str(const string& s)
+    {
+      u32(s.size());
+      out.write(s.data(), s.size());
+    }
+
+    void value(const VMValue& x)
+    {
+      if (x.is_handle())
+        throw MyPLException::VMError("cannot save a heap handle in an image");
+      u8(static_cast<uint8_t>(x.type()));
+      if (x.is_int())
+        i32(x.as_int());
+      else if (x.is_double())
+        f64(x.as_double());
+      else if (x.is_bool())
+        u8(x.as_bool());
+      else if (x.is_string())
+        str(x.as_string());
+    }
+
+  private:
+    ostream& out;
+  };
+
+
+  //--------------------------------------------------------------------
+  // Reading
+  //--------------------------------------------------------------------
+
+  // reads the image in place, reporting truncated and invalid data
+  class Reader
+  {
+  public:
+
+    Reader(const char* data, size_t size) : next(data), end(data + size) {}
+
+    void error(const string& msg) const
+    {
+      throw MyPLException::VMError("invalid image: " + msg);
+    }
+
+    const char* bytes(size_t n)
+    {
+      if (n > (size_t) (end - next))
+        error("unexpected end of data");
+      const char* start = next;
+      next += n;
+      return start;
+    }
+
+    uint8_t u8()
+    {
+      return static_cast<uint8_t>(*bytes(1));
+    }
+
+    uint32_t u32()
+    {
+      const char* b = bytes(4);
+      uint32_t x = 0;
+      for (int i = 0; i < 4; ++i)
+        x |= static_cast<uint32_t>(static_cast<uint8_t>(b[i])) << (8 * i);
+      return x;
+    }
+
+    int i32()
+    {
+      return static_cast<int>(u32());
+    }
+
+    // a count of items of at least min_size bytes each (so a corrupt
+    // count cannot reserve more than the data could hold)
+    uint32_t count(size_t min_size)
+    {
+      uint32_t n = u32();
+      if (n > (size_t) (end - next) / min_size)
+        error("unexpected end of data");
+      return n;
+    }
+
+    double f64()
+    {
+      const char* b = bytes(8);
+      uint64_t bits = 0;
+      for (int i = 0; i < 8; ++i)
+        bits |= static_cast<uint64_t>(static_cast<uint8_t>(b[i])) << (8 * i);
+      double x;
+      memcpy(&x, &bits, sizeof(x));
+      return x;
+    }
+
+    string str()
+    {
+      uint32_t n = u32();
+      return string(bytes(n), n);
+    }
+
+    VMValue value(uint8_t type)
+    {
+      switch (static_cast<VMType>(type)) {
+      case VMType::INT: return i32();
+      case VMType::DOUBLE: return f64();
+      case VMType::BOOL: return u8() != 0;
+      case VMType::STRING: return str();
+      case VMType::NULLPTR: return nullptr;
+      default: error("bad value type " + to_string(type));
+      }
+      return nullptr;
+    }
+
+    // checks the operand the run loop and VM::link use without checking
+    // (LOAD, STORE, PUSHK, and jump operands are checked by VM::add)
+    void check(OpCode op, const optional<VMValue>& operand, int resolved)
+    {
+      switch (op) {
+      case OpCode::PUSH:
+        if (!operand.has_value())
+          error("missing operand of " + to_string(op));
+        break;
+      case OpCode::CALL:
+      case OpCode::TAILCALL:
+      case OpCode::ADDF:
+      case OpCode::SETF:
+      case OpCode::GETF:
+        if (!operand.has_value() or !operand->is_string())
+          error("missing name operand of " + to_string(op));
+        break;
+      case OpCode::ALLOCS:
+        // a struct without a name has no layout
+        if (operand.has_value() ? !operand->is_string() : resolved != -1)
+          error("bad struct of " + to_string(op));
+        break;
+      case OpCode::INCL:
+      case OpCode::CMPLT_JMPF:
+      case OpCode::CMPLE_JMPF:
+      case OpCode::CMPGT_JMPF:
+      case OpCode::CMPGE_JMPF:
+      case OpCode::CMPEQ_JMPF:
+      case OpCode::CMPNE_JMPF:
+      case OpCode::LOADL_GETF:
+      case OpCode::GETF_Q:
+        // only set as executed opcodes by the VM (never saved)
+        error("bad opcode " + to_string(op));
+        break;
+      default:
+        break;
+      }
+    }
+
+    bool at_end() const
+    {
+      return next == end;
+    }
+
+  private:
+    const char* next;
+    const char* end;
+  };
+
+}
+
+
+void save_image(const VM& vm, ostream& out)
+{
+  Writer w(out);
+  out.write(MAGIC, sizeof(MAGIC));
+  w.u32(IMAGE_VERSION);
+  w.u32(OPCODE_COUNT);
+  w.u32(vm.struct_layouts.size());
+  for (const VMStructLayout& layout : vm.struct_layouts) {
+    w.str(layout.struct_name);
+    w.u32(layout.field_names.size());
+    for (const string& name : layout.field_names)
+      w.str(name);
+  }
+  w.u32(vm.frame_info.size());
+  for (const VMFrameInfo& frame : vm.frame_info) {
+    w.str(frame.function_name);
+    w.i32(frame.arg_count);
+    w.i32(frame.local_count);
+    w.u32(frame.constants.size());
+    for (const VMValue& x : frame.constants)
+      w.value(x);
+    w.u32(frame.instructions.size());
+    for (const VMInstr& instr : frame.instructions) {
+      w.u8(static_cast<uint8_t>(instr.opcode()));
+      w.i32(instr.resolved());
+      if (instr.operand().has_value())
+        w.value(instr.operand().value());
+      else
+        w.u8(NO_OPERAND);
+    }
+    w.u32(frame.lines.size());
+    for (const VMLineEntry& entry : frame.lines) {
+      w.i32(entry.pc);
+      w.i32(entry.line);
+      w.i32(entry.column);
+    }
+  }
+  if (!out)
+    throw MyPLException::VMError("unable to write image");
+}
+
+
+void load_image(VM& vm, const char* data, size_t size)
+{
+  Reader r(data, size);
+  if (memcmp(r.bytes(sizeof(MAGIC)), MAGIC, sizeof(MAGIC)) != 0)
+    r.error("not a mypl image");
+  uint32_t version = r.u32();
+  uint32_t opcode_count = r.u32();
+  if (version != IMAGE_VERSION or opcode_count != OPCODE_COUNT)
+    r.error("image version " + to_string(version) + " (expecting " +
+            to_string(IMAGE_VERSION) + "), recompile the program");
+  // the whole image is read and its frames verified before any of it
+  // is added to the vm, so a bad image leaves the vm unchanged
+  // struct layouts (each at least a name and field count)
+  vector<VMStructLayout> layouts(r.count(8));
+  for (VMStructLayout& layout : layouts) {
+    layout.struct_name = r.str();
+    for (uint32_t k = r.count(4); k > 0; --k)
+      layout.field_names.push_back(r.str());
+  }
+  // frames (each at least a name, two ints, and three counts)
+  vector<VMFrameInfo> frames(r.count(24));
+  for (VMFrameInfo& frame : frames) {
+    frame.function_name = r.str();
+    frame.arg_count = r.i32();
+    frame.local_count = r.i32();
+    if (frame.arg_count < 0 or frame.local_count < 0)
+      r.error("negative arg or local count in " + frame.function_name);
+    uint32_t constants = r.count(1);
+    frame.constants.reserve(constants);
+    for (; constants > 0; --constants)
+      frame.constants.push_back(r.value(r.u8()));
+    uint32_t instructions = r.count(6);
+    frame.instructions.reserve(instructions);
+    for (; instructions > 0; --instructions) {
+      uint8_t op = r.u8();
+      if (op >= OPCODE_COUNT)
+        r.error("bad opcode " + to_string(op));
+      int resolved = r.i32();
+      uint8_t type = r.u8();
+      optional<VMValue> operand;
+      if (type != NO_OPERAND)
+        operand = r.value(type);
+      r.check(static_cast<OpCode>(op), operand, resolved);
+      frame.instructions.push_back(
+        VMInstr::make(static_cast<OpCode>(op), operand, resolved));
+    }
+    uint32_t lines = r.count(12);
+    frame.lines.reserve(lines);
+    for (; lines > 0; --lines) {
+      int pc = r.i32();
+      int line = r.i32();
+      int column = r.i32();
+      frame.lines.push_back({pc, line, column});
+    }
+  }
+  if (!r.at_end())
+    r.error("unexpected data after the last frame");
+  unordered_map<string,int> arg_counts;
+  for (const VMFrameInfo& frame : vm.frame_info)
+    arg_counts[frame.function_name] = frame.arg_count;
+  for (const VMFrameInfo& frame : frames)
+    arg_counts[frame.function_name] = frame.arg_count;
+  for (VMFrameInfo& frame : frames) {
+    vm.verify(frame);
+    vm.verify_stack(frame, arg_counts);
+  }
+  for (const VMStructLayout& layout : layouts)
+    vm.add(layout);
+  for (const VMFrameInfo& frame : frames)
+    vm.add(frame);
+}
+
+
+void load_image(VM& vm, const string& path)
+{
+#if defined(MYPL_IMAGE_MMAP)
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw MyPLException::VMError("unable to open image '" + path + "'");
+  struct stat info;
+  if (fstat(fd, &info) < 0 or info.st_size == 0) {
+    close(fd);
+    throw MyPLException::VMError("unable to read image '" + path + "'");
+  }
+  size_t size = info.st_size;
+  void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    throw MyPLException::VMError("unable to read image '" + path + "'");
+  try {
+    load_image(vm, static_cast<const char*>(data), size);
+  } catch (...) {
+    munmap(data, size);
+    throw;
+  }
+  munmap(data, size);
+#else
+  ifstream in(path, ios::binary);
+  if (!in)
+    throw MyPLException::VMError("unable to open image '" + path + "'");
+  vector<char> data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  load_image(vm, data.data(), data.size());
+#endif
+}
+
+
+bool is_image_file(const string& path)
+{
+  ifstream in(path, ios::binary);
+  char magic[sizeof(MAGIC)];
+  return in.read(magic, sizeof(magic)) and
+    memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
@@ -0,0 +1,56 @@
+//----------------------------------------------------------------------
+// FILE: vm_image.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Precompiled (.myplc) program images: the vm's struct layouts
+//       and stack frames in a versioned binary format
+//----------------------------------------------------------------------
+
+#ifndef VM_IMAGE_H
+#define VM_IMAGE_H
+
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include "vm.h"
+
+
+// Image format (integers are little endian, strings are a u32 length
+// followed by their bytes):
+//
+//   magic "MYPLC\r\n\x1a", u32 format version, u32 opcode count
+//   u32 layout count, per layout: name, u32 field count, field names
+//   u32 frame count, per frame:
+//     name, i32 arg count, i32 local count
+//     u32 constant count, constants
+//     u32 instruction count, per instruction:
+//       u8 opcode, i32 resolved operand, operand
+//     u32 line table size, per entry: i32 pc, i32 line, i32 column
+//
+// where each value (constant or operand) is a u8 type (VMType, or
+// 0xff for no operand) followed by an i32 (int), 8 byte IEEE double,
+// u8 (bool), string, or nothing (null). An image is only loaded by
+// the vm it was written for: the version (and opcode count) must match.
+
+
+// the image format version (incremented on any format or opcode change)
+const int IMAGE_VERSION = 1;
+
+
+// write the vm's struct layouts and frames (as generated, before the
+// vm runs) as an image
+void save_image(const VM& vm, std::ostream& out);
+
+// add the struct layouts and frames of the image to the vm (reports
+// invalid and out of date images as vm errors, leaving the vm
+// unchanged)
+void load_image(VM& vm, const char* data, std::size_t size);
+
+// map the image file into memory and load it
+void load_image(VM& vm, const std::string& path);
+
+// true if the file starts with the image magic number
+bool is_image_file(const std::string& path);
+
+
+#endif
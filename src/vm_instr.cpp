@@ -13,12 +13,12 @@ using namespace std;
 
 
 VMInstr::VMInstr(OpCode opcode)
-  : instr_opcode(opcode)
+  : instr_opcode(opcode), instr_exec_opcode(opcode)
 {}
 
 
 VMInstr::VMInstr(OpCode opcode, const VMValue& operand)
-  : instr_opcode(opcode), instr_operand(operand)
+  : instr_opcode(opcode), instr_exec_opcode(opcode), instr_operand(operand)
 {}
 
 
@@ -40,7 +40,50 @@ OpCode VMInstr::opcode() const
 }
 
 
-std::optional<VMValue> VMInstr::operand() const
+OpCode VMInstr::exec_opcode() const
+{
+  return instr_exec_opcode;
+}
+
+
+void VMInstr::set_exec_opcode(OpCode op)
+{
+  instr_exec_opcode = op;
+}
+
+
+int VMInstr::cache_key() const
+{
+  return instr_cache_key;
+}
+
+
+int VMInstr::cache_value() const
+{
+  return instr_cache_value;
+}
+
+
+void VMInstr::set_cache(int key, int value)
+{
+  instr_cache_key = key;
+  instr_cache_value = value;
+}
+
+
+int VMInstr::quicken_misses() const
+{
+  return instr_quicken_misses;
+}
+
+
+void VMInstr::add_quicken_miss()
+{
+  ++instr_quicken_misses;
+}
+
+
+const std::optional<VMValue>& VMInstr::operand() const
 {
   return instr_operand;
 }
@@ -52,12 +95,32 @@ void VMInstr::set_operand(VMValue value)
 }
 
 
+int VMInstr::resolved() const
+{
+  return instr_resolved;
+}
+
+
+void VMInstr::set_resolved(int value)
+{
+  instr_resolved = value;
+}
+
+
 VMInstr VMInstr::PUSH(const VMValue& value)
 {
   return VMInstr(OpCode::PUSH, value);
 }
 
 
+VMInstr VMInstr::PUSHK(int constant_index)
+{
+  VMInstr instr(OpCode::PUSHK, constant_index);
+  instr.set_resolved(constant_index);
+  return instr;
+}
+
+
 VMInstr VMInstr::POP()
 {
   return VMInstr(OpCode::POP);
@@ -154,6 +217,126 @@ VMInstr VMInstr::CMPNE()
 }
 
 
+VMInstr VMInstr::ADDI()
+{
+  return VMInstr(OpCode::ADDI);
+}
+
+
+VMInstr VMInstr::ADDD()
+{
+  return VMInstr(OpCode::ADDD);
+}
+
+
+VMInstr VMInstr::SUBI()
+{
+  return VMInstr(OpCode::SUBI);
+}
+
+
+VMInstr VMInstr::SUBD()
+{
+  return VMInstr(OpCode::SUBD);
+}
+
+
+VMInstr VMInstr::MULI()
+{
+  return VMInstr(OpCode::MULI);
+}
+
+
+VMInstr VMInstr::MULD()
+{
+  return VMInstr(OpCode::MULD);
+}
+
+
+VMInstr VMInstr::DIVI()
+{
+  return VMInstr(OpCode::DIVI);
+}
+
+
+VMInstr VMInstr::DIVD()
+{
+  return VMInstr(OpCode::DIVD);
+}
+
+
+VMInstr VMInstr::CMPLTI()
+{
+  return VMInstr(OpCode::CMPLTI);
+}
+
+
+VMInstr VMInstr::CMPLTD()
+{
+  return VMInstr(OpCode::CMPLTD);
+}
+
+
+VMInstr VMInstr::CMPLTS()
+{
+  return VMInstr(OpCode::CMPLTS);
+}
+
+
+VMInstr VMInstr::CMPLEI()
+{
+  return VMInstr(OpCode::CMPLEI);
+}
+
+
+VMInstr VMInstr::CMPLED()
+{
+  return VMInstr(OpCode::CMPLED);
+}
+
+
+VMInstr VMInstr::CMPLES()
+{
+  return VMInstr(OpCode::CMPLES);
+}
+
+
+VMInstr VMInstr::CMPGTI()
+{
+  return VMInstr(OpCode::CMPGTI);
+}
+
+
+VMInstr VMInstr::CMPGTD()
+{
+  return VMInstr(OpCode::CMPGTD);
+}
+
+
+VMInstr VMInstr::CMPGTS()
+{
+  return VMInstr(OpCode::CMPGTS);
+}
+
+
+VMInstr VMInstr::CMPGEI()
+{
+  return VMInstr(OpCode::CMPGEI);
+}
+
+
+VMInstr VMInstr::CMPGED()
+{
+  return VMInstr(OpCode::CMPGED);
+}
+
+
+VMInstr VMInstr::CMPGES()
+{
+  return VMInstr(OpCode::CMPGES);
+}
+
+
 VMInstr VMInstr::JMP(int instruction_index)
 {
   return VMInstr(OpCode::JMP, instruction_index);
@@ -172,6 +355,12 @@ VMInstr VMInstr::CALL(const std::string& function)
 }
 
 
+VMInstr VMInstr::TAILCALL(const std::string& function)
+{
+  return VMInstr(OpCode::TAILCALL, function);
+}
+
+
 VMInstr VMInstr::RET()
 {
   return VMInstr(OpCode::RET);  
@@ -238,6 +427,12 @@ VMInstr VMInstr::ALLOCS()
 }
 
 
+VMInstr VMInstr::ALLOCS(const string& struct_name)
+{
+  return VMInstr(OpCode::ALLOCS, struct_name);
+}
+
+
 VMInstr VMInstr::ALLOCA()
 {
   return VMInstr(OpCode::ALLOCA);    
@@ -256,12 +451,28 @@ VMInstr VMInstr::SETF(const string& field)
 }
 
 
+VMInstr VMInstr::SETF(const string& field, int offset)
+{
+  VMInstr instr(OpCode::SETF, field);
+  instr.set_resolved(offset);
+  return instr;
+}
+
+
 VMInstr VMInstr::GETF(const string& field)
 {
   return VMInstr(OpCode::GETF, field);
 }
 
 
+VMInstr VMInstr::GETF(const string& field, int offset)
+{
+  VMInstr instr(OpCode::GETF, field);
+  instr.set_resolved(offset);
+  return instr;
+}
+
+
 VMInstr VMInstr::SETI()
 {
   return VMInstr(OpCode::SETI);      
@@ -296,26 +507,37 @@ VMInstr VMInstr::DELS()
 }
 
 
+VMInstr VMInstr::make(OpCode opcode, const optional<VMValue>& operand,
+                      int resolved)
+{
+  VMInstr instr(opcode);
+  instr.instr_operand = operand;
+  instr.instr_resolved = resolved;
+  return instr;
+}
+
+
 string to_string(const VMValue& val) {
-  if (holds_alternative<int>(val))
-    return to_string(get<int>(val));
-  else if (holds_alternative<double>(val))
-    return to_string(get<double>(val));
-  else if (holds_alternative<bool>(val) and get<bool>(val))
+  if (val.is_int() or val.is_handle())
+    return to_string(val.as_int());
+  else if (val.is_double())
+    return to_string(val.as_double());
+  else if (val.is_bool() and val.as_bool())
     return "true";
-  else if (holds_alternative<bool>(val) and !get<bool>(val))
+  else if (val.is_bool() and !val.as_bool())
     return "false";
-  else if (holds_alternative<string>(val))
-    return get<string>(val);
+  else if (val.is_string())
+    return val.as_string();
   else
     return "null";
 }
 
 
-std::string to_string(const VMInstr& instr)
+std::string to_string(OpCode op)
 {
-  std::unordered_map<OpCode, string> os = {
-    {OpCode::PUSH, "PUSH"}, {OpCode::POP, "POP"},
+  static const std::unordered_map<OpCode, string> os = {
+    {OpCode::PUSH, "PUSH"}, {OpCode::PUSHK, "PUSHK"},
+    {OpCode::POP, "POP"},
     {OpCode::LOAD, "LOAD"}, {OpCode::STORE, "STORE"},
     {OpCode::ADD, "ADD"}, {OpCode::SUB, "SUB"},
     {OpCode::MUL, "MUL"}, {OpCode::DIV, "DIV"},
@@ -325,6 +547,7 @@ std::string to_string(const VMInstr& instr)
     {OpCode::CMPGE, "CMPGE"}, {OpCode::CMPEQ, "CMPEQ"}, 
     {OpCode::CMPNE, "CMPNE"}, {OpCode::JMP, "JMP"},
     {OpCode::JMPF, "JMPF"}, {OpCode::CALL, "CALL"},
+    {OpCode::TAILCALL, "TAILCALL"},
     {OpCode::RET, "RET"}, {OpCode::WRITE, "WRITE"},
     {OpCode::READ, "READ"}, {OpCode::SLEN, "SLEN"},
     {OpCode::ALEN, "ALEN"}, {OpCode::GETC, "GETC"},
@@ -335,13 +558,106 @@ std::string to_string(const VMInstr& instr)
     {OpCode::SETF, "SETF"}, {OpCode::GETI, "GETI"},
     {OpCode::SETI, "SETI"}, {OpCode::DUP, "DUP"},
     {OpCode::NOP, "NOP"}, {OpCode::DELAR, "DELAR"},
-    {OpCode::DELS, "DELS"}
+    {OpCode::DELS, "DELS"}, {OpCode::INCL, "INCL"},
+    {OpCode::CMPLT_JMPF, "CMPLT_JMPF"}, {OpCode::CMPLE_JMPF, "CMPLE_JMPF"},
+    {OpCode::CMPGT_JMPF, "CMPGT_JMPF"}, {OpCode::CMPGE_JMPF, "CMPGE_JMPF"},
+    {OpCode::CMPEQ_JMPF, "CMPEQ_JMPF"}, {OpCode::CMPNE_JMPF, "CMPNE_JMPF"},
+    {OpCode::LOADL_GETF, "LOADL_GETF"},
+    {OpCode::GETF_Q, "GETF_Q"},
+    {OpCode::ADDI, "ADDI"}, {OpCode::ADDD, "ADDD"},
+    {OpCode::SUBI, "SUBI"}, {OpCode::SUBD, "SUBD"},
+    {OpCode::MULI, "MULI"}, {OpCode::MULD, "MULD"},
+    {OpCode::DIVI, "DIVI"}, {OpCode::DIVD, "DIVD"},
+    {OpCode::CMPLTI, "CMPLTI"}, {OpCode::CMPLTD, "CMPLTD"},
+    {OpCode::CMPLTS, "CMPLTS"}, {OpCode::CMPLEI, "CMPLEI"},
+    {OpCode::CMPLED, "CMPLED"}, {OpCode::CMPLES, "CMPLES"},
+    {OpCode::CMPGTI, "CMPGTI"}, {OpCode::CMPGTD, "CMPGTD"},
+    {OpCode::CMPGTS, "CMPGTS"}, {OpCode::CMPGEI, "CMPGEI"},
+    {OpCode::CMPGED, "CMPGED"}, {OpCode::CMPGES, "CMPGES"}
   };
+  return os.at(op);
+}
+
+
+bool stack_effect(OpCode op, int& pops, int& pushes)
+{
+  switch (op) {
+  case OpCode::PUSH:
+  case OpCode::PUSHK:
+  case OpCode::LOAD:
+  case OpCode::READ:
+  case OpCode::ALLOCS:
+    pops = 0;
+    pushes = 1;
+    return true;
+  case OpCode::DUP:
+    pops = 1;
+    pushes = 2;
+    return true;
+  case OpCode::NOT:
+  case OpCode::SLEN:
+  case OpCode::ALEN:
+  case OpCode::TOINT:
+  case OpCode::TODBL:
+  case OpCode::TOSTR:
+  case OpCode::GETF:
+    pops = 1;
+    pushes = 1;
+    return true;
+  case OpCode::JMP:
+  case OpCode::NOP:
+    pops = 0;
+    pushes = 0;
+    return true;
+  case OpCode::POP:
+  case OpCode::STORE:
+  case OpCode::JMPF:
+  case OpCode::WRITE:
+  case OpCode::ADDF:
+  case OpCode::DELAR:
+  case OpCode::DELS:
+    pops = 1;
+    pushes = 0;
+    return true;
+  case OpCode::ADD: case OpCode::SUB: case OpCode::MUL: case OpCode::DIV:
+  case OpCode::AND: case OpCode::OR:
+  case OpCode::CMPLT: case OpCode::CMPLE: case OpCode::CMPGT:
+  case OpCode::CMPGE: case OpCode::CMPEQ: case OpCode::CMPNE:
+  case OpCode::ADDI: case OpCode::ADDD: case OpCode::SUBI:
+  case OpCode::SUBD: case OpCode::MULI: case OpCode::MULD:
+  case OpCode::DIVI: case OpCode::DIVD:
+  case OpCode::CMPLTI: case OpCode::CMPLTD: case OpCode::CMPLTS:
+  case OpCode::CMPLEI: case OpCode::CMPLED: case OpCode::CMPLES:
+  case OpCode::CMPGTI: case OpCode::CMPGTD: case OpCode::CMPGTS:
+  case OpCode::CMPGEI: case OpCode::CMPGED: case OpCode::CMPGES:
+  case OpCode::GETC:
+  case OpCode::CONCAT:
+  case OpCode::ALLOCA:
+  case OpCode::GETI:
+    pops = 2;
+    pushes = 1;
+    return true;
+  case OpCode::SETF:
+    pops = 2;
+    pushes = 0;
+    return true;
+  case OpCode::SETI:
+    pops = 3;
+    pushes = 0;
+    return true;
+  default:
+    return false;
+  }
+}
+
+
+std::string to_string(const VMInstr& instr)
+{
   string vstr = "";
   if (instr.operand().has_value()) {
     vstr = to_string(instr.operand().value());
   }
-  string s = os[instr.opcode()] + "(" + vstr + ")";
+  string s = to_string(instr.opcode()) + "(" + vstr + ")";
   if (instr.instr_comment != "")
     s += "  // " + instr.instr_comment;
   return s;
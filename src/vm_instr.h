@@ -9,18 +9,23 @@
 #ifndef VM_INSTR_H
 #define VM_INSTR_H
 
-#include <variant>
 #include <optional>
 #include <string>
 #include "op_code.h"
+#include "vm_value.h"
 
 
-// vm values are one of int, double, bool, string, or nullptr_t
-typedef std::variant<int, double, bool, std::string, std::nullptr_t> VMValue;
-
 // function to get a string representation of a vm_value
 std::string to_string(const VMValue& val);
 
+// function to get the name of an opcode
+std::string to_string(OpCode op);
+
+// the number of operand stack values an instruction with the opcode
+// pops and pushes (false for CALL, TAILCALL, and RET, whose effect
+// depends on the frames, and for superinstructions)
+bool stack_effect(OpCode op, int& pops, int& pushes);
+
 
 class VMInstr
 {
@@ -28,6 +33,7 @@ public:
 
   // static creation functions for the various types of instructions
   static VMInstr PUSH(const VMValue& value);
+  static VMInstr PUSHK(int constant_index);
   static VMInstr POP();
   static VMInstr LOAD(int mem_addr);
   static VMInstr STORE(int mem_addr);
@@ -44,9 +50,30 @@ public:
   static VMInstr CMPGE();
   static VMInstr CMPEQ();
   static VMInstr CMPNE();
+  static VMInstr ADDI();
+  static VMInstr ADDD();
+  static VMInstr SUBI();
+  static VMInstr SUBD();
+  static VMInstr MULI();
+  static VMInstr MULD();
+  static VMInstr DIVI();
+  static VMInstr DIVD();
+  static VMInstr CMPLTI();
+  static VMInstr CMPLTD();
+  static VMInstr CMPLTS();
+  static VMInstr CMPLEI();
+  static VMInstr CMPLED();
+  static VMInstr CMPLES();
+  static VMInstr CMPGTI();
+  static VMInstr CMPGTD();
+  static VMInstr CMPGTS();
+  static VMInstr CMPGEI();
+  static VMInstr CMPGED();
+  static VMInstr CMPGES();
   static VMInstr JMP(int instruction_index);
   static VMInstr JMPF(int instruction_index);
   static VMInstr CALL(const std::string& function);
+  static VMInstr TAILCALL(const std::string& function);
   static VMInstr RET();
   static VMInstr WRITE();
   static VMInstr READ();
@@ -58,10 +85,13 @@ public:
   static VMInstr TOSTR();
   static VMInstr CONCAT();
   static VMInstr ALLOCS();
+  static VMInstr ALLOCS(const std::string& struct_name);
   static VMInstr ALLOCA();
   static VMInstr ADDF(const std::string& field);
   static VMInstr SETF(const std::string& field);
+  static VMInstr SETF(const std::string& field, int offset);
   static VMInstr GETF(const std::string& field);
+  static VMInstr GETF(const std::string& field, int offset);
   static VMInstr SETI();
   static VMInstr GETI(); 
   static VMInstr DELS(); 
@@ -69,6 +99,11 @@ public:
   static VMInstr DUP();
   static VMInstr NOP();
 
+  // create an instruction from its opcode, operand, and resolved
+  // operand (e.g., when loading a precompiled program)
+  static VMInstr make(OpCode opcode, const std::optional<VMValue>& operand,
+                      int resolved);
+
   // set the instruction's comment (optional)
   void set_comment(const std::string& comment);
 
@@ -78,11 +113,36 @@ public:
   // returns the instruction's opcode
   OpCode opcode() const;
 
+  // returns the opcode the vm executes: a superinstruction standing
+  // for this and the following instructions, or else opcode()
+  OpCode exec_opcode() const;
+
+  // set the executed opcode (opcode() to reset it)
+  void set_exec_opcode(OpCode op);
+
+  // inline cache of a quickened instruction, e.g., the struct layout
+  // (key) and field offset (value) of a quickened GETF
+  int cache_key() const;
+  int cache_value() const;
+  void set_cache(int key, int value);
+
+  // number of times the instruction's quickened form failed its type
+  // guard and was reset to the generic form
+  int quicken_misses() const;
+  void add_quicken_miss();
+
   // returns the operand for those instructions with operands
-  std::optional<VMValue> operand() const;
+  const std::optional<VMValue>& operand() const;
 
   // set the operand value
   void set_operand(VMValue value);
+
+  // returns the resolved (integer) form of the operand, e.g., the
+  // function index of a CALL, or -1 if the operand is not resolved
+  int resolved() const;
+
+  // set the resolved form of the operand
+  void set_resolved(int value);
   
   // pretty print the instruction
   friend std::string to_string(const VMInstr& instr);
@@ -92,9 +152,21 @@ private:
   // each instruction has an opcode
   OpCode instr_opcode;
 
+  // the opcode executed in its place (set by the optimizer, or by the
+  // vm when quickening)
+  OpCode instr_exec_opcode;
+
+  // inline cache and type guard failures (for quickening)
+  int instr_cache_key = -1;
+  int instr_cache_value = -1;
+  int instr_quicken_misses = 0;
+
   // some instructions have operands
   std::optional<VMValue> instr_operand;
 
+  // resolved form of the operand (set when linking)
+  int instr_resolved = -1;
+
   // comments can be optionally added
   std::string instr_comment;
 
@@ -0,0 +1,547 @@
+//----------------------------------------------------------------------
+// FILE: vm_jit.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Baseline x86-64 compiler for hot VM frames
+//----------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include "vm_jit.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MYPL_JIT_X86_64
+#endif
+
+using namespace std;
+
+
+#if defined(MYPL_JIT_X86_64)
+
+namespace {
+
+// register encodings (the native code has no calls, so it only uses
+// the argument and scratch registers of the System V calling
+// convention: rdi = locals, rsi = &top, rdx = pc, rcx = limit, and
+// throughout the code r8 = top and r9 = limit)
+enum Reg {RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9};
+enum XReg {XMM0 = 0, XMM1 = 1};
+
+// condition codes (of jcc and setcc)
+enum Cond {CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7, CC_L = 0xC,
+           CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF};
+
+
+// Emits the x86-64 encodings of the (few) instructions the jit uses.
+// Memory operands are always [base + disp32] with a base other than
+// rsp, rbp, r12, or r13 (which need a different encoding).
+class Assembler
+{
+public:
+
+  vector<unsigned char> code;
+
+  // labels are bound to a code offset, jumps to them are rel32
+  int label()
+  {
+    labels.push_back(-1);
+    return labels.size() - 1;
+  }
+
+  void bind(int l)
+  {
+    labels[l] = code.size();
+  }
+
+  int offset(int l) const
+  {
+    return labels[l];
+  }
+
+  // patch each jump with the distance to its label
+  void resolve()
+  {
+    for (auto [at, l] : fixups) {
+      int32_t rel = labels[l] - (at + 4);
+      memcpy(&code[at], &rel, 4);
+    }
+  }
+
+  void byte(int b) {code.push_back(b & 0xFF);}
+
+  void dword(int32_t d)
+  {
+    for (int i = 0; i < 4; ++i)
+      byte(d >> (8 * i));
+  }
+
+  void qword(uint64_t q)
+  {
+    for (int i = 0; i < 8; ++i)
+      byte(q >> (8 * i));
+  }
+
+  // [prefix] [rex] op modrm(reg, [base + disp32])
+  void mem(initializer_list<int> op, int reg, int base, int disp,
+           bool wide = false, int prefix = 0)
+  {
+    if (prefix)
+      byte(prefix);
+    rex(wide, reg, base);
+    for (int b : op)
+      byte(b);
+    byte(0x80 | ((reg & 7) << 3) | (base & 7));
+    dword(disp);
+  }
+
+  // [prefix] [rex] op modrm(reg, rm) with register operands
+  void regs(initializer_list<int> op, int reg, int rm, bool wide = false,
+            int prefix = 0)
+  {
+    if (prefix)
+      byte(prefix);
+    rex(wide, reg, rm);
+    for (int b : op)
+      byte(b);
+    byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+  }
+
+  // moves
+  void load64(int dst, int base, int disp) {mem({0x8B}, dst, base, disp, true);}
+  void store64(int base, int disp, int src) {mem({0x89}, src, base, disp, true);}
+  void load32(int dst, int base, int disp) {mem({0x8B}, dst, base, disp);}
+  void store32(int base, int disp, int src) {mem({0x89}, src, base, disp);}
+  void load8(int dst, int base, int disp) {mem({0x0F, 0xB6}, dst, base, disp);}
+  void store8(int base, int disp, int src) {mem({0x88}, src, base, disp);}
+  void store8_imm(int base, int disp, int imm) {mem({0xC6}, 0, base, disp); byte(imm);}
+  void mov64(int dst, int src) {regs({0x89}, src, dst, true);}
+
+  void mov64_imm(int dst, uint64_t imm)
+  {
+    rex(true, 0, dst);
+    byte(0xB8 + (dst & 7));
+    qword(imm);
+  }
+
+  // integer operations (on 32-bit registers unless noted)
+  void add(int dst, int src) {regs({0x01}, src, dst);}
+  void sub(int dst, int src) {regs({0x29}, src, dst);}
+  void imul(int dst, int src) {regs({0x0F, 0xAF}, dst, src);}
+  void and_(int dst, int src) {regs({0x21}, src, dst);}
+  void or_(int dst, int src) {regs({0x09}, src, dst);}
+  void cdq() {byte(0x99);}
+  void idiv(int src) {regs({0xF7}, 7, src);}
+  void add64_imm(int dst, int imm) {regs({0x83}, 0, dst, true); byte(imm);}
+  void cmp(int x, int y) {regs({0x39}, y, x);}
+  void cmp64(int x, int y) {regs({0x39}, y, x, true);}
+  void cmp_imm(int x, int32_t imm) {regs({0x81}, 7, x); dword(imm);}
+  void cmp_mem(int x, int base, int disp) {mem({0x3B}, x, base, disp);}
+  void cmp8_imm(int base, int disp, int imm) {mem({0x80}, 7, base, disp); byte(imm);}
+  void xor8_imm(int base, int disp, int imm) {mem({0x80}, 6, base, disp); byte(imm);}
+  void test(int x) {regs({0x85}, x, x);}
+  void setcc(int cc) {regs({0x0F, 0x90 | cc}, 0, RAX);}
+
+  // double operations (sse2)
+  void load_sd(int dst, int base, int disp) {mem({0x0F, 0x10}, dst, base, disp, false, 0xF2);}
+  void store_sd(int base, int disp, int src) {mem({0x0F, 0x11}, src, base, disp, false, 0xF2);}
+  void op_sd(int op, int dst, int base, int disp) {mem({0x0F, op}, dst, base, disp, false, 0xF2);}
+  void ucomisd(int x, int y) {regs({0x0F, 0x2E}, x, y, false, 0x66);}
+
+  // control flow
+  void jmp(int l) {byte(0xE9); fixup(l);}
+  void jcc(int cc, int l) {byte(0x0F); byte(0x80 | cc); fixup(l);}
+  void ret() {byte(0xC3);}
+
+private:
+
+  vector<int> labels;
+  vector<pair<int, int>> fixups;
+
+  void rex(bool wide, int reg, int rm)
+  {
+    int bits = (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+    if (bits)
+      byte(0x40 | bits);
+  }
+
+  void fixup(int l)
+  {
+    fixups.push_back({(int) code.size(), l});
+    dword(0);
+  }
+
+};
+
+}
+
+#endif
+
+
+VMJit::~VMJit()
+{
+#if defined(MYPL_JIT_X86_64)
+  for (auto [region, size] : regions)
+    munmap(region, size);
+#endif
+}
+
+
+bool VMJit::supported()
+{
+#if defined(MYPL_JIT_X86_64)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+int VMJit::compiled_count() const
+{
+  return regions.size();
+}
+
+
+VMNativeCode VMJit::compile(const VMFrameInfo& info)
+{
+#if defined(MYPL_JIT_X86_64)
+  // value slot layout
+  const int SLOT = sizeof(VMValue);
+  const int TAG = offsetof(VMValue, tag);
+  const int VAL = offsetof(VMValue, raw);
+  auto type_tag = [](VMType t) {return static_cast<int>(t);};
+  const int INT = type_tag(VMType::INT);
+  const int DBL = type_tag(VMType::DOUBLE);
+  const int BOOL = type_tag(VMType::BOOL);
+  const int STR = type_tag(VMType::STRING);
+  const int NUL = type_tag(VMType::NULLPTR);
+  // the top operand (x) and the one below it (y)
+  const int X_TAG = -SLOT + TAG, X_VAL = -SLOT + VAL;
+  const int Y_TAG = -2 * SLOT + TAG, Y_VAL = -2 * SLOT + VAL;
+
+  int size = info.instructions.size();
+  Assembler a;
+  vector<int> at(size + 1);
+  for (int& l : at)
+    l = a.label();
+  // exit stubs, created for the instructions that need one
+  vector<int> exits(size + 1, -1);
+  auto exit = [&](int pc) {
+    if (exits[pc] == -1)
+      exits[pc] = a.label();
+    return exits[pc];
+  };
+
+  // entry: jump to the code of instruction pc (through the table
+  // following the code, its address is patched in below)
+  a.load64(R8, RSI, 0);
+  a.mov64(R9, RCX);
+  int table_imm = a.code.size() + 2;
+  a.mov64_imm(RAX, 0);
+  a.byte(0x48); a.byte(0x63); a.byte(0xD2);     // movsxd rdx, edx
+  a.byte(0xFF); a.byte(0x24); a.byte(0xD0);     // jmp [rax + rdx*8]
+
+  // helpers for the instruction templates (each checks its guards
+  // before changing any slot, so a failed guard can hand the
+  // instruction to the interpreter as is)
+  auto pop = [&]() {
+    a.store8_imm(R8, X_TAG, NUL);
+    a.add64_imm(R8, -SLOT);
+  };
+  auto push_guard = [&](int pc) {
+    a.cmp64(R8, R9);
+    a.jcc(CC_E, exit(pc));
+  };
+  auto copy_slot = [&](int dst_base, int dst, int src_base, int src) {
+    a.load64(RAX, src_base, src);
+    a.store64(dst_base, dst, RAX);
+    a.load64(RAX, src_base, src + 8);
+    a.store64(dst_base, dst + 8, RAX);
+  };
+  // check both operands are ints (falling through) or doubles (going
+  // to the returned label)
+  auto number_guard = [&](int pc) {
+    int dbl = a.label();
+    a.load8(RAX, R8, Y_TAG);
+    a.load8(RCX, R8, X_TAG);
+    a.cmp(RAX, RCX);
+    a.jcc(CC_NE, exit(pc));
+    a.cmp_imm(RAX, INT);
+    a.jcc(CC_NE, dbl);
+    return dbl;
+  };
+  auto double_guard = [&](int pc, int dbl) {
+    a.bind(dbl);
+    a.cmp_imm(RAX, DBL);
+    a.jcc(CC_NE, exit(pc));
+  };
+  // the bool in al replaces the operands
+  auto push_bool = [&]() {
+    a.store8_imm(R8, Y_TAG, BOOL);
+    a.store8(R8, Y_VAL, RAX);
+    pop();
+  };
+
+  int compiled = 0;
+  for (int pc = 0; pc < size; ++pc) {
+    const VMInstr& instr = info.instructions[pc];
+    a.bind(at[pc]);
+    ++compiled;
+    switch (instr.opcode()) {
+
+    case OpCode::PUSH:
+    case OpCode::PUSHK: {
+      const VMValue& v = instr.opcode() == OpCode::PUSH ?
+        instr.operand().value() : info.constants[instr.resolved()];
+      // pushing a string adds a reference (left to the interpreter)
+      if (v.is_string()) {
+        --compiled;
+        a.jmp(exit(pc));
+        break;
+      }
+      push_guard(pc);
+      a.store8_imm(R8, TAG, type_tag(v.type()));
+      a.mov64_imm(RAX, v.raw);
+      a.store64(R8, VAL, RAX);
+      a.add64_imm(R8, SLOT);
+      break;
+    }
+
+    case OpCode::POP:
+      a.cmp8_imm(R8, X_TAG, STR);
+      a.jcc(CC_E, exit(pc));
+      pop();
+      break;
+
+    case OpCode::DUP:
+      push_guard(pc);
+      a.cmp8_imm(R8, X_TAG, STR);
+      a.jcc(CC_E, exit(pc));
+      copy_slot(R8, 0, R8, -SLOT);
+      a.add64_imm(R8, SLOT);
+      break;
+
+    case OpCode::LOAD: {
+      int local = SLOT * instr.operand().value().as_int();
+      push_guard(pc);
+      a.cmp8_imm(RDI, local + TAG, STR);
+      a.jcc(CC_E, exit(pc));
+      copy_slot(R8, 0, RDI, local);
+      a.add64_imm(R8, SLOT);
+      break;
+    }
+
+    case OpCode::STORE: {
+      // moving the operand (even a string) only needs the old value to
+      // not be a string
+      int local = SLOT * instr.operand().value().as_int();
+      a.cmp8_imm(RDI, local + TAG, STR);
+      a.jcc(CC_E, exit(pc));
+      copy_slot(RDI, local, R8, -SLOT);
+      pop();
+      break;
+    }
+
+    case OpCode::ADD: case OpCode::ADDI: case OpCode::ADDD:
+    case OpCode::SUB: case OpCode::SUBI: case OpCode::SUBD:
+    case OpCode::MUL: case OpCode::MULI: case OpCode::MULD:
+    case OpCode::DIV: case OpCode::DIVI: case OpCode::DIVD: {
+      OpCode op = instr.opcode();
+      bool add = op == OpCode::ADD or op == OpCode::ADDI or op == OpCode::ADDD;
+      bool sub = op == OpCode::SUB or op == OpCode::SUBI or op == OpCode::SUBD;
+      bool mul = op == OpCode::MUL or op == OpCode::MULI or op == OpCode::MULD;
+      int done = a.label();
+      int dbl = number_guard(pc);
+      a.load32(RAX, R8, Y_VAL);
+      a.load32(RCX, R8, X_VAL);
+      if (add)
+        a.add(RAX, RCX);
+      else if (sub)
+        a.sub(RAX, RCX);
+      else if (mul)
+        a.imul(RAX, RCX);
+      else {
+        // the interpreter handles the divisions that trap
+        a.cmp_imm(RCX, 0);
+        a.jcc(CC_E, exit(pc));
+        a.cmp_imm(RCX, -1);
+        a.jcc(CC_E, exit(pc));
+        a.cdq();
+        a.idiv(RCX);
+      }
+      a.store32(R8, Y_VAL, RAX);
+      a.jmp(done);
+      double_guard(pc, dbl);
+      a.load_sd(XMM0, R8, Y_VAL);
+      a.op_sd(add ? 0x58 : sub ? 0x5C : mul ? 0x59 : 0x5E, XMM0, R8, X_VAL);
+      a.store_sd(R8, Y_VAL, XMM0);
+      a.bind(done);
+      pop();
+      break;
+    }
+
+    case OpCode::CMPLT: case OpCode::CMPLTI: case OpCode::CMPLTD:
+    case OpCode::CMPLE: case OpCode::CMPLEI: case OpCode::CMPLED:
+    case OpCode::CMPGT: case OpCode::CMPGTI: case OpCode::CMPGTD:
+    case OpCode::CMPGE: case OpCode::CMPGEI: case OpCode::CMPGED: {
+      OpCode op = instr.opcode();
+      bool lt = op == OpCode::CMPLT or op == OpCode::CMPLTI or op == OpCode::CMPLTD;
+      bool le = op == OpCode::CMPLE or op == OpCode::CMPLEI or op == OpCode::CMPLED;
+      bool gt = op == OpCode::CMPGT or op == OpCode::CMPGTI or op == OpCode::CMPGTD;
+      int done = a.label();
+      int dbl = number_guard(pc);
+      a.load32(RAX, R8, Y_VAL);
+      a.cmp_mem(RAX, R8, X_VAL);
+      a.setcc(lt ? CC_L : le ? CC_LE : gt ? CC_G : CC_GE);
+      a.jmp(done);
+      // y < x is x > y (and so on) as only "above" is false when a
+      // double is NaN
+      double_guard(pc, dbl);
+      a.load_sd(XMM0, R8, Y_VAL);
+      a.load_sd(XMM1, R8, X_VAL);
+      if (lt or le)
+        a.ucomisd(XMM1, XMM0);
+      else
+        a.ucomisd(XMM0, XMM1);
+      a.setcc(lt or gt ? CC_A : CC_AE);
+      a.bind(done);
+      push_bool();
+      break;
+    }
+
+    case OpCode::CMPEQ:
+    case OpCode::CMPNE: {
+      // nulls, ints, handles, and bools (else left to the interpreter)
+      int cc = instr.opcode() == OpCode::CMPEQ ? CC_E : CC_NE;
+      int null = a.label();
+      int boolean = a.label();
+      int done = a.label();
+      a.load8(RAX, R8, Y_TAG);
+      a.load8(RCX, R8, X_TAG);
+      for (int r : {RAX, RCX}) {
+        for (int t : {STR, DBL}) {
+          a.cmp_imm(r, t);
+          a.jcc(CC_E, exit(pc));
+        }
+      }
+      for (int r : {RAX, RCX}) {
+        a.cmp_imm(r, NUL);
+        a.jcc(CC_E, null);
+      }
+      a.cmp(RAX, RCX);
+      a.jcc(CC_NE, exit(pc));
+      a.cmp_imm(RAX, BOOL);
+      a.jcc(CC_E, boolean);
+      a.load32(RAX, R8, Y_VAL);
+      a.cmp_mem(RAX, R8, X_VAL);
+      a.setcc(cc);
+      a.jmp(done);
+      a.bind(boolean);
+      a.load8(RAX, R8, Y_VAL);
+      a.load8(RCX, R8, X_VAL);
+      a.cmp(RAX, RCX);
+      a.setcc(cc);
+      a.jmp(done);
+      // equal only if both are null
+      a.bind(null);
+      a.cmp(RAX, RCX);
+      a.setcc(cc);
+      a.bind(done);
+      push_bool();
+      break;
+    }
+
+    case OpCode::AND:
+    case OpCode::OR:
+      a.cmp8_imm(R8, Y_TAG, BOOL);
+      a.jcc(CC_NE, exit(pc));
+      a.cmp8_imm(R8, X_TAG, BOOL);
+      a.jcc(CC_NE, exit(pc));
+      a.load8(RAX, R8, Y_VAL);
+      a.load8(RCX, R8, X_VAL);
+      if (instr.opcode() == OpCode::AND)
+        a.and_(RAX, RCX);
+      else
+        a.or_(RAX, RCX);
+      push_bool();
+      break;
+
+    case OpCode::NOT:
+      a.cmp8_imm(R8, X_TAG, BOOL);
+      a.jcc(CC_NE, exit(pc));
+      a.xor8_imm(R8, X_VAL, 1);
+      break;
+
+    case OpCode::JMP:
+      a.jmp(at[instr.operand().value().as_int()]);
+      break;
+
+    case OpCode::JMPF:
+      // a non-bool is popped without jumping (by the interpreter)
+      a.cmp8_imm(R8, X_TAG, BOOL);
+      a.jcc(CC_NE, exit(pc));
+      a.load8(RAX, R8, X_VAL);
+      pop();
+      a.test(RAX);
+      a.jcc(CC_E, at[instr.operand().value().as_int()]);
+      break;
+
+    case OpCode::NOP:
+      break;
+
+    default:
+      // calls, returns, built-ins, and heap operations
+      --compiled;
+      a.jmp(exit(pc));
+    }
+  }
+  a.bind(at[size]);
+  a.jmp(exit(size));
+  if (compiled == 0)
+    return nullptr;
+
+  // exit stubs: save the top and return the pc to continue from
+  for (int pc = 0; pc <= size; ++pc) {
+    if (exits[pc] == -1)
+      continue;
+    a.bind(exits[pc]);
+    a.store64(RSI, 0, R8);
+    a.byte(0xB8);                               // mov eax, pc
+    a.dword(pc);
+    a.ret();
+  }
+  a.resolve();
+
+  // copy the code followed by its jump table into executable memory
+  while (a.code.size() % 8)
+    a.byte(0xCC);
+  size_t table = a.code.size();
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = table + (size + 1) * sizeof(void*);
+  length = (length + page - 1) / page * page;
+  void* region = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED)
+    return nullptr;
+  unsigned char* base = static_cast<unsigned char*>(region);
+  uint64_t table_address = reinterpret_cast<uint64_t>(base + table);
+  memcpy(&a.code[table_imm], &table_address, 8);
+  memcpy(base, a.code.data(), a.code.size());
+  for (int pc = 0; pc <= size; ++pc) {
+    unsigned char* target = base + a.offset(at[pc]);
+    memcpy(base + table + pc * sizeof(void*), &target, sizeof(void*));
+  }
+  if (mprotect(region, length, PROT_READ | PROT_EXEC) != 0) {
+    munmap(region, length);
+    return nullptr;
+  }
+  regions.push_back({region, length});
+  return reinterpret_cast<VMNativeCode>(region);
+#else
+  return nullptr;
+#endif
+}
@@ -0,0 +1,54 @@
+//----------------------------------------------------------------------
+// FILE: vm_jit.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Baseline x86-64 compiler for hot VM frames
+//----------------------------------------------------------------------
+
+#ifndef VM_JIT_H
+#define VM_JIT_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "vm_frame.h"
+
+
+// The jit translates a frame's instructions one at a time into x86-64
+// code (Linux only) that works directly on the vm value stack: the
+// frame's locals and operands stay in the same slots as when they are
+// interpreted, so the vm can switch between the native code and the
+// interpreter at any instruction. The native code returns the pc of
+// the first instruction it does not run (an unsupported instruction,
+// e.g., a CALL, RET, or heap operation, or one whose operands fail its
+// type guard) for the interpreter to continue from.
+class VMJit
+{
+public:
+
+  VMJit() = default;
+  VMJit(const VMJit&) = delete;
+  VMJit& operator=(const VMJit&) = delete;
+
+  // releases the native code
+  ~VMJit();
+
+  // true if native code can be generated and run on this platform
+  static bool supported();
+
+  // compile the frame's instructions, returns null if the platform is
+  // not supported or the frame has no instruction the jit can run
+  VMNativeCode compile(const VMFrameInfo& info);
+
+  // number of frames compiled
+  int compiled_count() const;
+
+private:
+
+  // the executable memory (and its size) of each compiled frame
+  std::vector<std::pair<void*, std::size_t>> regions;
+
+};
+
+
+#endif
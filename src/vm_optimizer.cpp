@@ -0,0 +1,555 @@
+//----------------------------------------------------------------------
+// FILE: vm_optimizer.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Bytecode optimizations run by the VM before executing frames
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include "vm_optimizer.h"
+
+
+using namespace std;
+
+
+vector<bool> jump_targets(const VMFrameInfo& info)
+{
+  vector<bool> targets(info.instructions.size() + 1, false);
+  for (const VMInstr& instr : info.instructions) {
+    OpCode op = instr.opcode();
+    if ((op == OpCode::JMP or op == OpCode::JMPF) and instr.operand())
+      targets[instr.operand()->as_int()] = true;
+  }
+  return targets;
+}
+
+
+// the fused form of a comparison followed by a JMPF (or NOP if none)
+static OpCode compare_jump(OpCode op)
+{
+  switch (op) {
+  case OpCode::CMPLT:
+  case OpCode::CMPLTI:
+  case OpCode::CMPLTD:
+  case OpCode::CMPLTS: return OpCode::CMPLT_JMPF;
+  case OpCode::CMPLE:
+  case OpCode::CMPLEI:
+  case OpCode::CMPLED:
+  case OpCode::CMPLES: return OpCode::CMPLE_JMPF;
+  case OpCode::CMPGT:
+  case OpCode::CMPGTI:
+  case OpCode::CMPGTD:
+  case OpCode::CMPGTS: return OpCode::CMPGT_JMPF;
+  case OpCode::CMPGE:
+  case OpCode::CMPGEI:
+  case OpCode::CMPGED:
+  case OpCode::CMPGES: return OpCode::CMPGE_JMPF;
+  case OpCode::CMPEQ: return OpCode::CMPEQ_JMPF;
+  case OpCode::CMPNE: return OpCode::CMPNE_JMPF;
+  default: return OpCode::NOP;
+  }
+}
+
+
+int fuse_superinstructions(VMFrameInfo& info)
+{
+  unfuse_superinstructions(info);
+  vector<VMInstr>& instrs = info.instructions;
+  vector<bool> targets = jump_targets(info);
+  int size = instrs.size();
+  int count = 0;
+  // true if instructions i+1 to i+n-1 exist and are not jump targets
+  auto fusable = [&](int i, int n) {
+    if (i + n > size)
+      return false;
+    for (int j = i + 1; j < i + n; ++j)
+      if (targets[j])
+        return false;
+    return true;
+  };
+  int i = 0;
+  while (i < size) {
+    OpCode op = instrs[i].opcode();
+    int n = 1;
+    // LOAD i, PUSH c, ADD (or ADDI), STORE i (i = i + c for an int constant c)
+    if (op == OpCode::LOAD and fusable(i, 4) and
+        instrs[i + 1].opcode() == OpCode::PUSH and
+        instrs[i + 1].operand()->is_int() and
+        (instrs[i + 2].opcode() == OpCode::ADD or
+         instrs[i + 2].opcode() == OpCode::ADDI) and
+        instrs[i + 3].opcode() == OpCode::STORE and
+        instrs[i + 3].operand()->as_int() == instrs[i].operand()->as_int()) {
+      instrs[i].set_exec_opcode(OpCode::INCL);
+      n = 4;
+    }
+    // LOAD i, GETF f
+    else if (op == OpCode::LOAD and fusable(i, 2) and
+             instrs[i + 1].opcode() == OpCode::GETF) {
+      instrs[i].set_exec_opcode(OpCode::LOADL_GETF);
+      n = 2;
+    }
+    // comparison, JMPF t
+    else if (compare_jump(op) != OpCode::NOP and fusable(i, 2) and
+             instrs[i + 1].opcode() == OpCode::JMPF) {
+      instrs[i].set_exec_opcode(compare_jump(op));
+      n = 2;
+    }
+    if (n > 1)
+      ++count;
+    i += n;
+  }
+  return count;
+}
+
+
+void unfuse_superinstructions(VMFrameInfo& info)
+{
+  for (VMInstr& instr : info.instructions)
+    instr.set_exec_opcode(instr.opcode());
+}
+
+
+// true if the instruction never continues to the next one
+static bool ends_flow(OpCode op)
+{
+  return op == OpCode::JMP or op == OpCode::RET or op == OpCode::TAILCALL;
+}
+
+
+// a maximal run of instructions entered only at its first instruction
+struct BasicBlock
+{
+  int start;
+  int end;                      // one past the last instruction
+  std::vector<int> successors;  // block indexes
+};
+
+
+// the frame's basic blocks in instruction order (and the block index
+// of each instruction)
+static vector<BasicBlock> basic_blocks(const VMFrameInfo& info,
+                                       vector<int>& block_of)
+{
+  const vector<VMInstr>& instrs = info.instructions;
+  int size = instrs.size();
+  vector<bool> leaders = jump_targets(info);
+  leaders[0] = true;
+  for (int i = 0; i < size; ++i) {
+    OpCode op = instrs[i].opcode();
+    if (op == OpCode::JMPF or ends_flow(op))
+      leaders[i + 1] = true;
+  }
+  vector<BasicBlock> blocks;
+  block_of.assign(size, 0);
+  for (int i = 0; i < size; ++i) {
+    if (leaders[i])
+      blocks.push_back({i, i});
+    blocks.back().end = i + 1;
+    block_of[i] = blocks.size() - 1;
+  }
+  for (int b = 0; b < (int) blocks.size(); ++b) {
+    const VMInstr& last = instrs[blocks[b].end - 1];
+    OpCode op = last.opcode();
+    if (op == OpCode::JMP or op == OpCode::JMPF)
+      blocks[b].successors.push_back(block_of[last.operand()->as_int()]);
+    if (!ends_flow(op) and b + 1 < (int) blocks.size())
+      blocks[b].successors.push_back(b + 1);
+  }
+  return blocks;
+}
+
+
+int optimize_control_flow(VMFrameInfo& info)
+{
+  vector<VMInstr>& instrs = info.instructions;
+  int size = instrs.size();
+  if (size == 0 or !ends_flow(instrs.back().opcode()))
+    return 0;
+  for (const VMInstr& instr : instrs) {
+    OpCode op = instr.opcode();
+    if (op != OpCode::JMP and op != OpCode::JMPF)
+      continue;
+    if (!instr.operand() or !instr.operand()->is_int() or
+        instr.operand()->as_int() < 0 or instr.operand()->as_int() >= size)
+      return 0;
+  }
+
+  // thread each jump through NOPs and JMPs (stopping at a cycle of JMPs)
+  for (VMInstr& instr : instrs) {
+    OpCode op = instr.opcode();
+    if (op != OpCode::JMP and op != OpCode::JMPF)
+      continue;
+    int target = instr.operand()->as_int();
+    for (int steps = 0; steps < size; ++steps) {
+      if (instrs[target].opcode() == OpCode::NOP)
+        target = target + 1;
+      else if (instrs[target].opcode() == OpCode::JMP)
+        target = instrs[target].operand()->as_int();
+      else
+        break;
+    }
+    instr.set_operand(target);
+  }
+
+  // keep the reachable instructions other than NOPs
+  vector<int> block_of;
+  vector<BasicBlock> blocks = basic_blocks(info, block_of);
+  vector<bool> reachable(blocks.size(), false);
+  vector<int> work {0};
+  reachable[0] = true;
+  while (!work.empty()) {
+    int b = work.back();
+    work.pop_back();
+    for (int s : blocks[b].successors)
+      if (!reachable[s]) {
+        reachable[s] = true;
+        work.push_back(s);
+      }
+  }
+  vector<bool> keep(size);
+  for (int i = 0; i < size; ++i)
+    keep[i] = reachable[block_of[i]] and instrs[i].opcode() != OpCode::NOP;
+
+  // the new index of each instruction (that of the next kept instruction
+  // for removed ones), until no kept JMP goes to the next instruction
+  vector<int> new_index(size + 1);
+  bool changed = true;
+  while (changed) {
+    new_index[size] = 0;
+    for (int i = 0; i < size; ++i)
+      new_index[i + 1] = new_index[i] + keep[i];
+    for (int i = size - 1; i >= 0; --i)
+      if (!keep[i])
+        new_index[i] = new_index[i + 1];
+    changed = false;
+    for (int i = 0; i < size; ++i)
+      if (keep[i] and instrs[i].opcode() == OpCode::JMP and
+          new_index[instrs[i].operand()->as_int()] == new_index[i] + 1) {
+        keep[i] = false;
+        changed = true;
+      }
+  }
+
+  // renumber the instructions, jumps, and line table
+  vector<VMInstr> kept;
+  vector<VMLineEntry> lines;
+  for (int i = 0; i < size; ++i) {
+    if (!keep[i])
+      continue;
+    VMInstr instr = instrs[i];
+    OpCode op = instr.opcode();
+    if (op == OpCode::JMP or op == OpCode::JMPF)
+      instr.set_operand(new_index[instr.operand()->as_int()]);
+    const VMLineEntry* pos = source_position(info, i);
+    if (pos and (lines.empty() or lines.back().line != pos->line or
+                 lines.back().column != pos->column))
+      lines.push_back({(int) kept.size(), pos->line, pos->column});
+    kept.push_back(instr);
+  }
+  int removed = size - kept.size();
+  instrs = std::move(kept);
+  info.lines = std::move(lines);
+  return removed;
+}
+
+
+// true if the frame's body can replace a CALL of it: the frame starts
+// by storing its arguments in slots 0 to arg_count - 1 (and no jump
+// goes back into those stores), and every path through it keeps the
+// operand stack balanced, leaving only the return value at each RET
+// (and only the arguments at each TAILCALL)
+static bool inlinable(const VMFrameInfo& info, const vector<VMFrameInfo>& frames,
+                      const unordered_map<string,int>& frame_index)
+{
+  const vector<VMInstr>& instrs = info.instructions;
+  int size = instrs.size();
+  int args = info.arg_count;
+  if (size <= args or info.local_count < args)
+    return false;
+  for (int i = 0; i < args; ++i)
+    if (instrs[i].opcode() != OpCode::STORE or !instrs[i].operand() or
+        !instrs[i].operand()->is_int() or instrs[i].operand()->as_int() != i)
+      return false;
+  // the stack depth before each instruction (-1 if not yet reached)
+  vector<int> depth(size, -1);
+  vector<int> work {args};
+  depth[args] = 0;
+  auto reach = [&](int target, int d) {
+    if (target < args or target >= size or d < 0)
+      return false;
+    if (depth[target] == -1) {
+      depth[target] = d;
+      work.push_back(target);
+    }
+    return depth[target] == d;
+  };
+  while (!work.empty()) {
+    int i = work.back();
+    work.pop_back();
+    const VMInstr& instr = instrs[i];
+    OpCode op = instr.opcode();
+    int d = depth[i];
+    if (op == OpCode::CALL or op == OpCode::TAILCALL) {
+      const string& name = instr.operand().value().as_string();
+      if (!frame_index.contains(name))
+        return false;
+      int callee_args = frames[frame_index.at(name)].arg_count;
+      if (op == OpCode::TAILCALL) {
+        if (d != callee_args)
+          return false;
+      }
+      else if (d < callee_args or !reach(i + 1, d - callee_args + 1))
+        return false;
+      continue;
+    }
+    if (op == OpCode::RET) {
+      if (d != 1)
+        return false;
+      continue;
+    }
+    int pops, pushes;
+    if (!stack_effect(op, pops, pushes) or d < pops)
+      return false;
+    int effect = pushes - pops;
+    if (op == OpCode::LOAD or op == OpCode::STORE) {
+      if (!instr.operand() or !instr.operand()->is_int() or
+          instr.operand()->as_int() < 0 or
+          instr.operand()->as_int() >= info.local_count)
+        return false;
+    }
+    if (op == OpCode::JMP or op == OpCode::JMPF) {
+      if (!instr.operand() or !instr.operand()->is_int() or
+          !reach(instr.operand()->as_int(), d + effect))
+        return false;
+    }
+    if (op != OpCode::JMP and !reach(i + 1, d + effect))
+      return false;
+  }
+  return true;
+}
+
+
+// the names of the frames on a cycle of calls (including frames that
+// call themselves)
+static unordered_set<string> recursive_frames(const vector<VMFrameInfo>& frames,
+                                  const unordered_map<string,int>& frame_index)
+{
+  int count = frames.size();
+  vector<vector<int>> callees(count);
+  for (int f = 0; f < count; ++f)
+    for (const VMInstr& instr : frames[f].instructions)
+      if ((instr.opcode() == OpCode::CALL or
+           instr.opcode() == OpCode::TAILCALL) and
+          frame_index.contains(instr.operand().value().as_string()))
+        callees[f].push_back(frame_index.at(instr.operand()->as_string()));
+  unordered_set<string> recursive;
+  for (int f = 0; f < count; ++f) {
+    vector<bool> seen(count, false);
+    vector<int> work = callees[f];
+    while (!work.empty()) {
+      int g = work.back();
+      work.pop_back();
+      if (g == f) {
+        recursive.insert(frames[f].function_name);
+        break;
+      }
+      if (seen[g])
+        continue;
+      seen[g] = true;
+      work.insert(work.end(), callees[g].begin(), callees[g].end());
+    }
+  }
+  return recursive;
+}
+
+
+// the frame indexes in an order where each frame comes after the frames
+// it calls (ignoring calls on a cycle)
+static vector<int> callees_first(const vector<VMFrameInfo>& frames,
+                                 const unordered_map<string,int>& frame_index)
+{
+  vector<int> order;
+  vector<bool> visited(frames.size(), false);
+  // an explicit stack of (frame, next instruction to look at)
+  for (int root = 0; root < (int) frames.size(); ++root) {
+    if (visited[root])
+      continue;
+    visited[root] = true;
+    vector<pair<int,int>> stack {{root, 0}};
+    while (!stack.empty()) {
+      auto& [f, pc] = stack.back();
+      const vector<VMInstr>& instrs = frames[f].instructions;
+      if (pc == (int) instrs.size()) {
+        order.push_back(f);
+        stack.pop_back();
+        continue;
+      }
+      const VMInstr& instr = instrs[pc++];
+      if ((instr.opcode() == OpCode::CALL or
+           instr.opcode() == OpCode::TAILCALL) and
+          frame_index.contains(instr.operand().value().as_string())) {
+        int g = frame_index.at(instr.operand()->as_string());
+        if (!visited[g]) {
+          visited[g] = true;
+          stack.push_back({g, 0});
+        }
+      }
+    }
+  }
+  return order;
+}
+
+
+vector<VMInlinedCall> inline_calls(vector<VMFrameInfo>& frames, int threshold)
+{
+  vector<VMInlinedCall> inlined;
+  if (threshold <= 0)
+    return inlined;
+  unordered_map<string,int> frame_index;
+  for (int f = 0; f < (int) frames.size(); ++f)
+    frame_index[frames[f].function_name] = f;
+  unordered_set<string> recursive = recursive_frames(frames, frame_index);
+
+  for (int f : callees_first(frames, frame_index)) {
+    VMFrameInfo& caller = frames[f];
+    const vector<VMInstr>& instrs = caller.instructions;
+    int size = instrs.size();
+    // the callee of each call to inline (-1 for other instructions)
+    vector<int> site(size, -1);
+    bool any = false;
+    for (int i = 0; i < size; ++i) {
+      if (instrs[i].opcode() != OpCode::CALL)
+        continue;
+      const string& name = instrs[i].operand().value().as_string();
+      if (!frame_index.contains(name) or recursive.contains(name))
+        continue;
+      int g = frame_index.at(name);
+      const VMFrameInfo& callee = frames[g];
+      if (g == f or (int) callee.instructions.size() > threshold or
+          !inlinable(callee, frames, frame_index))
+        continue;
+      site[i] = g;
+      any = true;
+    }
+    if (!any)
+      continue;
+
+    // the callee's locals go in slots after the caller's (each inlined
+    // call reuses the same slots)
+    int base = caller.local_count;
+    int local_count = caller.local_count;
+    // indexes of the string constants in the caller's pool (so each
+    // inlined constant is added once)
+    unordered_map<string,int> constant_index;
+    for (int k = 0; k < (int) caller.constants.size(); ++k)
+      if (caller.constants[k].is_string())
+        constant_index.emplace(caller.constants[k].as_string(), k);
+    vector<VMInstr> result;
+    vector<const VMLineEntry*> positions;
+    vector<int> new_index(size + 1);
+    for (int i = 0; i < size; ++i) {
+      new_index[i] = result.size();
+      const VMLineEntry* call_pos = source_position(caller, i);
+      if (site[i] == -1) {
+        result.push_back(instrs[i]);
+        positions.push_back(call_pos);
+        continue;
+      }
+      const VMFrameInfo& callee = frames[site[i]];
+      const vector<VMInstr>& body = callee.instructions;
+      int args = callee.arg_count;
+      int body_size = body.size();
+      local_count = max(local_count, base + callee.local_count);
+      inlined.push_back({caller.function_name, callee.function_name,
+                         call_pos ? call_pos->line : 0});
+      // the arguments are stored last first (the last is on top)
+      for (int a = args - 1; a >= 0; --a) {
+        result.push_back(VMInstr::STORE(base + a));
+        positions.push_back(call_pos);
+      }
+      // where each callee instruction after the argument stores goes (a
+      // TAILCALL becomes two instructions), and the continuation, which
+      // clears the callee's slots (so they do not keep strings and heap
+      // objects alive, e.g., preventing an in-place CONCAT)
+      int start = result.size();
+      vector<int> body_index(body_size + 1);
+      int next = start;
+      for (int j = args; j < body_size; ++j) {
+        body_index[j] = next;
+        next += body[j].opcode() == OpCode::TAILCALL ? 2 : 1;
+      }
+      int end = next;
+      for (int j = args; j < body_size; ++j) {
+        const VMInstr& instr = body[j];
+        const VMLineEntry* pos = source_position(callee, j);
+        switch (instr.opcode()) {
+        case OpCode::LOAD:
+          result.push_back(VMInstr::LOAD(base + instr.operand()->as_int()));
+          break;
+        case OpCode::STORE:
+          result.push_back(VMInstr::STORE(base + instr.operand()->as_int()));
+          break;
+        case OpCode::PUSHK: {
+          const VMValue& x = callee.constants.at(instr.operand()->as_int());
+          if (!x.is_string() or !constant_index.contains(x.as_string())) {
+            if (x.is_string())
+              constant_index.emplace(x.as_string(), caller.constants.size());
+            result.push_back(VMInstr::PUSHK(caller.constants.size()));
+            caller.constants.push_back(x);
+          }
+          else
+            result.push_back(VMInstr::PUSHK(constant_index.at(x.as_string())));
+          break;
+        }
+        case OpCode::JMP:
+          result.push_back(VMInstr::JMP(body_index[instr.operand()->as_int()]));
+          break;
+        case OpCode::JMPF:
+          result.push_back(VMInstr::JMPF(body_index[instr.operand()->as_int()]));
+          break;
+        case OpCode::RET:
+          result.push_back(VMInstr::JMP(end));
+          break;
+        case OpCode::TAILCALL:
+          result.push_back(VMInstr::CALL(instr.operand()->as_string()));
+          positions.push_back(pos);
+          result.push_back(VMInstr::JMP(end));
+          break;
+        default:
+          result.push_back(instr);
+        }
+        positions.push_back(pos);
+      }
+      for (int k = 0; k < callee.local_count; ++k) {
+        result.push_back(VMInstr::PUSH(nullptr));
+        result.push_back(VMInstr::STORE(base + k));
+        positions.push_back(call_pos);
+        positions.push_back(call_pos);
+      }
+    }
+    new_index[size] = result.size();
+
+    // renumber the caller's own jumps and rebuild the line table
+    for (int i = 0; i < size; ++i) {
+      OpCode op = instrs[i].opcode();
+      if (site[i] == -1 and (op == OpCode::JMP or op == OpCode::JMPF)) {
+        int target = instrs[i].operand()->as_int();
+        if (target >= 0 and target <= size)
+          result[new_index[i]].set_operand(new_index[target]);
+      }
+    }
+    vector<VMLineEntry> lines;
+    for (int i = 0; i < (int) result.size(); ++i) {
+      const VMLineEntry* pos = positions[i];
+      if (pos and (lines.empty() or lines.back().line != pos->line or
+                   lines.back().column != pos->column))
+        lines.push_back({i, pos->line, pos->column});
+    }
+    caller.instructions = std::move(result);
+    caller.lines = std::move(lines);
+    caller.local_count = local_count;
+  }
+  return inlined;
+}
@@ -0,0 +1,70 @@
+//----------------------------------------------------------------------
+// FILE: vm_optimizer.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Bytecode optimizations run by the VM before executing frames
+//----------------------------------------------------------------------
+
+#ifndef VM_OPTIMIZER_H
+#define VM_OPTIMIZER_H
+
+#include <string>
+#include <vector>
+#include "vm_frame.h"
+
+
+// The indexes of the instructions of the frame that are JMP or JMPF
+// targets (as a flag per instruction index, plus one for the end).
+std::vector<bool> jump_targets(const VMFrameInfo& info);
+
+
+// Fuse common instruction sequences into superinstructions. The first
+// instruction of each sequence gets the superinstruction as its
+// executed opcode and the rest are left in place (and skipped when
+// the superinstruction runs), so instruction indexes, jump targets,
+// and error locations do not change. Sequences are only fused if none
+// of their instructions after the first is a jump target. Returns the
+// number of superinstructions.
+int fuse_superinstructions(VMFrameInfo& info);
+
+
+// Reset each instruction of the frame to execute its own opcode.
+void unfuse_superinstructions(VMFrameInfo& info);
+
+
+// Simplify the frame's control flow graph (of basic blocks): jumps to
+// NOPs and to JMPs are threaded to their final target, blocks not
+// reachable from the first instruction are removed, as are NOPs and
+// JMPs to the next instruction, and then jump operands and the line
+// table are renumbered. Frames with a jump out of the frame or whose
+// last instruction is not a JMP, RET, or TAILCALL are left unchanged.
+// Returns the number of instructions removed.
+int optimize_control_flow(VMFrameInfo& info);
+
+
+// a call replaced by the body of the called function
+struct VMInlinedCall
+{
+  std::string caller;
+  std::string callee;
+  int line;             // the source line of the call (0 if unknown)
+};
+
+
+// Replace each CALL of a frame with at most threshold instructions that
+// is not recursive (directly or through other frames) by the frame's
+// instructions: its arguments and locals are stored in slots after the
+// caller's local slots (set to null again after the inlined code), its
+// constants are added to the caller's pool (once each), and each RET
+// becomes a JMP past the inlined code (a TAILCALL becomes a CALL and
+// such a JMP). Frames are inlined into their callers after
+// their own calls are, so the threshold bounds the size with inlined
+// calls. Only frames that store their arguments first and keep the
+// operand stack balanced are inlined. Errors in inlined code are
+// reported in the caller at the inlined instruction's source line.
+// Returns the inlined calls (none if threshold is 0).
+std::vector<VMInlinedCall> inline_calls(std::vector<VMFrameInfo>& frames,
+                                        int threshold);
+
+
+#endif
@@ -0,0 +1,337 @@
+//----------------------------------------------------------------------
+// FILE: vm_profiler.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Execution profile of the VM
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <iomanip>
+#include <tuple>
+#include "vm_profiler.h"
+
+using namespace std;
+
+
+// number of opcode pairs, instructions, and lines listed in the report
+const int REPORT_PAIRS = 20;
+const int REPORT_INSTRUCTIONS = 20;
+const int REPORT_LINES = 20;
+
+
+void VMProfiler::start()
+{
+  for (int i = 0; i < OPCODE_COUNT; ++i) {
+    opcode_counts[i] = 0;
+    for (int j = 0; j < OPCODE_COUNT; ++j)
+      pair_counts[i][j] = 0;
+  }
+  functions.clear();
+  function_index.clear();
+  current_info = nullptr;
+  current = nullptr;
+  current_line = 0;
+  last_op = OPCODE_COUNT;
+  elapsed_ms = 0;
+  start_time = switch_time = Clock::now();
+  running = true;
+}
+
+
+void VMProfiler::charge(Clock::time_point now)
+{
+  if (current) {
+    double ms = chrono::duration<double, milli>(now - switch_time).count();
+    current->self_ms += ms;
+    if (current_line)
+      current->line_ms[current_line] += ms;
+  }
+  switch_time = now;
+}
+
+
+void VMProfiler::switch_to(const VMFrameInfo& info, Clock::time_point now)
+{
+  charge(now);
+  auto [entry, added] = function_index.try_emplace(&info, functions.size());
+  if (added) {
+    VMFunctionProfile& f = functions.emplace_back();
+    f.function_name = info.function_name;
+    f.instruction_counts.assign(info.instructions.size(), 0);
+    f.instruction_lines.assign(info.instructions.size(), 0);
+    for (int pc = 0; pc < (int) info.instructions.size(); ++pc)
+      if (const VMLineEntry* pos = source_position(info, pc))
+        f.instruction_lines[pc] = pos->line;
+  }
+  current_info = &info;
+  current = &functions[entry->second];
+}
+
+
+void VMProfiler::count(const VMFrameInfo& info, int pc, OpCode op)
+{
+  if (&info != current_info) {
+    switch_to(info, Clock::now());
+    current_line = current->instruction_lines[pc];
+  }
+  else if (current->instruction_lines[pc] != current_line) {
+    // the clock is only read when the source line changes
+    charge(Clock::now());
+    current_line = current->instruction_lines[pc];
+  }
+  // a function's first instruction right after a call (or before any
+  // other instruction, for main) starts a call of the function
+  if (pc == 0 and (last_op == OPCODE_COUNT or
+                   last_op == static_cast<int>(OpCode::CALL) or
+                   last_op == static_cast<int>(OpCode::TAILCALL)))
+    ++current->calls;
+  ++current->instruction_counts[pc];
+  int i = static_cast<int>(op);
+  ++opcode_counts[i];
+  if (last_op < OPCODE_COUNT)
+    ++pair_counts[last_op][i];
+  last_op = i;
+}
+
+
+void VMProfiler::stop()
+{
+  if (!running)
+    return;
+  Clock::time_point now = Clock::now();
+  charge(now);
+  elapsed_ms = chrono::duration<double, milli>(now - start_time).count();
+  current_info = nullptr;
+  current = nullptr;
+  current_line = 0;
+  running = false;
+}
+
+
+uint64_t VMProfiler::instruction_count() const
+{
+  uint64_t total = 0;
+  for (int i = 0; i < OPCODE_COUNT; ++i)
+    total += opcode_counts[i];
+  return total;
+}
+
+
+uint64_t VMProfiler::opcode_count(OpCode op) const
+{
+  return opcode_counts[static_cast<int>(op)];
+}
+
+
+uint64_t VMProfiler::pair_count(OpCode first, OpCode second) const
+{
+  return pair_counts[static_cast<int>(first)][static_cast<int>(second)];
+}
+
+
+const VMFunctionProfile* VMProfiler::function(const string& name) const
+{
+  for (const VMFunctionProfile& f : functions)
+    if (f.function_name == name)
+      return &f;
+  return nullptr;
+}
+
+
+uint64_t VMProfiler::line_count(int line) const
+{
+  uint64_t total = 0;
+  for (const VMFunctionProfile& f : functions)
+    for (int pc = 0; pc < (int) f.instruction_counts.size(); ++pc)
+      if (f.instruction_lines[pc] == line)
+        total += f.instruction_counts[pc];
+  return total;
+}
+
+
+double VMProfiler::total_ms() const
+{
+  return elapsed_ms;
+}
+
+
+namespace {
+
+  // the percentage of count in total
+  double percent(uint64_t count, uint64_t total)
+  {
+    return total ? 100.0 * count / total : 0.0;
+  }
+
+  // the nonzero opcode counts sorted by decreasing count
+  vector<pair<uint64_t, int>> sorted_opcodes(const uint64_t* counts)
+  {
+    vector<pair<uint64_t, int>> sorted;
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+      if (counts[i])
+        sorted.push_back({counts[i], i});
+    sort(sorted.begin(), sorted.end(), greater<>());
+    return sorted;
+  }
+
+  string opcode_name(int op)
+  {
+    return to_string(static_cast<OpCode>(op));
+  }
+
+  // a source line's instruction count and self time in a function
+  struct LineProfile
+  {
+    const VMFunctionProfile* function;
+    int line;
+    uint64_t count;
+    double ms;
+  };
+
+  // the profile of each line with instructions of the functions, in
+  // function and line order
+  vector<LineProfile> line_profiles(const vector<VMFunctionProfile>& functions)
+  {
+    vector<LineProfile> lines;
+    for (const VMFunctionProfile& f : functions) {
+      map<int, uint64_t> counts;
+      for (int pc = 0; pc < (int) f.instruction_counts.size(); ++pc)
+        if (f.instruction_lines[pc] and f.instruction_counts[pc])
+          counts[f.instruction_lines[pc]] += f.instruction_counts[pc];
+      for (auto [line, count] : counts) {
+        auto ms = f.line_ms.find(line);
+        lines.push_back({&f, line, count,
+                         ms == f.line_ms.end() ? 0.0 : ms->second});
+      }
+    }
+    return lines;
+  }
+
+}
+
+
+void VMProfiler::report(ostream& out) const
+{
+  uint64_t total = instruction_count();
+  out << fixed << setprecision(2);
+  out << "instructions executed: " << total << endl;
+  out << "total time: " << elapsed_ms << " ms" << endl;
+
+  out << endl << "opcodes:" << endl;
+  for (auto [count, op] : sorted_opcodes(opcode_counts))
+    out << "  " << left << setw(12) << opcode_name(op) << right
+        << setw(14) << count << setw(8) << percent(count, total) << "%"
+        << endl;
+
+  vector<tuple<uint64_t, int, int>> pairs;
+  for (int i = 0; i < OPCODE_COUNT; ++i)
+    for (int j = 0; j < OPCODE_COUNT; ++j)
+      if (pair_counts[i][j])
+        pairs.push_back({pair_counts[i][j], i, j});
+  sort(pairs.begin(), pairs.end(), greater<>());
+  out << endl << "opcode pairs:" << endl;
+  for (int k = 0; k < (int) pairs.size() and k < REPORT_PAIRS; ++k) {
+    auto [count, first, second] = pairs[k];
+    out << "  " << left << setw(24)
+        << (opcode_name(first) + " " + opcode_name(second)) << right
+        << setw(14) << count << setw(8) << percent(count, total) << "%"
+        << endl;
+  }
+
+  vector<const VMFunctionProfile*> by_time;
+  for (const VMFunctionProfile& f : functions)
+    by_time.push_back(&f);
+  sort(by_time.begin(), by_time.end(),
+       [](auto f, auto g) {return f->self_ms > g->self_ms;});
+  out << endl << "functions (calls, instructions, self time):" << endl;
+  for (const VMFunctionProfile* f : by_time) {
+    uint64_t count = 0;
+    for (uint64_t n : f->instruction_counts)
+      count += n;
+    out << "  " << left << setw(20) << f->function_name << right
+        << setw(12) << f->calls << setw(14) << count
+        << setw(12) << f->self_ms << " ms" << endl;
+  }
+
+  vector<tuple<uint64_t, const VMFunctionProfile*, int>> instrs;
+  for (const VMFunctionProfile& f : functions)
+    for (int pc = 0; pc < (int) f.instruction_counts.size(); ++pc)
+      if (f.instruction_counts[pc])
+        instrs.push_back({f.instruction_counts[pc], &f, pc});
+  sort(instrs.begin(), instrs.end(),
+       [](auto& x, auto& y) {return get<0>(x) > get<0>(y);});
+  out << endl << "instructions:" << endl;
+  for (int k = 0; k < (int) instrs.size() and k < REPORT_INSTRUCTIONS; ++k) {
+    auto [count, f, pc] = instrs[k];
+    out << "  " << left << setw(24)
+        << (f->function_name + " " + std::to_string(pc)) << right
+        << setw(14) << count << setw(8) << percent(count, total) << "%"
+        << endl;
+  }
+
+  vector<LineProfile> lines = line_profiles(functions);
+  stable_sort(lines.begin(), lines.end(),
+              [](auto& x, auto& y) {return x.ms > y.ms;});
+  if (!lines.empty())
+    out << endl << "lines (instructions, self time):" << endl;
+  for (int k = 0; k < (int) lines.size() and k < REPORT_LINES; ++k) {
+    const LineProfile& l = lines[k];
+    out << "  " << left << setw(24)
+        << (l.function->function_name + " line " + std::to_string(l.line))
+        << right << setw(14) << l.count << setw(12) << l.ms << " ms"
+        << endl;
+  }
+  out << defaultfloat;
+}
+
+
+void VMProfiler::write_json(ostream& out) const
+{
+  out << "{" << endl;
+  out << "  \"instructions\": " << instruction_count() << "," << endl;
+  out << "  \"total_ms\": " << elapsed_ms << "," << endl;
+  out << "  \"opcodes\": {";
+  bool first = true;
+  for (auto [count, op] : sorted_opcodes(opcode_counts)) {
+    out << (first ? "" : ",") << endl
+        << "    \"" << opcode_name(op) << "\": " << count;
+    first = false;
+  }
+  out << endl << "  }," << endl;
+  out << "  \"pairs\": [";
+  first = true;
+  for (int i = 0; i < OPCODE_COUNT; ++i)
+    for (int j = 0; j < OPCODE_COUNT; ++j)
+      if (pair_counts[i][j]) {
+        out << (first ? "" : ",") << endl
+            << "    {\"first\": \"" << opcode_name(i) << "\", \"second\": \""
+            << opcode_name(j) << "\", \"count\": " << pair_counts[i][j]
+            << "}";
+        first = false;
+      }
+  out << endl << "  ]," << endl;
+  out << "  \"functions\": [";
+  first = true;
+  for (const VMFunctionProfile& f : functions) {
+    out << (first ? "" : ",") << endl
+        << "    {\"name\": \"" << f.function_name << "\", \"calls\": "
+        << f.calls << ", \"self_ms\": " << f.self_ms
+        << ", \"instructions\": [";
+    for (size_t pc = 0; pc < f.instruction_counts.size(); ++pc)
+      out << (pc ? ", " : "") << f.instruction_counts[pc];
+    out << "]}";
+    first = false;
+  }
+  out << endl << "  ]," << endl;
+  out << "  \"lines\": [";
+  first = true;
+  for (const LineProfile& l : line_profiles(functions)) {
+    out << (first ? "" : ",") << endl
+        << "    {\"function\": \"" << l.function->function_name
+        << "\", \"line\": " << l.line << ", \"instructions\": " << l.count
+        << ", \"ms\": " << l.ms << "}";
+    first = false;
+  }
+  out << endl << "  ]" << endl;
+  out << "}" << endl;
+}
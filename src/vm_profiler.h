@@ -0,0 +1,122 @@
+//----------------------------------------------------------------------
+// FILE: vm_profiler.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Execution profile of the VM: opcode, opcode pair, function,
+//       and instruction counts plus wall time per function
+//----------------------------------------------------------------------
+
+#ifndef VM_PROFILER_H
+#define VM_PROFILER_H
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "op_code.h"
+#include "vm_frame.h"
+
+
+// execution counts and time of one function (frame type), by source
+// line if the frame has a line table
+struct VMFunctionProfile
+{
+  std::string function_name;
+
+  // number of times the function was called (or tail called)
+  std::uint64_t calls = 0;
+
+  // number of times each instruction (by index) was executed
+  std::vector<std::uint64_t> instruction_counts;
+
+  // wall time spent running the function's own instructions (time in
+  // the functions it calls is not included)
+  double self_ms = 0;
+
+  // the source line of each instruction (0 if unknown) and the self
+  // time of each line
+  std::vector<int> instruction_lines;
+  std::map<int, double> line_ms;
+};
+
+
+// The profiler is given each instruction as the vm runs it (with the
+// executed opcode, i.e., after quickening and superinstruction fusion,
+// so a fused instruction counts once).
+class VMProfiler
+{
+public:
+
+  // reset the profile and start the clock
+  void start();
+
+  // count the execution of the instruction at index pc of the frame
+  // with the given (executed) opcode
+  void count(const VMFrameInfo& info, int pc, OpCode op);
+
+  // stop the clock (charging the elapsed time to the current function)
+  void stop();
+
+  // total number of instructions executed
+  std::uint64_t instruction_count() const;
+
+  // number of executions of the opcode
+  std::uint64_t opcode_count(OpCode op) const;
+
+  // number of times the second opcode ran right after the first
+  std::uint64_t pair_count(OpCode first, OpCode second) const;
+
+  // the profile of the function (null if it never ran)
+  const VMFunctionProfile* function(const std::string& name) const;
+
+  // number of instructions executed on the source line (in any
+  // function)
+  std::uint64_t line_count(int line) const;
+
+  // total wall time between start and stop
+  double total_ms() const;
+
+  // print the profile sorted by count (and time) to the stream
+  void report(std::ostream& out) const;
+
+  // write the profile as a json object to the stream
+  void write_json(std::ostream& out) const;
+
+private:
+
+  using Clock = std::chrono::steady_clock;
+
+  std::uint64_t opcode_counts[OPCODE_COUNT] = {};
+  std::uint64_t pair_counts[OPCODE_COUNT][OPCODE_COUNT] = {};
+
+  // function profiles in order of first call
+  std::vector<VMFunctionProfile> functions;
+  std::unordered_map<const VMFrameInfo*, int> function_index;
+
+  // the frame type, profile, and source line of the previous
+  // instruction, and its opcode (OPCODE_COUNT before the first
+  // instruction)
+  const VMFrameInfo* current_info = nullptr;
+  VMFunctionProfile* current = nullptr;
+  int current_line = 0;
+  int last_op = OPCODE_COUNT;
+
+  // time since the current function (and line) was entered or resumed
+  Clock::time_point start_time;
+  Clock::time_point switch_time;
+  double elapsed_ms = 0;
+  bool running = false;
+
+  // charge the time since the last switch to the current function and
+  // line
+  void charge(Clock::time_point now);
+
+  // switch the current function (after charging it)
+  void switch_to(const VMFrameInfo& info, Clock::time_point now);
+};
+
+
+#endif
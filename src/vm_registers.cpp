@@ -0,0 +1,453 @@
+//----------------------------------------------------------------------
+// FILE: vm_registers.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: The register engine of the mypl virtual machine (runs the
+// register frames of the vm, see reg_instr.h)
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <iostream>
+#include "vm.h"
+#include "mypl_exception.h"
+
+using namespace std;
+
+
+// the register operands of the instruction
+static vector<int> registers(const RegInstr& instr)
+{
+  int a = instr.a();
+  int b = instr.b();
+  int c = instr.c();
+  switch (instr.opcode()) {
+  case RegOpCode::JMP:
+  case RegOpCode::NOP:
+    return {};
+  case RegOpCode::LOADK: case RegOpCode::JMPF: case RegOpCode::RET:
+  case RegOpCode::WRITE: case RegOpCode::READ: case RegOpCode::ALLOCS:
+  case RegOpCode::DELS: case RegOpCode::DELAR:
+    return {a};
+  case RegOpCode::CALL:
+    if (c > 0)
+      return {a, b, b + c - 1};
+    return {a};
+  case RegOpCode::MOV: case RegOpCode::NOT: case RegOpCode::SLEN:
+  case RegOpCode::ALEN: case RegOpCode::TOINT: case RegOpCode::TODBL:
+  case RegOpCode::TOSTR: case RegOpCode::ALLOCA: case RegOpCode::GETF:
+  case RegOpCode::SETF:
+    return {a, b};
+  default:
+    return {a, b, c};
+  }
+}
+
+
+void VM::add(const RegFrameInfo& frame)
+{
+  if (!reg_function_index.contains(frame.function_name)) {
+    reg_function_index[frame.function_name] = reg_frame_info.size();
+    reg_frame_info.push_back(frame);
+  }
+  else
+    reg_frame_info[reg_function_index[frame.function_name]] = frame;
+  reg_linked = false;
+  RegFrameInfo& info = reg_frame_info[reg_function_index[frame.function_name]];
+  intern(info.constants);
+  verify(info);
+}
+
+
+void VM::error(string msg, const RegFrameInfo& info, int pc) const
+{
+  msg += " (in " + info.function_name + " at " + to_string(pc) + ": " +
+    to_string(info.instructions[pc]) + ")";
+  throw MyPLException::VMError(msg);
+}
+
+
+void VM::verify(RegFrameInfo& info) const
+{
+  int size = info.instructions.size();
+  // frames built without a register count (e.g., by hand) are sized
+  // from their highest register
+  if (info.register_count == 0)
+    for (const RegInstr& instr : info.instructions)
+      for (int r : registers(instr))
+        info.register_count = max(info.register_count, r + 1);
+  info.register_count = max(info.register_count, info.arg_count);
+  // the run loop relies on the following without checking them
+  for (int i = 0; i < size; ++i) {
+    const RegInstr& instr = info.instructions[i];
+    RegOpCode op = instr.opcode();
+    for (int r : registers(instr))
+      if (r < 0 or r >= info.register_count)
+        error("invalid register", info, i);
+    if (op == RegOpCode::LOADK) {
+      if (instr.b() < 0 or instr.b() >= info.constants.size())
+        error("invalid constant index", info, i);
+    }
+    else if (op == RegOpCode::JMP or op == RegOpCode::JMPF) {
+      int target = op == RegOpCode::JMP ? instr.a() : instr.b();
+      if (target < 0 or target > size)
+        error("invalid jump target", info, i);
+    }
+  }
+}
+
+
+void VM::link_registers()
+{
+  for (RegFrameInfo& info : reg_frame_info) {
+    for (int i = 0; i < info.instructions.size(); ++i) {
+      RegInstr& instr = info.instructions[i];
+      if (instr.opcode() == RegOpCode::CALL) {
+        const string& fun_name = instr.operand().value().as_string();
+        if (!reg_function_index.contains(fun_name))
+          error("undefined function '" + fun_name + "'", info, i);
+        int index = reg_function_index.at(fun_name);
+        if (reg_frame_info[index].arg_count != instr.c())
+          error("wrong number of arguments", info, i);
+        instr.set_resolved(index);
+      }
+      else if (instr.opcode() == RegOpCode::ALLOCS) {
+        const string& struct_name = instr.operand().value().as_string();
+        if (!struct_index.contains(struct_name))
+          error("undefined struct '" + struct_name + "'", info, i);
+        instr.set_resolved(struct_index.at(struct_name));
+      }
+    }
+  }
+  reg_linked = true;
+}
+
+
+void VM::run_registers()
+{
+  if (!reg_function_index.contains("main"))
+    error("No 'main' function");
+  if (!reg_linked)
+    link_registers();
+  const RegFrameInfo& main_info = reg_frame_info[reg_function_index["main"]];
+  value_stack.assign(max_stack_size, VMValue());
+  if (main_info.register_count > max_stack_size)
+    error("stack overflow");
+  reg_call_stack.clear();
+  reg_call_stack.push_back({&main_info, 0, 0});
+
+  // the current frame, its registers, and its constants (sp is the
+  // end of the current frame's registers, for the garbage collector)
+  RegFrame* frame = &reg_call_stack.back();
+  VMValue* r = value_stack.data();
+  const VMValue* k = main_info.constants.data();
+  sp = main_info.register_count;
+
+  // report an error at the current instruction
+  auto fail = [&](const string& msg) {
+    error(msg, *frame->info, frame->pc - 1);
+  };
+  auto ensure_not_null = [&](const VMValue& x) {
+    if (x.is_null())
+      fail("null reference");
+  };
+
+// r[a] = r[b] op r[c], directly for ints (else with the generic
+// operation after checking for nulls)
+#define REG_BINARY(op, generic)                                         \
+      {                                                                 \
+        const VMValue& x = r[instr.b()];                                \
+        const VMValue& y = r[instr.c()];                                \
+        if (x.is_int() and y.is_int())                                  \
+          r[instr.a()] = x.as_int() op y.as_int();                      \
+        else {                                                          \
+          ensure_not_null(x);                                           \
+          ensure_not_null(y);                                           \
+          r[instr.a()] = generic(x, y);                                 \
+        }                                                               \
+      }
+
+  while (frame->pc < (int) frame->info->instructions.size()) {
+
+    const RegInstr& instr = frame->info->instructions[frame->pc++];
+
+    switch (instr.opcode()) {
+
+    //----------------------------------------------------------------------
+    // Moves
+    //----------------------------------------------------------------------
+
+    case RegOpCode::MOV:
+      r[instr.a()] = r[instr.b()];
+      break;
+
+    case RegOpCode::LOADK:
+      r[instr.a()] = k[instr.b()];
+      break;
+
+    //----------------------------------------------------------------------
+    // Operations
+    //----------------------------------------------------------------------
+
+    case RegOpCode::ADD: REG_BINARY(+, add); break;
+    case RegOpCode::SUB: REG_BINARY(-, sub); break;
+    case RegOpCode::MUL: REG_BINARY(*, mul); break;
+    case RegOpCode::DIV: REG_BINARY(/, div); break;
+    case RegOpCode::CMPLT: REG_BINARY(<, lt); break;
+    case RegOpCode::CMPLE: REG_BINARY(<=, le); break;
+    case RegOpCode::CMPGT: REG_BINARY(>, gt); break;
+    case RegOpCode::CMPGE: REG_BINARY(>=, ge); break;
+
+    case RegOpCode::AND:
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      r[instr.a()] = an(r[instr.b()], r[instr.c()]);
+      break;
+
+    case RegOpCode::OR:
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      r[instr.a()] = orr(r[instr.b()], r[instr.c()]);
+      break;
+
+    case RegOpCode::NOT:
+      ensure_not_null(r[instr.b()]);
+      r[instr.a()] = nt(r[instr.b()]);
+      break;
+
+    case RegOpCode::CMPEQ:
+      r[instr.a()] = eq(r[instr.b()], r[instr.c()]);
+      break;
+
+    case RegOpCode::CMPNE:
+      r[instr.a()] = neq(r[instr.b()], r[instr.c()]);
+      break;
+
+    //----------------------------------------------------------------------
+    // Branching
+    //----------------------------------------------------------------------
+
+    case RegOpCode::JMP:
+      frame->pc = instr.a();
+      break;
+
+    case RegOpCode::JMPF:
+      if (r[instr.a()].is_bool() and !r[instr.a()].as_bool())
+        frame->pc = instr.b();
+      break;
+
+    //----------------------------------------------------------------------
+    // Functions
+    //----------------------------------------------------------------------
+
+    case RegOpCode::CALL: {
+      // the callee's registers follow the caller's, starting with a
+      // copy of the args
+      const RegFrameInfo& info = reg_frame_info[instr.resolved()];
+      int bp = frame->bp + frame->info->register_count;
+      if (bp + info.register_count > max_stack_size)
+        fail("stack overflow");
+      if ((int) reg_call_stack.size() >= max_call_depth)
+        fail("call depth exceeded");
+      for (int i = 0; i < info.arg_count; ++i)
+        value_stack[bp + i] = r[instr.b() + i];
+      sp = bp + info.register_count;
+      reg_call_stack.push_back({&info, 0, bp});
+      frame = &reg_call_stack.back();
+      r = value_stack.data() + bp;
+      k = info.constants.data();
+      break;
+    }
+
+    case RegOpCode::RET: {
+      VMValue v = std::move(r[instr.a()]);
+      while (sp > frame->bp)
+        value_stack[--sp] = VMValue();
+      reg_call_stack.pop_back();
+      if (reg_call_stack.empty())
+        return;
+      frame = &reg_call_stack.back();
+      r = value_stack.data() + frame->bp;
+      k = frame->info->constants.data();
+      sp = frame->bp + frame->info->register_count;
+      // the result goes to the destination register of the CALL
+      r[frame->info->instructions[frame->pc - 1].a()] = std::move(v);
+      break;
+    }
+
+    //----------------------------------------------------------------------
+    // Built in functions
+    //----------------------------------------------------------------------
+
+    case RegOpCode::WRITE:
+      cout << to_string(r[instr.a()]);
+      break;
+
+    case RegOpCode::READ: {
+      string val = "";
+      getline(cin, val);
+      r[instr.a()] = std::move(val);
+      break;
+    }
+
+    case RegOpCode::SLEN:
+      ensure_not_null(r[instr.b()]);
+      r[instr.a()] = (int) r[instr.b()].as_string().size();
+      break;
+
+    case RegOpCode::ALEN: {
+      ensure_not_null(r[instr.b()]);
+      VMObject* array = heap.get(r[instr.b()].as_handle(), VMObjectKind::ARRAY);
+      if (!array)
+        fail("array does not exist");
+      r[instr.a()] = array->length;
+      break;
+    }
+
+    case RegOpCode::GETC: {
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      int index = r[instr.b()].as_int();
+      const string& word = r[instr.c()].as_string();
+      if (index < 0 or index >= word.size())
+        fail("out-of-bounds string index");
+      r[instr.a()] = string(1, word[index]);
+      break;
+    }
+
+    case RegOpCode::TOINT:
+      ensure_not_null(r[instr.b()]);
+      r[instr.a()] = to_int(r[instr.b()]);
+      if (r[instr.a()].is_null())
+        fail("cannot convert string to int");
+      break;
+
+    case RegOpCode::TODBL:
+      ensure_not_null(r[instr.b()]);
+      r[instr.a()] = to_dbl(r[instr.b()]);
+      if (r[instr.a()].is_null())
+        fail("cannot convert string to double");
+      break;
+
+    case RegOpCode::TOSTR:
+      ensure_not_null(r[instr.b()]);
+      r[instr.a()] = to_string(r[instr.b()]);
+      break;
+
+    case RegOpCode::CONCAT: {
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      // appending to the destination itself is done in place (when its
+      // string is not shared)
+      if (instr.a() == instr.b())
+        r[instr.a()].append(r[instr.c()].as_string());
+      else {
+        VMValue y = r[instr.b()];
+        y.append(r[instr.c()].as_string());
+        r[instr.a()] = std::move(y);
+      }
+      break;
+    }
+
+    //----------------------------------------------------------------------
+    // Heap
+    //----------------------------------------------------------------------
+
+    case RegOpCode::ALLOCS: {
+      if (heap.collection_due())
+        collect_garbage();
+      int layout = instr.resolved();
+      int field_count = struct_layouts[layout].field_names.size();
+      int oid = heap.alloc_struct(layout, field_count);
+      if (oid == -1)
+        fail("out of heap memory");
+      r[instr.a()] = VMValue::handle(oid);
+      break;
+    }
+
+    case RegOpCode::ALLOCA: {
+      if (heap.collection_due())
+        collect_garbage();
+      ensure_not_null(r[instr.b()]);
+      int size = r[instr.b()].as_int();
+      if (size < 0)
+        fail("negative array size");
+      int oid = heap.alloc_array(size, VMValue());
+      if (oid == -1)
+        fail("out of heap memory");
+      r[instr.a()] = VMValue::handle(oid);
+      break;
+    }
+
+    case RegOpCode::GETF: {
+      ensure_not_null(r[instr.b()]);
+      VMObject* obj = heap.get(r[instr.b()].as_handle(), VMObjectKind::STRUCT);
+      if (!obj)
+        fail("struct does not exist");
+      int offset = instr.resolved();
+      if (offset < 0)
+        offset = field_offset(*obj, instr.operand().value().as_string());
+      if (offset < 0 or offset >= obj->length)
+        r[instr.a()] = nullptr;
+      else
+        r[instr.a()] = obj->values[offset];
+      break;
+    }
+
+    case RegOpCode::SETF: {
+      ensure_not_null(r[instr.a()]);
+      VMObject* obj = heap.get(r[instr.a()].as_handle(), VMObjectKind::STRUCT);
+      if (!obj)
+        fail("struct does not exist");
+      int offset = instr.resolved();
+      if (offset < 0)
+        offset = field_offset(*obj, instr.operand().value().as_string());
+      if (offset < 0 or offset >= obj->length)
+        fail("struct does not have field");
+      obj->values[offset] = r[instr.b()];
+      break;
+    }
+
+    case RegOpCode::GETI: {
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      VMObject* array = heap.get(r[instr.b()].as_handle(), VMObjectKind::ARRAY);
+      if (!array)
+        fail("array does not exist");
+      int index = r[instr.c()].as_int();
+      if (index < 0 or index >= array->length)
+        fail("out-of-bounds array index");
+      r[instr.a()] = array->values[index];
+      break;
+    }
+
+    case RegOpCode::SETI: {
+      ensure_not_null(r[instr.a()]);
+      ensure_not_null(r[instr.b()]);
+      ensure_not_null(r[instr.c()]);
+      VMObject* array = heap.get(r[instr.a()].as_handle(), VMObjectKind::ARRAY);
+      if (!array)
+        fail("array does not exist");
+      int index = r[instr.b()].as_int();
+      if (index < 0 or index >= array->length)
+        fail("out-of-bounds array index");
+      array->values[index] = r[instr.c()];
+      break;
+    }
+
+    case RegOpCode::DELS:
+      ensure_not_null(r[instr.a()]);
+      heap.free(r[instr.a()].as_handle(), VMObjectKind::STRUCT);
+      break;
+
+    case RegOpCode::DELAR:
+      ensure_not_null(r[instr.a()]);
+      heap.free(r[instr.a()].as_handle(), VMObjectKind::ARRAY);
+      break;
+
+    case RegOpCode::NOP:
+      break;
+    }
+  }
+
+#undef REG_BINARY
+}
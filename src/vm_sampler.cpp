@@ -0,0 +1,188 @@
+//----------------------------------------------------------------------
+// FILE: vm_sampler.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Sampling profiler of the VM call stack
+//----------------------------------------------------------------------
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include "vm_sampler.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <signal.h>
+#include <sys/time.h>
+#define MYPL_SAMPLER_POSIX
+#endif
+
+using namespace std;
+
+
+namespace {
+
+  // the running sampler (signaled by the timer)
+  VMSampler* volatile active = nullptr;
+
+#if defined(MYPL_SAMPLER_POSIX)
+  // the SIGPROF action replaced while sampling
+  struct sigaction old_action;
+
+  // set the SIGPROF timer interval (0 to stop the timer)
+  void set_timer(int interval_us)
+  {
+    itimerval timer {};
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+  }
+#endif
+
+}
+
+
+VMSampler::VMSampler(int hz, int max_frames)
+  : interval_us(max(1, 1000000 / max(1, hz))),
+    samples(max(1, max_frames / 8)), frames(max_frames)
+{
+}
+
+
+VMSampler::~VMSampler()
+{
+  stop();
+}
+
+
+bool VMSampler::supported()
+{
+#if defined(MYPL_SAMPLER_POSIX)
+  return true;
+#else
+  return false;
+#endif
+}
+
+
+void VMSampler::start(const vector<VMFrame>& stack, const int& depth,
+                      const volatile sig_atomic_t& growing)
+{
+  stop();
+  sample_total = frame_total = dropped = 0;
+  call_stack = &stack;
+  call_depth = &depth;
+  stack_growing = &growing;
+#if defined(MYPL_SAMPLER_POSIX)
+  if (active)
+    return;
+  active = this;
+  struct sigaction action {};
+  action.sa_handler = handle;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGPROF, &action, &old_action);
+  set_timer(interval_us);
+  running = true;
+#endif
+}
+
+
+void VMSampler::stop()
+{
+#if defined(MYPL_SAMPLER_POSIX)
+  if (!running)
+    return;
+  set_timer(0);
+  sigaction(SIGPROF, &old_action, nullptr);
+  active = nullptr;
+  running = false;
+#endif
+}
+
+
+void VMSampler::handle(int)
+{
+  VMSampler* sampler = active;
+  if (sampler)
+    sampler->sample();
+}
+
+
+void VMSampler::sample()
+{
+  // only reads the call stack and writes to the preallocated buffers
+  // (the vm may be stopped anywhere, except in the middle of growing
+  // the call stack)
+  if (*stack_growing) {
+    ++dropped;
+    return;
+  }
+  int depth = *call_depth;
+  if (depth <= 0)
+    return;
+  int n = min(depth, MAX_SAMPLE_DEPTH);
+  if (sample_total == (int) samples.size() or
+      frame_total + n > (int) frames.size()) {
+    ++dropped;
+    return;
+  }
+  const VMFrame* stack = call_stack->data();
+  samples[sample_total++] = {frame_total, n, n < depth};
+  for (int i = depth - n; i < depth; ++i)
+    frames[frame_total++] = {stack[i].info, stack[i].pc};
+}
+
+
+int VMSampler::sample_count() const
+{
+  return sample_total;
+}
+
+
+int VMSampler::dropped_count() const
+{
+  return dropped;
+}
+
+
+void VMSampler::write_folded(ostream& out) const
+{
+  // a frame's pc is that of its next instruction (the call site's
+  // successor in callers), so the sampled instruction is the one before
+  map<string, int> stacks;
+  for (int s = 0; s < sample_total; ++s) {
+    const Sample& sample = samples[s];
+    string stack = sample.truncated ? "[truncated]" : "";
+    for (int i = 0; i < sample.depth; ++i) {
+      const SampleFrame& frame = frames[sample.first + i];
+      string name = frame.info ? frame.info->function_name : "[unknown]";
+      if (!stack.empty())
+        stack += ";";
+      stack += name;
+      if (i == sample.depth - 1)
+        stack += ";" + name + ":" + to_string(max(0, frame.pc - 1));
+    }
+    ++stacks[stack];
+  }
+  for (const auto& [stack, count] : stacks)
+    out << stack << " " << count << endl;
+}
+
+
+VMSamplingScope::VMSamplingScope(VMSampler* sampler,
+                                 const vector<VMFrame>& call_stack,
+                                 const int& depth,
+                                 const volatile sig_atomic_t& growing)
+  : sampler(sampler)
+{
+  if (sampler)
+    sampler->start(call_stack, depth, growing);
+}
+
+
+VMSamplingScope::~VMSamplingScope()
+{
+  if (sampler)
+    sampler->stop();
+}
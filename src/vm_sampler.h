@@ -0,0 +1,111 @@
+//----------------------------------------------------------------------
+// FILE: vm_sampler.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Sampling profiler of the VM call stack (folded stack output)
+//----------------------------------------------------------------------
+
+#ifndef VM_SAMPLER_H
+#define VM_SAMPLER_H
+
+#include <csignal>
+#include <iostream>
+#include <vector>
+#include "vm_frame.h"
+
+
+// The sampler sets a SIGPROF interval timer (of process cpu time) and
+// on each signal copies the vm's active frames (their frame types and
+// pcs) into a buffer allocated up front. The vm is not otherwise
+// involved, so its loop runs as fast as without sampling. Only one
+// sampler can run at a time (POSIX only).
+class VMSampler
+{
+public:
+
+  // a sampler taking the given number of samples per second of cpu
+  // time, with room for max_frames frames over all samples
+  explicit VMSampler(int hz, int max_frames = 1 << 20);
+  VMSampler(const VMSampler&) = delete;
+  VMSampler& operator=(const VMSampler&) = delete;
+
+  // stops sampling
+  ~VMSampler();
+
+  // true if samples can be taken on this platform
+  static bool supported();
+
+  // clear the samples and sample the given call stack (the first depth
+  // frames are active) until stop, skipping samples while growing is
+  // set (the call stack is being reallocated)
+  void start(const std::vector<VMFrame>& call_stack, const int& depth,
+             const volatile std::sig_atomic_t& growing);
+
+  // stop sampling
+  void stop();
+
+  // number of samples taken, and not taken because the buffer was
+  // full or the call stack was being reallocated
+  int sample_count() const;
+  int dropped_count() const;
+
+  // write the samples in folded stack format, one line per distinct
+  // stack with its function names from main to the sampled function,
+  // then the function name and pc, followed by the number of samples:
+  //   main;fib;fib;fib:12 5
+  void write_folded(std::ostream& out) const;
+
+private:
+
+  // deepest frames kept in a sample (the outermost are cut off)
+  static constexpr int MAX_SAMPLE_DEPTH = 256;
+
+  struct Sample
+  {
+    // index of the sample's first frame, its frame count, and whether
+    // outer frames were cut off
+    int first;
+    int depth;
+    bool truncated;
+  };
+
+  struct SampleFrame
+  {
+    const VMFrameInfo* info;
+    int pc;
+  };
+
+  int interval_us;
+
+  // buffers allocated when constructed (only added to when sampling)
+  std::vector<Sample> samples;
+  std::vector<SampleFrame> frames;
+  int sample_total = 0;
+  int frame_total = 0;
+  int dropped = 0;
+
+  // the sampled call stack
+  const std::vector<VMFrame>* call_stack = nullptr;
+  const int* call_depth = nullptr;
+  const volatile std::sig_atomic_t* stack_growing = nullptr;
+  bool running = false;
+
+  // take a sample (run by the signal handler)
+  void sample();
+  static void handle(int signal);
+};
+
+
+// samples for the lifetime of the scope (if given a sampler)
+class VMSamplingScope
+{
+public:
+  VMSamplingScope(VMSampler* sampler, const std::vector<VMFrame>& call_stack,
+                  const int& depth, const volatile std::sig_atomic_t& growing);
+  ~VMSamplingScope();
+private:
+  VMSampler* sampler;
+};
+
+
+#endif
@@ -0,0 +1,170 @@
+//----------------------------------------------------------------------
+// FILE: vm_value.h
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Compact (16 byte) tagged representation of MyPL VM values
+//----------------------------------------------------------------------
+
+#ifndef VM_VALUE_H
+#define VM_VALUE_H
+
+#include <cstddef>
+#include <string>
+#include <utility>
+
+
+// Reference counted string storage shared between vm values. Copying
+// a string value only bumps the count, the characters are never copied.
+class VMString
+{
+public:
+
+  // create a new string with a reference count of one
+  static VMString* create(const std::string& str) {return new VMString(str);}
+  static VMString* create(std::string&& str) {return new VMString(std::move(str));}
+
+  // reference counting
+  void retain() {++refs;}
+  void release() {if (--refs == 0) delete this;}
+  int ref_count() const {return refs;}
+
+  // the underlying characters
+  const std::string& str() const {return value;}
+
+  // add to the end of the string (only when it is not shared)
+  void append(const std::string& str) {value += str;}
+
+private:
+
+  VMString(const std::string& str) : value(str) {}
+  VMString(std::string&& str) : value(std::move(str)) {}
+
+  // number of vm values referring to the string
+  int refs = 1;
+
+  // the string value
+  std::string value;
+
+};
+
+
+// the possible types of a vm value
+enum class VMType : unsigned char {INT, DOUBLE, BOOL, STRING, HANDLE, NULLPTR};
+
+
+// vm values are one of int, double, bool, string, heap object handle,
+// or null
+class VMValue
+{
+public:
+
+  // constructors for each value type
+  VMValue() : tag(VMType::NULLPTR), i(0) {}
+  VMValue(std::nullptr_t) : tag(VMType::NULLPTR), i(0) {}
+  VMValue(int x) : tag(VMType::INT), i(x) {}
+  VMValue(double x) : tag(VMType::DOUBLE), d(x) {}
+  VMValue(bool x) : tag(VMType::BOOL), b(x) {}
+  VMValue(const char* x) : tag(VMType::STRING), s(VMString::create(x)) {}
+  VMValue(const std::string& x) : tag(VMType::STRING), s(VMString::create(x)) {}
+  VMValue(std::string&& x)
+    : tag(VMType::STRING), s(VMString::create(std::move(x))) {}
+
+  // a reference to a struct or array object (see vm_heap.h)
+  static VMValue handle(int h) {VMValue x(h); x.tag = VMType::HANDLE; return x;}
+
+  // copying shares the string (if any)
+  VMValue(const VMValue& other) : tag(other.tag), raw(other.raw)
+  {
+    if (tag == VMType::STRING)
+      s->retain();
+  }
+
+  VMValue(VMValue&& other) noexcept : tag(other.tag), raw(other.raw)
+  {
+    other.tag = VMType::NULLPTR;
+  }
+
+  VMValue& operator=(const VMValue& other)
+  {
+    if (other.tag == VMType::STRING)
+      other.s->retain();
+    if (tag == VMType::STRING)
+      s->release();
+    tag = other.tag;
+    raw = other.raw;
+    return *this;
+  }
+
+  VMValue& operator=(VMValue&& other) noexcept
+  {
+    if (this != &other) {
+      if (tag == VMType::STRING)
+        s->release();
+      tag = other.tag;
+      raw = other.raw;
+      other.tag = VMType::NULLPTR;
+    }
+    return *this;
+  }
+
+  ~VMValue()
+  {
+    if (tag == VMType::STRING)
+      s->release();
+  }
+
+  // type queries
+  VMType type() const {return tag;}
+  bool is_int() const {return tag == VMType::INT;}
+  bool is_double() const {return tag == VMType::DOUBLE;}
+  bool is_bool() const {return tag == VMType::BOOL;}
+  bool is_string() const {return tag == VMType::STRING;}
+  bool is_handle() const {return tag == VMType::HANDLE;}
+  bool is_null() const {return tag == VMType::NULLPTR;}
+
+  // value access (the caller is responsible for checking the type)
+  int as_int() const {return i;}
+  int as_handle() const {return i;}
+  double as_double() const {return d;}
+  bool as_bool() const {return b;}
+  const std::string& as_string() const {return s->str();}
+
+  // append to a string value, in place if no other value shares the
+  // string (so repeatedly appending to one value is amortized linear)
+  void append(const std::string& x)
+  {
+    if (s->ref_count() == 1)
+      s->append(x);
+    else {
+      VMString* t = VMString::create(s->str() + x);
+      s->release();
+      s = t;
+    }
+  }
+
+  // the shared string storage (for string values only)
+  const VMString* string_ref() const {return s;}
+
+private:
+
+  // the jit's native code reads and writes the tag and value directly
+  friend class VMJit;
+
+  // the type of the value
+  VMType tag;
+
+  // the value itself (strings are held by reference)
+  union {
+    int i;
+    double d;
+    bool b;
+    VMString* s;
+    unsigned long long raw;     // for copying the value bits
+  };
+
+};
+
+static_assert(sizeof(VMValue) == 16, "VMValue should fit in 16 bytes");
+
+
+#endif
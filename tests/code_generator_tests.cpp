@@ -742,6 +742,35 @@ TEST(BasicCodeGenTest, BasicElseIf) {
   restore_cout();
 }
 
+TEST(BasicCodeGenTest, MultipleElseIfs) {
+  stringstream in(build_string({
+        "void main() {",
+        "  for (int i = 0; i < 4; i = i + 1) {",
+        "    if (i == 0) {",
+        "      print('a')",
+        "    }",
+        "    elseif (i == 1) {",
+        "      print('b')",
+        "    }",
+        "    elseif (i == 2) {",
+        "      print('c')",
+        "    }",
+        "    else {",
+        "      print('d')",
+        "    }",
+        "  }",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("abcd", out.str());
+  restore_cout();
+}
+
 //----------------------------------------------------------------------
 // Function calls
 //----------------------------------------------------------------------
@@ -1172,6 +1201,39 @@ TEST(BasicCodeGenTest, ArrayAsParam) {
   restore_cout();
 }
 
+TEST(BasicCodeGenTest, GarbageCollectedLoop) {
+  stringstream in(build_string({
+        "struct Node {int val, Node next}",
+        "void main() {",
+        "  Node head = null",
+        "  for (int i = 0; i < 1000; i = i + 1) {",
+        "    Node n = new Node",
+        "    n.val = i",
+        "    n.next = head",
+        "    head = n",
+        "    array int garbage = new int[100]",
+        "  }",
+        "  int sum = 0",
+        "  while (head != null) {",
+        "    sum = sum + head.val",
+        "    head = head.next",
+        "  }",
+        "  print(sum)",
+        "}"
+      }));
+  VM vm;
+  vm.set_gc_threshold(16 * 1024);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("499500", out.str());
+  restore_cout();
+  EXPECT_LT(0, vm.gc_stats().collections);
+  EXPECT_LE(900, vm.gc_stats().objects_freed);
+}
+
 
 //----------------------------------------------------------------------
 // Built-in functions
@@ -1289,6 +1351,137 @@ TEST(BasicCodeGenTest, StringConcat) {
   restore_cout();
 }
 
+TEST(BasicCodeGenTest, RepeatedConcatAssign) {
+  stringstream in(build_string({
+        "void main() {",
+        "  string s = \"a\"",
+        "  string t = s",
+        "  for (int i = 0; i < 3; i = i + 1) {",
+        "    s = concat(s, \"b\")",
+        "  }",
+        "  string u = s",
+        "  s = concat(s, s)",
+        "  s = concat(s, \"c\")",
+        "  print(concat(t, \" \"))",
+        "  print(concat(u, \" \"))",
+        "  print(s)",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("a abbb abbbabbbc", out.str());
+  restore_cout();
+}
+
+TEST(BasicCodeGenTest, TailCallRunsInConstantStack) {
+  stringstream in(build_string({
+        "int count(int n, int total) {",
+        "  if (n == 0) {",
+        "    return total",
+        "  }",
+        "  return count(n - 1, total + 2)",
+        "}",
+        "void main() {",
+        "  print(count(100000, 0))",
+        "}"
+      }));
+  VM vm;
+  vm.set_max_stack_size(64);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  string ir = to_string(vm);
+  EXPECT_NE(string::npos, ir.find("TAILCALL(count)"));
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("200000", out.str());
+  restore_cout();
+}
+TEST(BasicCodeGenTest, OnlyCallsInReturnPositionAreTailCalls) {
+  stringstream in(build_string({
+        "int f(int n) {",
+        "  return n",
+        "}",
+        "int g(int n) {",
+        "  return f(n) + 1",
+        "}",
+        "string h(int n) {",
+        "  return to_string(n)",
+        "}",
+        "void main() {",
+        "  print(g(1))",
+        "  print(h(2))",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  EXPECT_EQ(string::npos, to_string(vm).find("TAILCALL"));
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("22", out.str());
+  restore_cout();
+}
+
+TEST(BasicCodeGenTest, RuntimeErrorReportsSourceLine) {
+  stringstream in(build_string({
+        "void main() {",
+        "  array int xs = new int[3]",
+        "  int i = 5",
+        "  int x = xs[i]",
+        "}"
+      }));
+  VM vm;
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_TRUE(err.starts_with("VM Error: out-of-bounds array index (in main at "));
+    EXPECT_TRUE(err.ends_with(": GETI()) at line 4, column 11")) << err;
+  }
+}
+
+TEST(BasicCodeGenTest, ProfileCountsSourceLines) {
+  stringstream in(build_string({
+        "void main() {",
+        "  int s = 0",
+        "  int i = 0",
+        "  while (i < 10) {",
+        "    s = s + i",
+        "    i = i + 1",
+        "  }",
+        "  print(s)",
+        "}"
+      }));
+  VM vm;
+  vm.set_superinstructions(false);
+  vm.set_profiling(true);
+  CodeGenerator generator(vm);
+  ASTParser(Lexer(in)).parse().accept(generator);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("45", out.str());
+  const VMProfiler* profile = vm.profile();
+  // LOAD, LOAD, ADD, STORE per iteration
+  EXPECT_EQ(40, profile->line_count(5));
+  EXPECT_EQ(40, profile->line_count(6));
+  // LOAD, WRITE, and the implicit PUSH(null), RET
+  EXPECT_EQ(4, profile->line_count(8));
+  const VMFunctionProfile* main = profile->function("main");
+  EXPECT_TRUE(main->line_ms.contains(5));
+  EXPECT_EQ(0, profile->line_count(7));
+}
+
 
 //----------------------------------------------------------------------
 // main
@@ -251,7 +251,7 @@ TEST(DeleteTests, DeleteOneFieldStruct) {
   } catch(MyPLException& ex) {
     string err = ex.what();
     string msg = "VM Error: struct does not exist ";
-    msg += "(in main at 1: GETF(a))";
+    msg += "(in main at 8: GETF(field_1))";
     EXPECT_EQ(msg, err);
   }
   restore_cout();
@@ -288,7 +288,7 @@ TEST(DeleteTests, DeleteTwoFieldStruct) {
   } catch(MyPLException& ex) {
     string err = ex.what();
     string msg = "VM Error: struct does not exist ";
-    msg += "(in main at 1: GETF(a))";
+    msg += "(in main at 18: GETF(field_2))";
     EXPECT_EQ(msg, err);
   }
   restore_cout();
@@ -313,7 +313,7 @@ TEST(DeleteTests, BasicArrayDeleteGet) {
   } catch(MyPLException& ex) {
     string err = ex.what();
     string msg = "VM Error: array does not exist ";
-    msg += "(in main at 4: GETI())";
+    msg += "(in main at 6: GETI())";
     EXPECT_EQ(msg, err);
   }
   restore_cout();
@@ -339,11 +339,81 @@ TEST(DeleteTests, BasicArrayDeleteSet) {
   } catch(MyPLException& ex) {
     string err = ex.what();
     string msg = "VM Error: array does not exist ";
-    msg += "(in main at 5: SETI())";
+    msg += "(in main at 7: SETI())";
     EXPECT_EQ(msg, err);
   }
   restore_cout();
 }
+TEST(DeleteTests, StaleArrayAfterSlotReuse) {
+  VMFrameInfo main {"main", 1};
+  main.instructions.push_back(VMInstr::PUSH(5));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::ALLOCA());
+  main.instructions.push_back(VMInstr::STORE(0));   // x = old array
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::DELAR());
+  main.instructions.push_back(VMInstr::PUSH(5));    // reuses the freed slot
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ALLOCA());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::CMPEQ());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::GETI());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: array does not exist ";
+    msg += "(in main at 14: GETI())";
+    EXPECT_EQ(msg, err);
+  }
+  EXPECT_EQ("false", out.str());
+  restore_cout();
+}
+
+TEST(DeleteTests, StaleStructAfterManySlotReuses) {
+  // the slot of the old struct is freed and reused 127 times (as many
+  // times as there are generations), then holds a live struct
+  VMFrameInfo main {"main", 3};
+  main.instructions.push_back(VMInstr::ALLOCS());    // 0
+  main.instructions.push_back(VMInstr::STORE(0));    // x = old struct
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::DELS());
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::STORE(1));    // 5: i = 0
+  main.instructions.push_back(VMInstr::LOAD(1));     // 6
+  main.instructions.push_back(VMInstr::PUSH(126));
+  main.instructions.push_back(VMInstr::CMPLT());
+  main.instructions.push_back(VMInstr::JMPF(17));
+  main.instructions.push_back(VMInstr::ALLOCS());    // 10
+  main.instructions.push_back(VMInstr::DELS());
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(1));
+  main.instructions.push_back(VMInstr::JMP(6));
+  main.instructions.push_back(VMInstr::ALLOCS());    // 17
+  main.instructions.push_back(VMInstr::STORE(2));    // y = live struct
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::ADDF("x"));   // 20
+  VM vm;
+  vm.add(main);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: struct does not exist (in main at 20: ADDF(x))",
+              string(ex.what()));
+  }
+}
+
 //----------------------------------------------------------------------
 // Code Generator tests
 //----------------------------------------------------------------------
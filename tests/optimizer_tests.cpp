@@ -0,0 +1,1031 @@
+//----------------------------------------------------------------------
+// FILE: optimizer_tests.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Bytecode optimizer tests
+//----------------------------------------------------------------------
+
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <gtest/gtest.h>
+#include "mypl_exception.h"
+#include "lexer.h"
+#include "ast_parser.h"
+#include "semantic_checker.h"
+#include "vm.h"
+#include "vm_optimizer.h"
+#include "constant_folder.h"
+#include "code_generator.h"
+
+using namespace std;
+
+
+streambuf* stream_buffer;
+
+
+void change_cout(stringstream& out)
+{
+  stream_buffer = cout.rdbuf();
+  cout.rdbuf(out.rdbuf());
+}
+
+void restore_cout()
+{
+  cout.rdbuf(stream_buffer);
+}
+
+string build_string(initializer_list<string> strs)
+{
+  string result = "";
+  for (string s : strs)
+    result += s + "\n";
+  return result;
+}
+
+// compile the program into the vm (type checking it first if checked,
+// which lets the code generator emit type-specialized opcodes)
+void compile(const string& program, VM& vm, bool checked)
+{
+  stringstream in(program);
+  Program p = ASTParser(Lexer(in)).parse();
+  if (checked) {
+    SemanticChecker checker;
+    p.accept(checker);
+  }
+  CodeGenerator generator(vm);
+  p.accept(generator);
+}
+
+// compile and run the program, returning its output (followed by the
+// error message if it fails)
+string run(const string& program, bool superinstructions, bool checked = false,
+           bool quickening = true)
+{
+  VM vm;
+  vm.set_superinstructions(superinstructions);
+  vm.set_quickening(quickening);
+  compile(program, vm, checked);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+// run the struct layouts and frames, returning the output (followed by
+// the error message if it fails)
+string run(const vector<VMStructLayout>& layouts,
+           const vector<VMFrameInfo>& frames, bool quickening)
+{
+  VM vm;
+  vm.set_quickening(quickening);
+  for (const VMStructLayout& layout : layouts)
+    vm.add(layout);
+  for (const VMFrameInfo& frame : frames)
+    vm.add(frame);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+// check that the program gives the expected output with and without
+// superinstructions, type-specialized opcodes, and quickening
+void expect_same(const string& program, const string& expected)
+{
+  EXPECT_EQ(expected, run(program, false, false, false));
+  EXPECT_EQ(expected, run(program, false));
+  EXPECT_EQ(expected, run(program, true));
+  EXPECT_EQ(expected, run(program, false, true));
+  EXPECT_EQ(expected, run(program, true, true));
+}
+
+
+//----------------------------------------------------------------------
+// Superinstruction fusion
+//----------------------------------------------------------------------
+
+TEST(SuperinstructionTest, FusesIncrement) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));
+  EXPECT_EQ(1, fuse_superinstructions(main));
+  EXPECT_EQ(OpCode::INCL, main.instructions[0].exec_opcode());
+  EXPECT_EQ(OpCode::LOAD, main.instructions[0].opcode());
+  EXPECT_EQ(OpCode::PUSH, main.instructions[1].exec_opcode());
+}
+
+TEST(SuperinstructionTest, NoIncrementOfOtherVariable) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(1));
+  EXPECT_EQ(0, fuse_superinstructions(main));
+}
+
+TEST(SuperinstructionTest, NoIncrementOfNonIntConstant) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1.5));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));
+  EXPECT_EQ(0, fuse_superinstructions(main));
+}
+
+TEST(SuperinstructionTest, FusesCompareAndJump) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::CMPGE());
+  main.instructions.push_back(VMInstr::JMPF(0));
+  EXPECT_EQ(1, fuse_superinstructions(main));
+  EXPECT_EQ(OpCode::CMPGE_JMPF, main.instructions[2].exec_opcode());
+}
+
+TEST(SuperinstructionTest, FusesFieldLoad) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("x", 0));
+  EXPECT_EQ(1, fuse_superinstructions(main));
+  EXPECT_EQ(OpCode::LOADL_GETF, main.instructions[0].exec_opcode());
+}
+
+TEST(SuperinstructionTest, NoFusionAcrossJumpTarget) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::CMPLT());
+  main.instructions.push_back(VMInstr::JMPF(6));
+  main.instructions.push_back(VMInstr::PUSH(true));
+  main.instructions.push_back(VMInstr::JMP(3));     // into the pair
+  main.instructions.push_back(VMInstr::NOP());
+  EXPECT_EQ(0, fuse_superinstructions(main));
+}
+
+TEST(SuperinstructionTest, Unfuse) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("x"));
+  fuse_superinstructions(main);
+  unfuse_superinstructions(main);
+  EXPECT_EQ(OpCode::LOAD, main.instructions[0].exec_opcode());
+}
+
+TEST(SuperinstructionTest, ErrorReportedAtOriginalInstruction) {
+  VMFrameInfo main {"main", 1};
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(0));
+  VM vm;
+  vm.add(main);
+  try {
+    vm.run();
+    FAIL();
+  } catch (MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_EQ("VM Error: null reference (in main at 4: ADD())", err);
+  }
+}
+
+
+//----------------------------------------------------------------------
+// Semantic equivalence (with and without superinstructions)
+//----------------------------------------------------------------------
+
+TEST(SuperinstructionTest, CountingLoops) {
+  expect_same(build_string({
+        "void main() {",
+        "  int sum = 0",
+        "  for (int i = 0; i < 10; i = i + 1) {",
+        "    sum = sum + i",
+        "  }",
+        "  int j = 10",
+        "  while (j < 20) {",
+        "    j = j + 3",
+        "  }",
+        "  print(sum)",
+        "  print(' ')",
+        "  print(j)",
+        "}"
+      }), "45 22");
+}
+
+TEST(SuperinstructionTest, AllComparisonJumps) {
+  expect_same(build_string({
+        "void main() {",
+        "  for (int i = 0; i < 3; i = i + 1) {",
+        "    if (i < 1) {print('a')}",
+        "    if (i <= 1) {print('b')}",
+        "    if (i > 1) {print('c')}",
+        "    if (i >= 1) {print('d')}",
+        "    if (i == 1) {print('e')}",
+        "    if (i != 1) {print('f')}",
+        "  }",
+        "  string s = \"x\"",
+        "  if (s == \"x\") {print('g')}",
+        "  if (s != null) {print('h')}",
+        "}"
+      }), "abfbdecdfgh");
+}
+
+TEST(SuperinstructionTest, StructFieldLoads) {
+  expect_same(build_string({
+        "struct Node {int val, Node next}",
+        "void main() {",
+        "  Node head = null",
+        "  for (int i = 1; i <= 4; i = i + 1) {",
+        "    Node n = new Node",
+        "    n.val = i * i",
+        "    n.next = head",
+        "    head = n",
+        "  }",
+        "  while (head != null) {",
+        "    print(head.val)",
+        "    print(' ')",
+        "    head = head.next",
+        "  }",
+        "}"
+      }), "16 9 4 1 ");
+}
+
+TEST(SuperinstructionTest, DoubleIncrement) {
+  expect_same(build_string({
+        "void main() {",
+        "  double d = 0.5",
+        "  d = d + 1.25",
+        "  int i = 2",
+        "  i = i + 1",
+        "  print(d)",
+        "  print(' ')",
+        "  print(i)",
+        "}"
+      }), "1.750000 3");
+}
+
+TEST(SuperinstructionTest, NullFieldLoadError) {
+  expect_same(build_string({
+        "struct S {int x}",
+        "void main() {",
+        "  S s = null",
+        "  print(s.x)",
+        "}"
+      }), "VM Error: null reference (in main at 3: GETF(x)) at line 4, column 11");
+}
+
+TEST(SuperinstructionTest, NullCompareError) {
+  string program = build_string({
+      "void main() {",
+      "  int i = null",
+      "  while (i < 10) {",
+      "    i = i + 1",
+      "  }",
+      "}"
+    });
+  string msg = "VM Error: null reference (in main at 4: ";
+  string pos = " at line 3, column 12";
+  EXPECT_EQ(msg + "CMPLT())" + pos, run(program, false));
+  EXPECT_EQ(msg + "CMPLT())" + pos, run(program, true));
+  EXPECT_EQ(msg + "CMPLTI())" + pos, run(program, false, true));
+  EXPECT_EQ(msg + "CMPLTI())" + pos, run(program, true, true));
+}
+
+TEST(SuperinstructionTest, RecursiveCalls) {
+  expect_same(build_string({
+        "int fib(int n) {",
+        "  if (n < 2) {return n}",
+        "  return fib(n - 1) + fib(n - 2)",
+        "}",
+        "void main() {",
+        "  print(fib(15))",
+        "}"
+      }), "610");
+}
+
+
+//----------------------------------------------------------------------
+// Type-specialized opcodes
+//----------------------------------------------------------------------
+
+TEST(TypedOpcodeTest, EmittedForCheckedPrograms) {
+  string program = build_string({
+      "void main() {",
+      "  int i = 1 + 2",
+      "  double d = 1.5 * 2.0",
+      "  bool b1 = \"a\" < \"b\"",
+      "  bool b2 = 'a' >= 'b'",
+      "  bool b3 = i == 3",
+      "}"
+    });
+  VM vm;
+  compile(program, vm, true);
+  stringstream out;
+  out << to_string(vm);
+  string code = out.str();
+  EXPECT_NE(string::npos, code.find("ADDI()"));
+  EXPECT_NE(string::npos, code.find("MULD()"));
+  EXPECT_NE(string::npos, code.find("CMPLTS()"));
+  EXPECT_NE(string::npos, code.find("CMPGES()"));
+  EXPECT_NE(string::npos, code.find("CMPEQ()"));
+}
+
+TEST(TypedOpcodeTest, GenericWithoutTypes) {
+  VM vm;
+  compile(build_string({"void main() {", "  int i = 1 + 2", "}"}), vm, false);
+  stringstream out;
+  out << to_string(vm);
+  EXPECT_EQ(string::npos, out.str().find("ADDI()"));
+  EXPECT_NE(string::npos, out.str().find("ADD()"));
+}
+
+TEST(TypedOpcodeTest, Arithmetic) {
+  expect_same(build_string({
+        "void main() {",
+        "  int i = 7",
+        "  double d = 2.5",
+        "  print(i + 3) print(' ') print(i - 3) print(' ')",
+        "  print(i * 3) print(' ') print(i / 3) print(' ')",
+        "  print(d + 1.0) print(' ') print(d - 1.0) print(' ')",
+        "  print(d * 2.0) print(' ') print(d / 2.0)",
+        "}"
+      }), "10 4 21 2 3.500000 1.500000 5.000000 1.250000");
+}
+
+TEST(TypedOpcodeTest, Comparisons) {
+  expect_same(build_string({
+        "void main() {",
+        "  int i = 2",
+        "  double d = 2.5",
+        "  string s = \"bc\"",
+        "  char c = 'b'",
+        "  print(i < 3) print(i <= 1) print(i > 1) print(i >= 3)",
+        "  print(d < 3.0) print(d <= 2.5) print(d > 2.5) print(d >= 1.0)",
+        "  print(s < \"bd\") print(s <= \"b\") print(s > \"a\") print(s >= \"c\")",
+        "  print(c < 'c') print(c >= 'c')",
+        "}"
+      }), "truefalsetruefalsetruetruefalsetruetruefalsetruefalsetruefalse");
+}
+
+TEST(TypedOpcodeTest, NullOperandError) {
+  string program = build_string({
+      "void main() {",
+      "  int i = null",
+      "  print(i * 2)",
+      "}"
+    });
+  EXPECT_EQ("VM Error: null reference (in main at 4: MUL()) at line 3, column 11",
+            run(program, true));
+  EXPECT_EQ("VM Error: null reference (in main at 4: MULI()) at line 3, column 11",
+            run(program, true, true));
+}
+
+
+//----------------------------------------------------------------------
+// Quickening
+//----------------------------------------------------------------------
+
+// main calls f with each pair of arguments, printing the results
+VMFrameInfo call_with_pairs(const vector<pair<VMValue,VMValue>>& args)
+{
+  VMFrameInfo main {"main", 0};
+  for (const auto& [x, y] : args) {
+    main.instructions.push_back(VMInstr::PUSH(x));
+    main.instructions.push_back(VMInstr::PUSH(y));
+    main.instructions.push_back(VMInstr::CALL("f"));
+    main.instructions.push_back(VMInstr::WRITE());
+    main.instructions.push_back(VMInstr::PUSH(" "));
+    main.instructions.push_back(VMInstr::WRITE());
+  }
+  return main;
+}
+
+TEST(QuickeningTest, PolymorphicAdd) {
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::STORE(0));    // x
+  f.instructions.push_back(VMInstr::STORE(1));    // y
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main = call_with_pairs({{1, 2}, {3, 4}, {1.5, 2.0}, {5, 6},
+      {0.5, 0.25}});
+  string expected = "3 7 3.500000 11 0.750000 ";
+  EXPECT_EQ(expected, run({}, {f, main}, true));
+  EXPECT_EQ(expected, run({}, {f, main}, false));
+}
+
+TEST(QuickeningTest, PolymorphicCompare) {
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::STORE(0));    // x
+  f.instructions.push_back(VMInstr::STORE(1));    // y
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::CMPLT());
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main = call_with_pairs({{1, 2}, {2, 1}, {1.5, 2.5}, {"b", "a"},
+      {"a", "b"}, {3, 4}});
+  string expected = "true false true false true true ";
+  EXPECT_EQ(expected, run({}, {f, main}, true));
+  EXPECT_EQ(expected, run({}, {f, main}, false));
+}
+
+TEST(QuickeningTest, RepeatedTypeChanges) {
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::STORE(0));    // x
+  f.instructions.push_back(VMInstr::STORE(1));    // y
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::MUL());
+  f.instructions.push_back(VMInstr::RET());
+  vector<pair<VMValue,VMValue>> args;
+  string expected = "";
+  for (int i = 0; i < 10; ++i) {
+    args.push_back({i, 2});
+    args.push_back({0.5, 3.0});
+    expected += to_string(i * 2) + " 1.500000 ";
+  }
+  EXPECT_EQ(expected, run({}, {f, call_with_pairs(args)}, true));
+}
+
+TEST(QuickeningTest, NullAfterQuickening) {
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  EXPECT_EQ("2VM Error: null reference (in f at 3: ADD())",
+            run({}, {f, main}, true));
+}
+
+TEST(QuickeningTest, FieldByNameAcrossLayouts) {
+  VMStructLayout a {"A", {"x", "y"}};
+  VMStructLayout b {"B", {"y", "x"}};
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::GETF("x"));    // by name
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  auto call = [&](int x) {
+    main.instructions.push_back(VMInstr::DUP());
+    main.instructions.push_back(VMInstr::PUSH(x));
+    main.instructions.push_back(VMInstr::SETF("x"));
+    main.instructions.push_back(VMInstr::CALL("f"));
+    main.instructions.push_back(VMInstr::WRITE());
+  };
+  main.instructions.push_back(VMInstr::ALLOCS("A"));
+  call(1);
+  main.instructions.push_back(VMInstr::ALLOCS("A"));
+  call(2);
+  main.instructions.push_back(VMInstr::ALLOCS("B"));
+  call(3);
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::DUP());
+  main.instructions.push_back(VMInstr::ADDF("x"));
+  call(4);
+  main.instructions.push_back(VMInstr::ALLOCS("A"));
+  call(5);
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  string expected = "12345VM Error: null reference (in f at 2: GETF(x))";
+  EXPECT_EQ(expected, run({a, b}, {f, main}, true));
+  EXPECT_EQ(expected, run({a, b}, {f, main}, false));
+}
+
+
+//----------------------------------------------------------------------
+// Constant folding
+//----------------------------------------------------------------------
+
+// check and fold the program, then generate its code into the vm,
+// returning the number of expressions folded
+int fold(const string& program, VM& vm)
+{
+  stringstream in(program);
+  Program p = ASTParser(Lexer(in)).parse();
+  SemanticChecker checker;
+  p.accept(checker);
+  ConstantFolder folder;
+  p.accept(folder);
+  CodeGenerator generator(vm);
+  p.accept(generator);
+  return folder.folded_count();
+}
+
+// the folded program's main instructions
+string folded_main(const string& program)
+{
+  VM vm;
+  fold(program, vm);
+  string code = to_string(vm);
+  return code.substr(code.find("Frame 'main'"));
+}
+
+// the folded program's output (followed by the error message if it
+// fails)
+string run_folded(const string& program)
+{
+  VM vm;
+  fold(program, vm);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+TEST(ConstantFoldingTest, ArithmeticAndComparisons) {
+  string program = build_string({
+      "void main() {",
+      "  int secs = 60 * 60 * 24",
+      "  double d = 1.5 * (2.0 - 0.5)",
+      "  bool b = (3 < 4) and not (2.5 >= 2.5) and (\"ab\" < \"b\")",
+      "  print(secs == 86400)",
+      "}"
+    });
+  VM vm;
+  EXPECT_EQ(10, fold(program, vm));
+  EXPECT_EQ(build_string({
+        "Frame 'main'",
+        "  0: PUSH(86400)",
+        "  1: STORE(0)",
+        "  2: PUSH(2.250000)",
+        "  3: STORE(1)",
+        "  4: PUSH(false)",
+        "  5: STORE(2)",
+        "  6: LOAD(0)",
+        "  7: PUSH(86400)",
+        "  8: CMPEQ()",
+        "  9: WRITE()",
+        "  10: PUSH(null)",
+        "  11: RET()"
+      }), folded_main(program));
+}
+
+TEST(ConstantFoldingTest, BuiltInCalls) {
+  string program = build_string({
+      "void main() {",
+      "  print(concat(to_string(6 * 7), concat(\"\\t\", to_string(0.5))))",
+      "  print(to_int(\"12\") + to_int(2.9) + to_int(to_double(3)))",
+      "  print(concat(\"\\n\", to_string(to_double(\"1.25\"))))",
+      "}"
+    });
+  VM vm;
+  EXPECT_EQ(14, fold(program, vm));
+  EXPECT_EQ("42\t0.50000017\n1.250000", run_folded(program));
+  string code = folded_main(program);
+  EXPECT_EQ(string::npos, code.find("CONCAT"));
+  EXPECT_EQ(string::npos, code.find("TO"));
+}
+
+TEST(ConstantFoldingTest, Identities) {
+  // the kept operands are never null (they are results of operators)
+  string program = build_string({
+      "void main() {",
+      "  int x = input_int()",
+      "  print((x + x) * 1)",
+      "  print(0 + (1 * (x - 1)))",
+      "  print(((x * 2) - 0) / 1)",
+      "  print((x > 0) and true)",
+      "  print(false or not (not (x > 0)))",
+      "}",
+      "int input_int() { return 3 }"
+    });
+  VM vm;
+  EXPECT_EQ(8, fold(program, vm));
+  EXPECT_EQ("626truetrue", run_folded(program));
+  string code = folded_main(program);
+  for (string op : {"DIVI(", "AND(", "OR(", "NOT("})
+    EXPECT_EQ(string::npos, code.find(op)) << op;
+}
+
+TEST(ConstantFoldingTest, IdentitiesKeepNullChecks) {
+  string program = build_string({
+      "void main() {",
+      "  int x = null",
+      "  int y = x * 1",
+      "  print(y)",
+      "}"
+    });
+  VM vm;
+  EXPECT_EQ(0, fold(program, vm));
+  EXPECT_EQ(run(program, true, true), run_folded(program));
+  EXPECT_TRUE(run_folded(program).starts_with("VM Error: null reference"));
+  for (string e : {"x * 1", "1 * x", "x / 1", "x + 0", "0 + x", "x - 0"})
+    EXPECT_EQ(0, fold("void main() {int x = null int y = " + e + "}", vm)) << e;
+  for (string e : {"b and true", "true and b", "b or false", "false or b",
+                   "not (not b)"})
+    EXPECT_EQ(0, fold("void main() {bool b = null bool c = " + e + "}", vm)) << e;
+  EXPECT_EQ(0, fold("void main() {int x = 1 int y = (x) * 1}", vm));
+}
+
+TEST(ConstantFoldingTest, DoubleZeroSumsNotSimplified) {
+  // -0.0 + 0.0 is 0.0, so x + 0.0 is not x
+  VM vm;
+  EXPECT_EQ(0, fold("void main() {double x = 1.0 print((x * x) + 0.0)}", vm));
+  EXPECT_EQ(1, fold("void main() {double x = 1.0 print((x * x) - 0.0)}", vm));
+}
+
+TEST(ConstantFoldingTest, FailuresLeftToTheVM) {
+  string program = build_string({
+      "void main() {",
+      "  print((2147483647 + 1) > 0)",
+      "  print(to_int(\"x\"))",
+      "}"
+    });
+  VM vm;
+  EXPECT_EQ(0, fold(program, vm));
+  EXPECT_EQ("falseVM Error: cannot convert string to int (in main at 7: "
+            "TOINT()) at line 3, column 9", run_folded(program));
+  EXPECT_EQ(0, fold("void main() {int x = 7 / 0}", vm));
+  EXPECT_EQ(0, fold("void main() {double x = 7.0 / 0.0}", vm));
+  EXPECT_EQ(0, fold("void main() {print(concat(\"\\\\\", \"n\"))}", vm));
+}
+
+TEST(ConstantFoldingTest, DoubleNegation) {
+  // not not b is b (without folding)
+  string program = "void main() {bool b = true print(not not b) print(not b)}";
+  EXPECT_EQ("truefalse", run(program, false, true));
+  EXPECT_EQ("truefalse", run_folded(program));
+  EXPECT_EQ("truefalse",
+            run_folded("void main() {print(not not true) print(not true)}"));
+}
+
+
+//----------------------------------------------------------------------
+// Control flow optimization
+//----------------------------------------------------------------------
+
+// compile the (checked) program with or without control flow
+// optimization, returning the number of instructions removed
+int compile_cfg(const string& program, VM& vm, bool optimize)
+{
+  stringstream in(program);
+  Program p = ASTParser(Lexer(in)).parse();
+  SemanticChecker checker;
+  p.accept(checker);
+  CodeGenerator generator(vm);
+  generator.set_control_flow_optimization(optimize);
+  p.accept(generator);
+  return generator.removed_instructions();
+}
+
+// the output of the program with or without control flow optimization
+// (followed by the error message if it fails)
+string run_cfg(const string& program, bool optimize)
+{
+  VM vm;
+  compile_cfg(program, vm, optimize);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+TEST(ControlFlowTest, ThreadsJumpsAndRemovesNops) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));     // 0
+  main.instructions.push_back(VMInstr::PUSH(true));  // 1
+  main.instructions.push_back(VMInstr::JMPF(5));     // 2
+  main.instructions.push_back(VMInstr::TOSTR());     // 3
+  main.instructions.push_back(VMInstr::JMP(7));      // 4
+  main.instructions.push_back(VMInstr::NOP());       // 5
+  main.instructions.push_back(VMInstr::JMP(8));      // 6
+  main.instructions.push_back(VMInstr::JMP(9));      // 7
+  main.instructions.push_back(VMInstr::NOP());       // 8
+  main.instructions.push_back(VMInstr::WRITE());     // 9
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::RET());
+  main.lines = {{0, 1, 1}, {5, 2, 1}, {9, 3, 5}};
+  // both jumps go to the WRITE, so JMP 4 goes to the next instruction
+  // and 5 to 8 are unreachable
+  EXPECT_EQ(5, optimize_control_flow(main));
+  ASSERT_EQ(7, main.instructions.size());
+  EXPECT_EQ(OpCode::JMPF, main.instructions[2].opcode());
+  EXPECT_EQ(4, main.instructions[2].operand()->as_int());
+  EXPECT_EQ(OpCode::TOSTR, main.instructions[3].opcode());
+  EXPECT_EQ(OpCode::WRITE, main.instructions[4].opcode());
+  ASSERT_EQ(2, main.lines.size());
+  EXPECT_EQ(0, main.lines[0].pc);
+  EXPECT_EQ(4, main.lines[1].pc);
+  EXPECT_EQ(3, main.lines[1].line);
+  EXPECT_EQ("1", run({}, {main}, true));
+}
+
+TEST(ControlFlowTest, RemovesUnreachableBlocks) {
+  VMFrameInfo f {"f", 0};
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::RET());
+  f.instructions.push_back(VMInstr::PUSH(2));
+  f.instructions.push_back(VMInstr::JMP(0));
+  f.instructions.push_back(VMInstr::PUSH(nullptr));
+  f.instructions.push_back(VMInstr::RET());
+  EXPECT_EQ(4, optimize_control_flow(f));
+  ASSERT_EQ(2, f.instructions.size());
+  EXPECT_EQ(OpCode::RET, f.instructions[1].opcode());
+  // an infinite loop is kept (and nothing after it)
+  VMFrameInfo g {"g", 0};
+  g.instructions.push_back(VMInstr::NOP());
+  g.instructions.push_back(VMInstr::JMP(0));
+  g.instructions.push_back(VMInstr::RET());
+  EXPECT_EQ(2, optimize_control_flow(g));
+  ASSERT_EQ(1, g.instructions.size());
+  EXPECT_EQ(OpCode::JMP, g.instructions[0].opcode());
+  EXPECT_EQ(0, g.instructions[0].operand()->as_int());
+}
+
+TEST(ControlFlowTest, FramesFallingOffTheEndUnchanged) {
+  VMFrameInfo f {"f", 0};
+  f.instructions.push_back(VMInstr::NOP());
+  f.instructions.push_back(VMInstr::PUSH(1));
+  EXPECT_EQ(0, optimize_control_flow(f));
+  VMFrameInfo g {"g", 0};
+  g.instructions.push_back(VMInstr::JMP(2));
+  g.instructions.push_back(VMInstr::RET());
+  EXPECT_EQ(0, optimize_control_flow(g));
+  EXPECT_EQ(2, g.instructions.size());
+}
+
+TEST(ControlFlowTest, GeneratedProgramsRunTheSame) {
+  string program = build_string({
+      "int f(int n) {",
+      "  int s = 0",
+      "  for (int i = 0; i < n; i = i + 1) {",
+      "    if (i < 3) { s = s + 1 }",
+      "    elseif (i < 5) { s = s + 2 }",
+      "    else { s = s + 3 }",
+      "  }",
+      "  while (s > 20) {",
+      "    if (s > 25) { return s }",
+      "    s = s - 1",
+      "  }",
+      "  if (s > 0) { return s } else { return 0 - s }",
+      "}",
+      "void main() {",
+      "  print(f(3)) print(f(10)) print(f(8))",
+      "  int x = 0",
+      "  if (f(1) > 0) { }",
+      "  while (x < 2) { x = x + 1 if (x == 1) { } else { print(x) } }",
+      "}"
+    });
+  VM vm;
+  EXPECT_LT(0, compile_cfg(program, vm, true));
+  EXPECT_EQ(string::npos, to_string(vm).find("NOP"));
+  EXPECT_EQ("320162", run_cfg(program, true));
+  EXPECT_EQ("320162", run_cfg(program, false));
+  EXPECT_EQ(0, compile_cfg(program, vm, false));
+}
+
+TEST(ControlFlowTest, ErrorsReportedAtSourceLine) {
+  string program = build_string({
+      "void main() {",
+      "  int x = 0",
+      "  while (x < 3) {",
+      "    if (x == 2) {",
+      "      string s = null",
+      "      print(length(s))",
+      "    }",
+      "    x = x + 1",
+      "  }",
+      "}"
+    });
+  string output = run_cfg(program, true);
+  EXPECT_TRUE(output.ends_with("at line 6, column 13")) << output;
+  string unoptimized = run_cfg(program, false);
+  EXPECT_EQ(unoptimized.substr(unoptimized.find(")")),
+            output.substr(output.find(")")));
+}
+
+
+//----------------------------------------------------------------------
+// Inlining
+//----------------------------------------------------------------------
+
+// compile the (checked) program inlining functions of at most threshold
+// instructions, returning the inlined calls
+vector<VMInlinedCall> compile_inlined(const string& program, VM& vm,
+                                      int threshold)
+{
+  stringstream in(program);
+  Program p = ASTParser(Lexer(in)).parse();
+  SemanticChecker checker;
+  p.accept(checker);
+  CodeGenerator generator(vm);
+  generator.set_control_flow_optimization(true);
+  generator.set_inline_threshold(threshold);
+  p.accept(generator);
+  return generator.inlined_calls();
+}
+
+// the output of the program compiled with the inlining threshold
+// (followed by the error message if it fails)
+string run_inlined(const string& program, int threshold)
+{
+  VM vm;
+  compile_inlined(program, vm, threshold);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+TEST(InliningTest, SmallFunctionsInlined) {
+  string program = build_string({
+      "int sq(int x) { return x * x }",
+      "int sum(int a, int b, int c) { return a + sq(b) + c }",
+      "string greet(string s) { return concat(\"hi \", s) }",
+      "void main() {",
+      "  int t = 0",
+      "  for (int i = 0; i < 4; i = i + 1) {",
+      "    t = t + sum(i, i, 1)",
+      "  }",
+      "  print(t)",
+      "  print(greet(\"x\"))",
+      "}"
+    });
+  VM vm;
+  vector<VMInlinedCall> calls = compile_inlined(program, vm, 16);
+  ASSERT_EQ(3, calls.size());
+  EXPECT_EQ("sum", calls[0].caller);
+  EXPECT_EQ("sq", calls[0].callee);
+  EXPECT_EQ(2, calls[0].line);
+  EXPECT_EQ("main", calls[1].caller);
+  EXPECT_EQ("sum", calls[1].callee);
+  EXPECT_EQ(7, calls[1].line);
+  EXPECT_EQ("greet", calls[2].callee);
+  EXPECT_EQ(10, calls[2].line);
+  string code = to_string(vm);
+  string main_code = code.substr(code.find("Frame 'main'"));
+  EXPECT_EQ(string::npos, main_code.find("CALL")) << main_code;
+  EXPECT_EQ("24hi x", run_inlined(program, 16));
+  EXPECT_EQ("24hi x", run_inlined(program, 0));
+}
+
+TEST(InliningTest, CalleeSlotsClearedAfterInlinedCode) {
+  // the inlined len's slot does not keep the string alive (main has
+  // no RET, which would clear its slots)
+  VMValue blue("blue");
+  VMFrameInfo len {"len", 1};
+  len.local_count = 1;
+  len.instructions.push_back(VMInstr::STORE(0));
+  len.instructions.push_back(VMInstr::LOAD(0));
+  len.instructions.push_back(VMInstr::SLEN());
+  len.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(blue));
+  main.instructions.push_back(VMInstr::CALL("len"));
+  main.instructions.push_back(VMInstr::WRITE());
+  vector<VMFrameInfo> frames {len, main};
+  ASSERT_EQ(1, inline_calls(frames, 16).size());
+  VM vm;
+  for (const VMFrameInfo& frame : frames)
+    vm.add(frame);
+  int refs = blue.string_ref()->ref_count();
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("4", out.str());
+  EXPECT_EQ(refs, blue.string_ref()->ref_count());
+}
+
+TEST(InliningTest, ConstantsAddedOnce) {
+  string program = build_string({
+      "string greet(string s) { return concat(\"hi \", s) }",
+      "void main() { print(greet(\"x\")) print(greet(\"y\")) print(\"hi \") }"
+    });
+  VM vm;
+  EXPECT_EQ(2, compile_inlined(program, vm, 16).size());
+  string code = to_string(vm);
+  string main_code = code.substr(code.find("Frame 'main'"));
+  EXPECT_EQ(main_code.find(": hi \n"), main_code.rfind(": hi \n"));
+  EXPECT_EQ(string::npos, main_code.find("k3:"));
+  EXPECT_EQ("hi xhi yhi ", run_inlined(program, 16));
+}
+
+TEST(InliningTest, RecursiveFunctionsNotInlined) {
+  string program = build_string({
+      "int fact(int n) {",
+      "  if (n <= 1) { return 1 }",
+      "  return n * fact(n - 1)",
+      "}",
+      "bool even(int n) { if (n == 0) { return true } return odd(n - 1) }",
+      "bool odd(int n) { if (n == 0) { return false } return even(n - 1) }",
+      "int f(int n) { return fact(n) }",
+      "void main() {",
+      "  print(f(5))",
+      "  print(even(4))",
+      "}"
+    });
+  VM vm;
+  vector<VMInlinedCall> calls = compile_inlined(program, vm, 100);
+  ASSERT_EQ(1, calls.size());
+  EXPECT_EQ("f", calls[0].callee);
+  EXPECT_EQ("main", calls[0].caller);
+  EXPECT_EQ("120true", run_inlined(program, 100));
+}
+
+TEST(InliningTest, ThresholdRespected) {
+  string program = build_string({
+      "int small(int x) { return x + 1 }",
+      "int large(int x) {",
+      "  int y = x",
+      "  for (int i = 0; i < 3; i = i + 1) { y = y * 2 }",
+      "  return y",
+      "}",
+      "void main() { print(small(1)) print(large(1)) }"
+    });
+  VM vm;
+  vector<VMInlinedCall> calls = compile_inlined(program, vm, 6);
+  ASSERT_EQ(1, calls.size());
+  EXPECT_EQ("small", calls[0].callee);
+  VM no_inlining;
+  EXPECT_TRUE(compile_inlined(program, no_inlining, 0).empty());
+  VM all;
+  EXPECT_EQ(2, compile_inlined(program, all, 100).size());
+  EXPECT_EQ("28", run_inlined(program, 100));
+}
+
+TEST(InliningTest, FramesLeavingValuesNotInlined) {
+  // the call statement leaves g's result on f's operand stack
+  string program = build_string({
+      "int g() { return 1 }",
+      "void f() { g() }",
+      "void main() { f() print(2) }"
+    });
+  VM vm;
+  vector<VMInlinedCall> calls = compile_inlined(program, vm, 100);
+  ASSERT_EQ(1, calls.size());
+  EXPECT_EQ("g", calls[0].callee);
+  EXPECT_EQ("f", calls[0].caller);
+  EXPECT_EQ("2", run_inlined(program, 100));
+}
+
+TEST(InliningTest, CallerLocalsKeptAndErrorsAtCalleeLine) {
+  string program = build_string({
+      "int len(string s) {",
+      "  int n = length(s)",
+      "  return n",
+      "}",
+      "void main() {",
+      "  int n = 7",
+      "  string s = \"abc\"",
+      "  print(len(s))",
+      "  print(n)",
+      "  print(s)",
+      "  string t = null",
+      "  print(len(t))",
+      "}"
+    });
+  string output = run_inlined(program, 16);
+  EXPECT_TRUE(output.starts_with("37abc")) << output;
+  EXPECT_TRUE(output.ends_with("at line 2, column 11")) << output;
+}
+
+
+//----------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,392 @@
+//----------------------------------------------------------------------
+// FILE: register_tests.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: Register VM and register code generator tests
+//----------------------------------------------------------------------
+
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <gtest/gtest.h>
+#include "mypl_exception.h"
+#include "lexer.h"
+#include "ast_parser.h"
+#include "semantic_checker.h"
+#include "vm.h"
+#include "code_generator.h"
+#include "reg_code_generator.h"
+
+using namespace std;
+
+
+streambuf* stream_buffer;
+
+
+void change_cout(stringstream& out)
+{
+  stream_buffer = cout.rdbuf();
+  cout.rdbuf(out.rdbuf());
+}
+
+void restore_cout()
+{
+  cout.rdbuf(stream_buffer);
+}
+
+string build_string(initializer_list<string> strs)
+{
+  string result = "";
+  for (string s : strs)
+    result += s + "\n";
+  return result;
+}
+
+// run the vm's register frames (or its stack frames), returning the
+// output (followed by the error message if it fails)
+string run(VM& vm, bool registers)
+{
+  stringstream out;
+  change_cout(out);
+  try {
+    if (registers)
+      vm.run_registers();
+    else
+      vm.run();
+  } catch (MyPLException& ex) {
+    out << ex.what();
+  }
+  restore_cout();
+  return out.str();
+}
+
+// compile the (checked) program into the vm as register or stack code
+void compile(const string& program, VM& vm, bool registers)
+{
+  stringstream in(program);
+  Program p = ASTParser(Lexer(in)).parse();
+  SemanticChecker checker;
+  p.accept(checker);
+  if (registers) {
+    RegCodeGenerator generator(vm);
+    p.accept(generator);
+  }
+  else {
+    CodeGenerator generator(vm);
+    p.accept(generator);
+  }
+}
+
+// compile and run the program with both engines, checking they agree
+string run_both(const string& program)
+{
+  VM stack_vm;
+  compile(program, stack_vm, false);
+  VM reg_vm;
+  compile(program, reg_vm, true);
+  string expected = run(stack_vm, false);
+  string actual = run(reg_vm, true);
+  EXPECT_EQ(expected, actual);
+  return actual;
+}
+
+
+//----------------------------------------------------------------------
+// Register VM tests
+//----------------------------------------------------------------------
+
+TEST(RegVMTest, ArithmeticInRegisters)
+{
+  RegFrameInfo main {"main", 0};
+  main.constants = {VMValue(4), VMValue(3.5), VMValue("x")};
+  main.instructions.push_back(RegInstr::LOADK(0, 0));
+  main.instructions.push_back(RegInstr::ADD(1, 0, 0));
+  main.instructions.push_back(RegInstr::MUL(1, 1, 0));
+  main.instructions.push_back(RegInstr::WRITE(1));
+  main.instructions.push_back(RegInstr::LOADK(2, 1));
+  main.instructions.push_back(RegInstr::ADD(2, 2, 2));
+  main.instructions.push_back(RegInstr::WRITE(2));
+  main.instructions.push_back(RegInstr::LOADK(3, 2));
+  main.instructions.push_back(RegInstr::CONCAT(3, 3, 3));
+  main.instructions.push_back(RegInstr::WRITE(3));
+  VM vm;
+  vm.add(main);
+  EXPECT_EQ("327.000000xx", run(vm, true));
+}
+
+TEST(RegVMTest, LoopWithJumps)
+{
+  // r0 = 0; while r0 < 3 { print(r0); r0 = r0 + 1 }
+  RegFrameInfo main {"main", 0};
+  main.constants = {VMValue(0), VMValue(3), VMValue(1)};
+  main.instructions.push_back(RegInstr::LOADK(0, 0));
+  main.instructions.push_back(RegInstr::LOADK(1, 1));
+  main.instructions.push_back(RegInstr::LOADK(2, 2));
+  main.instructions.push_back(RegInstr::CMPLT(3, 0, 1));
+  main.instructions.push_back(RegInstr::JMPF(3, 8));
+  main.instructions.push_back(RegInstr::WRITE(0));
+  main.instructions.push_back(RegInstr::ADD(0, 0, 2));
+  main.instructions.push_back(RegInstr::JMP(3));
+  VM vm;
+  vm.add(main);
+  EXPECT_EQ("012", run(vm, true));
+}
+
+TEST(RegVMTest, CallCopiesArgsAndReturnsIntoDestination)
+{
+  RegFrameInfo f {"f", 2};
+  f.instructions.push_back(RegInstr::SUB(2, 0, 1));
+  f.instructions.push_back(RegInstr::RET(2));
+  RegFrameInfo main {"main", 0};
+  main.constants = {VMValue(10), VMValue(4)};
+  main.instructions.push_back(RegInstr::LOADK(1, 0));
+  main.instructions.push_back(RegInstr::LOADK(2, 1));
+  main.instructions.push_back(RegInstr::CALL(0, "f", 1, 2));
+  main.instructions.push_back(RegInstr::WRITE(0));
+  main.instructions.push_back(RegInstr::WRITE(1));
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  EXPECT_EQ("610", run(vm, true));
+}
+
+TEST(RegVMTest, StructsAndArrays)
+{
+  VMStructLayout layout {"T", {"x", "y"}};
+  RegFrameInfo main {"main", 0};
+  main.constants = {VMValue(2), VMValue(7), VMValue(1)};
+  main.instructions.push_back(RegInstr::ALLOCS(0, "T"));
+  main.instructions.push_back(RegInstr::LOADK(1, 1));
+  main.instructions.push_back(RegInstr::SETF(0, "y", 1));
+  main.instructions.push_back(RegInstr::GETF(2, 0, "y"));
+  main.instructions.push_back(RegInstr::WRITE(2));
+  main.instructions.push_back(RegInstr::LOADK(3, 0));
+  main.instructions.push_back(RegInstr::ALLOCA(4, 3));
+  main.instructions.push_back(RegInstr::LOADK(5, 2));
+  main.instructions.push_back(RegInstr::SETI(4, 5, 2));
+  main.instructions.push_back(RegInstr::GETI(6, 4, 5));
+  main.instructions.push_back(RegInstr::WRITE(6));
+  main.instructions.push_back(RegInstr::ALEN(6, 4));
+  main.instructions.push_back(RegInstr::WRITE(6));
+  VM vm;
+  vm.add(layout);
+  vm.add(main);
+  EXPECT_EQ("772", run(vm, true));
+}
+
+TEST(RegVMTest, NullOperandError)
+{
+  RegFrameInfo main {"main", 0};
+  main.constants = {VMValue(1), VMValue()};
+  main.instructions.push_back(RegInstr::LOADK(0, 0));
+  main.instructions.push_back(RegInstr::LOADK(1, 1));
+  main.instructions.push_back(RegInstr::ADD(2, 0, 1));
+  VM vm;
+  vm.add(main);
+  EXPECT_EQ("VM Error: null reference (in main at 2: ADD(r2, r0, r1))",
+            run(vm, true));
+}
+
+TEST(RegVMTest, InvalidRegisterCountIsRejected)
+{
+  RegFrameInfo main {"main", 0};
+  main.register_count = 2;
+  main.instructions.push_back(RegInstr::MOV(0, 5));
+  VM vm;
+  try {
+    vm.add(main);
+    FAIL();
+  } catch (MyPLException& ex) {
+    EXPECT_EQ("VM Error: invalid register (in main at 0: MOV(r0, r5))",
+              string(ex.what()));
+  }
+}
+
+
+//----------------------------------------------------------------------
+// Register code generator tests (checking the register engine's
+// output against the stack engine's)
+//----------------------------------------------------------------------
+
+TEST(RegCodeGenTest, ExpressionsAndVariables)
+{
+  string program = build_string({
+      "void main() {",
+      "  int x = 3",
+      "  int y = x * 4 + 2",
+      "  double d = 1.5 * 2.0",
+      "  bool b = not ((x < y) and (y != 14))",
+      "  print(concat(to_string(y), concat(\" \", to_string(d))))",
+      "  print(b)",
+      "  x = y - x",
+      "  print(x)",
+      "}"
+    });
+  EXPECT_EQ("18 3.000000false15", run_both(program));
+}
+
+TEST(RegCodeGenTest, LoopsAndConditionals)
+{
+  string program = build_string({
+      "void main() {",
+      "  int sum = 0",
+      "  for (int i = 0; i < 10; i = i + 1) {",
+      "    if (i < 3) {",
+      "      sum = sum + 1",
+      "    }",
+      "    elseif (i < 6) {",
+      "      sum = sum + 10",
+      "    }",
+      "    else {",
+      "      int j = i",
+      "      while (j > 0) {",
+      "        sum = sum + 100",
+      "        j = j - 1",
+      "      }",
+      "    }",
+      "  }",
+      "  print(sum)",
+      "}"
+    });
+  EXPECT_EQ("3033", run_both(program));
+}
+
+TEST(RegCodeGenTest, FunctionCalls)
+{
+  string program = build_string({
+      "int fib(int n) {",
+      "  if (n < 2) {",
+      "    return n",
+      "  }",
+      "  return fib(n - 1) + fib(n - 2)",
+      "}",
+      "string twice(string s, int n) {",
+      "  string r = \"\"",
+      "  for (int i = 0; i < n; i = i + 1) {",
+      "    r = concat(r, s)",
+      "  }",
+      "  return r",
+      "}",
+      "void main() {",
+      "  print(fib(15))",
+      "  print(twice(\"ab\", 3))",
+      "  print(length(twice(\"c\", fib(5))))",
+      "  print(get(1, \"xyz\"))",
+      "}"
+    });
+  EXPECT_EQ("610ababab5y", run_both(program));
+}
+
+TEST(RegCodeGenTest, StructsAndArrays)
+{
+  string program = build_string({
+      "struct Node {",
+      "  int val,",
+      "  Node next",
+      "}",
+      "void main() {",
+      "  Node head = null",
+      "  for (int i = 0; i < 4; i = i + 1) {",
+      "    Node n = new Node",
+      "    n.val = i * i",
+      "    n.next = head",
+      "    head = n",
+      "  }",
+      "  array int xs = new int[4]",
+      "  Node curr = head",
+      "  int i = 0",
+      "  while (curr != null) {",
+      "    xs[i] = curr.val",
+      "    curr = curr.next",
+      "    i = i + 1",
+      "  }",
+      "  head.next.val = 42",
+      "  print(head.next.val)",
+      "  for (int j = 0; j < 4; j = j + 1) {",
+      "    int x = xs[j]",
+      "    print(\" \")",
+      "    print(x)",
+      "  }",
+      "}"
+    });
+  EXPECT_EQ("42 9 4 1 0", run_both(program));
+}
+
+TEST(RegCodeGenTest, RuntimeErrorsMatchStackEngine)
+{
+  string program = build_string({
+      "void main() {",
+      "  array int xs = new int[2]",
+      "  int x = xs[2]",
+      "}"
+    });
+  VM vm;
+  compile(program, vm, true);
+  string actual = run(vm, true);
+  EXPECT_TRUE(actual.starts_with("VM Error: out-of-bounds array index"));
+}
+
+TEST(RegCodeGenTest, FewerInstructionsThanStackCode)
+{
+  string program = build_string({
+      "int dot(array int xs, array int ys, int n) {",
+      "  int sum = 0",
+      "  for (int i = 0; i < n; i = i + 1) {",
+      "    int x = xs[i]",
+      "    int y = ys[i]",
+      "    sum = sum + x * y",
+      "  }",
+      "  return sum",
+      "}",
+      "void main() {",
+      "  int n = 50",
+      "  array int xs = new int[n]",
+      "  for (int i = 0; i < n; i = i + 1) {",
+      "    xs[i] = i",
+      "  }",
+      "  int total = 0",
+      "  int k = 0",
+      "  while (k < 20) {",
+      "    total = total + dot(xs, xs, n)",
+      "    k = k + 1",
+      "  }",
+      "  print(total)",
+      "}"
+    });
+  VM stack_vm;
+  compile(program, stack_vm, false);
+  VM reg_vm;
+  compile(program, reg_vm, true);
+  EXPECT_EQ(run(stack_vm, false), run(reg_vm, true));
+  // compare the static instruction counts of the two forms
+  auto count = [](const string& listing, const string& header) {
+    int n = 0;
+    bool in_frame = false;
+    stringstream lines(listing);
+    string line;
+    while (getline(lines, line)) {
+      if (line.starts_with("Frame") or line.starts_with("Register frame"))
+        in_frame = line.starts_with(header);
+      else if (in_frame and line.size() > 2 and isdigit(line[2]))
+        ++n;
+    }
+    return n;
+  };
+  int stack_count = count(to_string(stack_vm), "Frame");
+  int reg_count = count(to_string(reg_vm), "Register frame");
+  EXPECT_GT(stack_count, 0);
+  EXPECT_GT(reg_count, 0);
+  EXPECT_LE(reg_count * 10, stack_count * 7);
+}
+
+
+//----------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,249 @@
+//----------------------------------------------------------------------
+// FILE: vm_benchmarks.cpp
+// DATE: CPSC 326, Spring 2023
+// AUTH:
+// DESC: VM performance benchmarks (timings are reported, not checked)
+//----------------------------------------------------------------------
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <gtest/gtest.h>
+#include "mypl_exception.h"
+#include "lexer.h"
+#include "ast_parser.h"
+#include "semantic_checker.h"
+#include "code_generator.h"
+#include "vm_frame.h"
+#include "vm.h"
+#include "vm_image.h"
+
+using namespace std;
+
+
+streambuf* stream_buffer;
+
+
+void change_cout(stringstream& out)
+{
+  stream_buffer = cout.rdbuf();
+  cout.rdbuf(out.rdbuf());
+}
+
+void restore_cout()
+{
+  cout.rdbuf(stream_buffer);
+}
+
+// run the vm and return the elapsed time in milliseconds
+double timed_run(VM& vm)
+{
+  auto start = chrono::steady_clock::now();
+  vm.run();
+  auto end = chrono::steady_clock::now();
+  return chrono::duration<double, milli>(end - start).count();
+}
+
+// number of calls made by the recursive fib(n) below
+long fib_calls(int n)
+{
+  return n < 2 ? 1 : 1 + fib_calls(n - 1) + fib_calls(n - 2);
+}
+
+// int fib(int n) { if (n < 2) return n; return fib(n-1) + fib(n-2) }
+// followed by padding instructions that are never executed
+VMFrameInfo fib_frame(int padding)
+{
+  VMFrameInfo f {"fib", 1};
+  f.instructions.push_back(VMInstr::STORE(0));    // n -> var[0]
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(2));
+  f.instructions.push_back(VMInstr::CMPLT());     // n < 2
+  f.instructions.push_back(VMInstr::JMPF(7));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::RET());       // return n
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::SUB());
+  f.instructions.push_back(VMInstr::CALL("fib")); // fib(n-1)
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(2));
+  f.instructions.push_back(VMInstr::SUB());
+  f.instructions.push_back(VMInstr::CALL("fib")); // fib(n-2)
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::RET());       // return fib(n-1) + fib(n-2)
+  for (int i = 0; i < padding; ++i)
+    f.instructions.push_back(VMInstr::NOP());
+  return f;
+}
+
+VMFrameInfo fib_main(int n)
+{
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(n));
+  main.instructions.push_back(VMInstr::CALL("fib"));
+  main.instructions.push_back(VMInstr::WRITE());
+  return main;
+}
+
+
+//----------------------------------------------------------------------
+// Function calls
+//----------------------------------------------------------------------
+
+TEST(VMBenchmark, RecursiveFibCallOverhead) {
+  const int n = 25;
+  long calls = fib_calls(n);
+  // the cost of a call should not depend on the size of the callee
+  for (int padding : {0, 1000, 10000}) {
+    VM vm;
+    vm.add(fib_frame(padding));
+    vm.add(fib_main(n));
+    stringstream out;
+    change_cout(out);
+    double ms = timed_run(vm);
+    restore_cout();
+    EXPECT_EQ("75025", out.str());
+    cout << "  fib(" << n << ") with " << padding << " padding instrs: "
+         << ms << " ms, " << (ms * 1e6 / calls) << " ns/call" << endl;
+  }
+}
+
+
+//----------------------------------------------------------------------
+// Strings
+//----------------------------------------------------------------------
+
+TEST(VMBenchmark, RepeatedConcatBuilds10MBString) {
+  const int chunk_size = 64;
+  const int n = 10 * 1024 * 1024 / chunk_size;
+  // string s = "" for (int i = 0; i < n; i = i + 1) {s = concat(s, chunk)}
+  // as generated by the code generator (s is cleared before the CONCAT)
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(""));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::STORE(1));
+  main.instructions.push_back(VMInstr::LOAD(1));     // 4: i < n
+  main.instructions.push_back(VMInstr::PUSH(n));
+  main.instructions.push_back(VMInstr::CMPLT());
+  main.instructions.push_back(VMInstr::JMPF(19));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(string(chunk_size, 'a')));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::CONCAT());
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(1));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.instructions.push_back(VMInstr::STORE(1));
+  main.instructions.push_back(VMInstr::JMP(4));
+  main.instructions.push_back(VMInstr::LOAD(0));     // 19
+  main.instructions.push_back(VMInstr::SLEN());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  double ms = timed_run(vm);
+  restore_cout();
+  EXPECT_EQ(to_string(n * chunk_size), out.str());
+  cout << "  " << n << " concats of " << chunk_size << " chars: " << ms
+       << " ms, " << (ms * 1e6 / n) << " ns/concat" << endl;
+}
+
+
+//----------------------------------------------------------------------
+// Startup
+//----------------------------------------------------------------------
+
+// a script of the given number of functions (only the first is called)
+string startup_program(int functions)
+{
+  string program;
+  for (int k = 0; k < functions; ++k) {
+    string f = "f" + to_string(k);
+    program +=
+      "int " + f + "(int n) {\n"
+      "  int s = 0\n"
+      "  for (int i = 0; i < n; i = i + 1) {\n"
+      "    s = s + i * " + to_string(k) + "\n"
+      "  }\n"
+      "  if (s > 100) {\n"
+      "    s = s - 1\n"
+      "  }\n"
+      "  else {\n"
+      "    s = s + 1\n"
+      "  }\n"
+      "  return s\n"
+      "}\n";
+  }
+  program += "void main() {\n  print(f0(3))\n}\n";
+  return program;
+}
+
+TEST(VMBenchmark, StartupFromSourceAndImage) {
+  const int functions = 500;
+  const int runs = 20;
+  string program = startup_program(functions);
+  // the image is written once, as by mypl --compile
+  string image;
+  {
+    stringstream in(program);
+    Program p = ASTParser(Lexer(in)).parse();
+    SemanticChecker checker;
+    p.accept(checker);
+    VM vm;
+    CodeGenerator generator(vm);
+    p.accept(generator);
+    stringstream out;
+    save_image(vm, out);
+    image = out.str();
+  }
+  double source_ms = 0;
+  double image_ms = 0;
+  for (int i = 0; i < runs; ++i) {
+    stringstream out;
+    change_cout(out);
+    auto start = chrono::steady_clock::now();
+    {
+      stringstream in(program);
+      Program p = ASTParser(Lexer(in)).parse();
+      SemanticChecker checker;
+      p.accept(checker);
+      VM vm;
+      CodeGenerator generator(vm);
+      p.accept(generator);
+      vm.run();
+    }
+    auto middle = chrono::steady_clock::now();
+    {
+      VM vm;
+      load_image(vm, image.data(), image.size());
+      vm.run();
+    }
+    auto end = chrono::steady_clock::now();
+    restore_cout();
+    EXPECT_EQ("11", out.str());
+    source_ms += chrono::duration<double, milli>(middle - start).count();
+    image_ms += chrono::duration<double, milli>(end - middle).count();
+  }
+  cout << "  startup of " << functions << " functions (" << program.size()
+       << " source bytes, " << image.size() << " image bytes): source "
+       << (source_ms / runs) << " ms, image " << (image_ms / runs)
+       << " ms" << endl;
+}
+
+
+//----------------------------------------------------------------------
+// main
+//----------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
@@ -5,6 +5,9 @@
 // DESC: Basic vm tests
 //----------------------------------------------------------------------
 
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
@@ -12,6 +15,8 @@
 #include "mypl_exception.h"
 #include "vm_frame.h"
 #include "vm.h"
+#include "vm_image.h"
+#include "compile_cache.h"
 
 using namespace std;
 
@@ -75,6 +80,43 @@ TEST(BasicVMTest, SinglePop) {
   restore_cout();
 }
 
+TEST(BasicVMTest, PushConstants) {
+  VMFrameInfo f {"f", 0};
+  f.constants = {"blue", "green"};
+  f.instructions.push_back(VMInstr::PUSHK(1));
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.constants = {"green"};
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::PUSHK(0));
+  main.instructions.push_back(VMInstr::CMPEQ());   // interned across frames
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSHK(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("truegreen", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, InvalidConstantIndex) {
+  VMFrameInfo main {"main", 0};
+  main.constants = {"blue"};
+  main.instructions.push_back(VMInstr::PUSHK(1));
+  VM vm;
+  try {
+    vm.add(main);
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_EQ("VM Error: invalid constant index (in main at 0: PUSHK(1))", err);
+  }
+}
+
 TEST(BasicVMTest, StoreAndLoad) {
   VMFrameInfo main {"main", 0};
   main.instructions.push_back(VMInstr::PUSH("blue"));
@@ -90,6 +132,23 @@ TEST(BasicVMTest, StoreAndLoad) {
   restore_cout();
 }
 
+TEST(BasicVMTest, StoreOutsideLocalCount) {
+  VMFrameInfo main {"main", 0};
+  main.local_count = 1;
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::STORE(1));
+  VM vm;
+  try {
+    vm.add(main);
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: invalid variable index ";
+    msg += "(in main at 1: STORE(1))";
+    EXPECT_EQ(msg, err);
+  }
+}
+
 //----------------------------------------------------------------------
 // Special instructions
 //----------------------------------------------------------------------
@@ -185,6 +244,46 @@ TEST(BasicVMTest, NullAddSecondOperand) {
   restore_cout();
 }
 
+TEST(BasicVMTest, TypedIntAndDoubleAdd) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(42));
+  main.instructions.push_back(VMInstr::PUSH(43));
+  main.instructions.push_back(VMInstr::ADDI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(3.50));
+  main.instructions.push_back(VMInstr::PUSH(2.25));
+  main.instructions.push_back(VMInstr::ADDD());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("855.750000", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, TypedAddNullOperand) {
+  VMFrameInfo main {"main", 0};                      
+  main.instructions.push_back(VMInstr::PUSH(10));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::ADDI());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: null reference ";
+    msg += "(in main at 2: ADDI())";
+    EXPECT_EQ(msg, err);
+  }
+  restore_cout();
+}
+
 TEST(BasicVMTest, IntSub) {
   VMFrameInfo main {"main", 0};
   main.instructions.push_back(VMInstr::PUSH(15));
@@ -954,6 +1053,29 @@ TEST(BasicVMTest, StringGreaterEqual) {
   restore_cout();
 }
 
+TEST(BasicVMTest, TypedComparisons) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(2));
+  main.instructions.push_back(VMInstr::CMPLTI());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::CMPGED());
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("ab"));
+  main.instructions.push_back(VMInstr::PUSH("b"));
+  main.instructions.push_back(VMInstr::CMPGTS());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("truetruefalse", out.str());
+  restore_cout();
+}
+
 TEST(BasicVMTest, NullGreaterEqualFirstOperand) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::PUSH(nullptr));
@@ -1415,6 +1537,72 @@ TEST(BasicVMTest, RecursiveSumFunction) {
   restore_cout();
 }
 
+TEST(BasicVMTest, DeepRecursionStackOverflow) {
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));    // x -> var[0]
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::ADD());       // x + 1
+  f.instructions.push_back(VMInstr::CALL("f"));   // f(x + 1)
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  vm.set_max_stack_size(1000);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_TRUE(err.starts_with("VM Error: stack overflow (in f at"));
+  }
+}
+
+TEST(BasicVMTest, DeepRecursionCallDepthExceeded) {
+  // f uses no value stack slots, so only the call depth bounds it
+  VMFrameInfo f {"f", 0};
+  f.instructions.push_back(VMInstr::CALL("f"));
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::CALL("f"));
+  VM vm;
+  vm.add(f);
+  vm.add(main);
+  vm.set_max_call_depth(100);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: call depth exceeded (in f at 0: CALL(f))",
+              string(ex.what()));
+  }
+}
+
+TEST(BasicVMTest, UndefinedFunctionReportedAtLink) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH("blue"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::CALL("f"));
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    string msg = "VM Error: undefined function 'f' ";
+    msg += "(in main at 2: CALL(f))";
+    EXPECT_EQ(msg, err);
+  }
+  EXPECT_EQ("", out.str());
+  restore_cout();
+}
+
 //----------------------------------------------------------------------
 // Heap-Related
 //----------------------------------------------------------------------
@@ -1513,6 +1701,73 @@ TEST(BasicVMTest, TwoFieldsOneStructAlloc) {
   restore_cout();
 }
 
+TEST(BasicVMTest, ManyFieldsOneStructAlloc) {
+  VMFrameInfo main {"main", 1};
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::STORE(0));
+  for (int i = 0; i < 20; ++i) {
+    main.instructions.push_back(VMInstr::LOAD(0));
+    main.instructions.push_back(VMInstr::ADDF("f" + to_string(i)));
+    main.instructions.push_back(VMInstr::LOAD(0));
+    main.instructions.push_back(VMInstr::PUSH(i));
+    main.instructions.push_back(VMInstr::SETF("f" + to_string(i)));
+  }
+  for (int i : {0, 7, 19}) {
+    main.instructions.push_back(VMInstr::LOAD(0));
+    main.instructions.push_back(VMInstr::GETF("f" + to_string(i)));
+    main.instructions.push_back(VMInstr::WRITE());
+  }
+  VM vm;
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("0719", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, LayoutStructFieldOffsets) {
+  VMStructLayout point {"Point", {"x", "y"}};
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS("Point"));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::SETF("x", 0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(4));
+  main.instructions.push_back(VMInstr::SETF("y", 1));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("y", 1));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("x"));    // by name
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(point);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("43", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, UndefinedStructReportedAtLink) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS("Point"));
+  VM vm;
+  vm.add(main);
+  try {
+    vm.link();
+    FAIL();
+  } catch(MyPLException& ex) {
+    string err = ex.what();
+    EXPECT_EQ("VM Error: undefined struct 'Point' (in main at 0: ALLOCS(Point))",
+              err);
+  }
+}
+
 TEST(BasicVMTest, NullObjectFieldAccess) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::PUSH(nullptr)); // oid is null
@@ -1835,6 +2090,30 @@ TEST(BasicVMTest, StringLength) {
   restore_cout();
 }
 
+TEST(BasicVMTest, PoppedStringsReleased) {
+  // each instruction releases the strings it pops (the program's
+  // operands keep the only other references)
+  VMValue blue("blue");
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(blue));
+  main.instructions.push_back(VMInstr::SLEN());
+  main.instructions.push_back(VMInstr::POP());
+  main.instructions.push_back(VMInstr::PUSH(blue));
+  main.instructions.push_back(VMInstr::PUSH(blue));
+  main.instructions.push_back(VMInstr::CMPEQ());
+  main.instructions.push_back(VMInstr::POP());
+  main.instructions.push_back(VMInstr::PUSH(blue));
+  main.instructions.push_back(VMInstr::TOSTR());
+  main.instructions.push_back(VMInstr::POP());
+  VM vm;
+  vm.add(main);
+  int refs = blue.string_ref()->ref_count();
+  for (int i = 0; i < 3; ++i) {
+    vm.run();
+    EXPECT_EQ(refs, blue.string_ref()->ref_count());
+  }
+}
+
 TEST(BasicVMTest, NullStringLength) {
   VMFrameInfo main {"main", 0};                      
   main.instructions.push_back(VMInstr::PUSH(nullptr));  // string is null
@@ -2227,13 +2506,655 @@ TEST(BasicVMTest, NullConcatSecondOperand) {
   restore_cout();
 }
 
+//----------------------------------------------------------------------
+// Tail calls
+//----------------------------------------------------------------------
+
+TEST(BasicVMTest, TailCallReusesFrame) {
+  // f(n, s) returns s if n is 0, else f(n - 1, s + n)
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::STORE(1));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::CMPEQ());
+  f.instructions.push_back(VMInstr::JMPF(8));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::RET());
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::SUB());
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::TAILCALL("f"));
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(10000));
+  main.instructions.push_back(VMInstr::PUSH(0));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_max_stack_size(32);
+  vm.add(f);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("50005000", out.str());
+  restore_cout();
+}
+
+TEST(BasicVMTest, TailCallToOtherFunction) {
+  // g's frame (with more locals) replaces f's, and g returns to main
+  VMFrameInfo f {"f", 1};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::PUSH("x"));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::TAILCALL("g"));
+  VMFrameInfo g {"g", 2};
+  g.local_count = 3;
+  g.instructions.push_back(VMInstr::STORE(0));
+  g.instructions.push_back(VMInstr::STORE(1));
+  g.instructions.push_back(VMInstr::LOAD(0));
+  g.instructions.push_back(VMInstr::LOAD(1));
+  g.instructions.push_back(VMInstr::CONCAT());
+  g.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH("y"));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.add(f);
+  vm.add(g);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  EXPECT_EQ("xy", out.str());
+  restore_cout();
+}
+
+
+//----------------------------------------------------------------------
+// JIT tests (each frame is compiled on its first call)
+//----------------------------------------------------------------------
+
+// sum of 0..n-1 in a loop of locals and int operations
+VMFrameInfo jit_sum_frame()
+{
+  VMFrameInfo f {"sum", 1};
+  f.instructions.push_back(VMInstr::STORE(0));     // n
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::STORE(1));     // s = 0
+  f.instructions.push_back(VMInstr::PUSH(0));
+  f.instructions.push_back(VMInstr::STORE(2));     // i = 0
+  f.instructions.push_back(VMInstr::LOAD(2));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::CMPLT());
+  f.instructions.push_back(VMInstr::JMPF(18));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::LOAD(2));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::STORE(1));     // s = s + i
+  f.instructions.push_back(VMInstr::LOAD(2));
+  f.instructions.push_back(VMInstr::PUSH(1));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::STORE(2));     // i = i + 1
+  f.instructions.push_back(VMInstr::JMP(5));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::RET());
+  return f;
+}
+
+TEST(JitVMTest, HotFunctionIsCompiled) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(0);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("499500", out.str());
+  if (VMJit::supported())
+    EXPECT_EQ(2, vm.jit_compiled_count());
+}
+
+TEST(JitVMTest, ColdFunctionIsInterpreted) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(100);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("3", out.str());
+  EXPECT_EQ(0, vm.jit_compiled_count());
+}
+
+TEST(JitVMTest, DoublesAndTypeGuardFallback) {
+  // the same native code adds doubles, then strings (left to the
+  // interpreter when the type guard fails)
+  VMFrameInfo f {"f", 2};
+  f.instructions.push_back(VMInstr::STORE(0));
+  f.instructions.push_back(VMInstr::STORE(1));
+  f.instructions.push_back(VMInstr::LOAD(0));
+  f.instructions.push_back(VMInstr::LOAD(1));
+  f.instructions.push_back(VMInstr::ADD());
+  f.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1.25));
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(7));
+  main.instructions.push_back(VMInstr::PUSH(-2));
+  main.instructions.push_back(VMInstr::CALL("f"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("ab"));
+  main.instructions.push_back(VMInstr::PUSH("cd"));
+  main.instructions.push_back(VMInstr::CONCAT());
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(0);
+  vm.add(f);
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("3.7500005abcd", out.str());
+}
+
+TEST(JitVMTest, NullOperandErrorFromNativeCode) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::ADD());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(0);
+  vm.add(main);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: null reference (in main at 2: ADD())",
+              string(ex.what()));
+  }
+}
+
+TEST(JitVMTest, StackOverflowFromNativeCode) {
+  VMFrameInfo main {"main", 0};
+  for (int i = 0; i < 70; ++i)
+    main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::RET());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(0);
+  vm.set_max_stack_size(64);
+  vm.add(main);
+  try {
+    vm.run();
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: stack overflow (in main at 64: PUSH(1))",
+              string(ex.what()));
+  }
+}
+
+
+//----------------------------------------------------------------------
+// Profiler tests
+//----------------------------------------------------------------------
+
+TEST(ProfilerVMTest, CountsOpcodesPairsAndInstructions) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(3));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_superinstructions(false);
+  vm.set_quickening(false);
+  vm.set_profiling(true);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("3", out.str());
+  const VMProfiler* profile = vm.profile();
+  ASSERT_NE(nullptr, profile);
+  EXPECT_EQ(3 + 5 + 4 * 4 + 3 * 9 + 2, profile->instruction_count());
+  EXPECT_EQ(6, profile->opcode_count(OpCode::ADD));
+  EXPECT_EQ(3, profile->opcode_count(OpCode::JMP));
+  EXPECT_EQ(6, profile->pair_count(OpCode::ADD, OpCode::STORE));
+  EXPECT_EQ(1, profile->pair_count(OpCode::CALL, OpCode::STORE));
+  EXPECT_EQ(0, profile->pair_count(OpCode::STORE, OpCode::CALL));
+  const VMFunctionProfile* sum = profile->function("sum");
+  ASSERT_NE(nullptr, sum);
+  EXPECT_EQ(1, sum->calls);
+  EXPECT_EQ(1, sum->instruction_counts[0]);
+  EXPECT_EQ(4, sum->instruction_counts[5]);
+  EXPECT_EQ(3, sum->instruction_counts[17]);
+  EXPECT_EQ(1, sum->instruction_counts[19]);
+  EXPECT_EQ(1, profile->function("main")->calls);
+  EXPECT_EQ(nullptr, profile->function("other"));
+}
+
+TEST(ProfilerVMTest, CountsEachCall) {
+  VMFrameInfo main {"main", 0};
+  for (int i = 0; i < 4; ++i) {
+    main.instructions.push_back(VMInstr::PUSH(i));
+    main.instructions.push_back(VMInstr::CALL("sum"));
+    main.instructions.push_back(VMInstr::POP());
+  }
+  VM vm;
+  vm.set_profiling(true);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  vm.run();
+  const VMProfiler* profile = vm.profile();
+  EXPECT_EQ(4, profile->function("sum")->calls);
+  EXPECT_EQ(4, profile->opcode_count(OpCode::CALL));
+  EXPECT_EQ(4, profile->function("sum")->instruction_counts[0]);
+  EXPECT_LE(0, profile->function("sum")->self_ms);
+  EXPECT_LE(profile->function("sum")->self_ms, profile->total_ms());
+}
+
+TEST(ProfilerVMTest, ProfilingTurnsOffTheJit) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1000));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::WRITE());
+  VM vm;
+  vm.set_jit(true);
+  vm.set_jit_threshold(0);
+  vm.set_profiling(true);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  stringstream out;
+  change_cout(out);
+  vm.run();
+  restore_cout();
+  EXPECT_EQ("499500", out.str());
+  EXPECT_EQ(0, vm.jit_compiled_count());
+  EXPECT_EQ(1000, vm.profile()->function("sum")->instruction_counts[17]);
+  vm.set_profiling(false);
+  EXPECT_EQ(nullptr, vm.profile());
+}
+
+
+TEST(ProfilerVMTest, SamplesFoldedCallStacks) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1000000));
+  main.instructions.push_back(VMInstr::CALL("sum"));
+  main.instructions.push_back(VMInstr::POP());
+  VM vm;
+  vm.set_jit(false);
+  EXPECT_EQ(nullptr, vm.samples());
+  vm.set_sampling(1000);
+  vm.add(jit_sum_frame());
+  vm.add(main);
+  vm.run();
+  const VMSampler* samples = vm.samples();
+  ASSERT_NE(nullptr, samples);
+  if (!VMSampler::supported())
+    return;
+  EXPECT_LT(0, samples->sample_count());
+  EXPECT_EQ(0, samples->dropped_count());
+  stringstream out;
+  samples->write_folded(out);
+  string line;
+  int total = 0;
+  int in_sum = 0;
+  while (getline(out, line)) {
+    EXPECT_TRUE(line.starts_with("main;")) << line;
+    int count = stoi(line.substr(line.rfind(' ') + 1));
+    if (line.starts_with("main;sum;sum:"))
+      in_sum += count;
+    total += count;
+  }
+  EXPECT_EQ(samples->sample_count(), total);
+  EXPECT_LT(0, in_sum);
+}
+
+
+//----------------------------------------------------------------------
+// Image tests
+//----------------------------------------------------------------------
+
+// a program with a struct layout, constants of each type, a call, and
+// a line table
+VM& add_image_program(VM& vm)
+{
+  VMStructLayout point {"Point", {"x", "y"}};
+  VMFrameInfo scale {"scale", 2};
+  scale.instructions.push_back(VMInstr::STORE(0));
+  scale.instructions.push_back(VMInstr::STORE(1));
+  scale.instructions.push_back(VMInstr::LOAD(0));
+  scale.instructions.push_back(VMInstr::LOAD(1));
+  scale.instructions.push_back(VMInstr::MUL());
+  scale.instructions.push_back(VMInstr::RET());
+  VMFrameInfo main {"main", 0};
+  main.constants.push_back(VMValue("x = "));
+  main.instructions.push_back(VMInstr::ALLOCS("Point"));
+  main.instructions.push_back(VMInstr::STORE(0));
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::PUSH(2.5));
+  main.instructions.push_back(VMInstr::PUSH(4.0));
+  main.instructions.push_back(VMInstr::CALL("scale"));
+  main.instructions.push_back(VMInstr::SETF("x", 0));
+  main.instructions.push_back(VMInstr::PUSHK(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("x", 0));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(true));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH("a\nb"));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::GETF("y", 1));
+  main.instructions.push_back(VMInstr::PUSH(-1));
+  main.instructions.push_back(VMInstr::ADD());
+  main.lines = {{0, 2, 3}, {2, 3, 5}, {19, 7, 1}};
+  vm.add(point);
+  vm.add(scale);
+  vm.add(main);
+  return vm;
+}
+
+TEST(ImageVMTest, SavedProgramRunsTheSame) {
+  VM vm;
+  add_image_program(vm);
+  stringstream image;
+  save_image(vm, image);
+  VM loaded;
+  string data = image.str();
+  load_image(loaded, data.data(), data.size());
+  EXPECT_EQ(to_string(vm), to_string(loaded));
+  for (VM* v : {&vm, &loaded}) {
+    stringstream out;
+    change_cout(out);
+    try {
+      v->run();
+      FAIL();
+    } catch(MyPLException& ex) {
+      EXPECT_EQ("VM Error: null reference (in main at 21: ADD()) "
+                "at line 7, column 1", string(ex.what()));
+    }
+    restore_cout();
+    EXPECT_EQ("x = 10.000000truenulla\nb", out.str());
+  }
+}
+
+TEST(ImageVMTest, RejectsTruncatedAndExtendedImages) {
+  VM vm;
+  add_image_program(vm);
+  stringstream image;
+  save_image(vm, image);
+  string data = image.str();
+  for (size_t size = 0; size < data.size(); ++size) {
+    VM loaded;
+    EXPECT_THROW(load_image(loaded, data.data(), size), MyPLException);
+  }
+  VM loaded;
+  data += '\0';
+  EXPECT_THROW(load_image(loaded, data.data(), data.size()), MyPLException);
+}
+
+TEST(ImageVMTest, RejectsOtherVersions) {
+  VM vm;
+  add_image_program(vm);
+  stringstream image;
+  save_image(vm, image);
+  string data = image.str();
+  data[8] = IMAGE_VERSION + 1;
+  VM loaded;
+  try {
+    load_image(loaded, data.data(), data.size());
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_TRUE(string(ex.what()).ends_with("recompile the program"));
+  }
+  data = "#!/bin/mypl" + image.str();
+  EXPECT_THROW(load_image(loaded, data.data(), data.size()), MyPLException);
+}
+
+// the error of loading the saved image of a frame
+string load_saved_frame(const VMFrameInfo& frame)
+{
+  VM vm;
+  vm.add(frame);
+  stringstream image;
+  save_image(vm, image);
+  string data = image.str();
+  VM loaded;
+  try {
+    load_image(loaded, data.data(), data.size());
+  } catch(MyPLException& ex) {
+    return ex.what();
+  }
+  return "";
+}
+
+TEST(ImageVMTest, RejectsBadOperands) {
+  vector<VMInstr> bad = {
+    VMInstr::make(OpCode::CALL, nullopt, -1),
+    VMInstr::make(OpCode::TAILCALL, VMValue(1), -1),
+    VMInstr::make(OpCode::ALLOCS, VMValue(2.5), -1),
+    VMInstr::make(OpCode::ALLOCS, nullopt, 7),
+    VMInstr::make(OpCode::GETF, nullopt, 0),
+    VMInstr::make(OpCode::SETF, VMValue(true), 0),
+    VMInstr::make(OpCode::ADDF, VMValue(nullptr), -1),
+    VMInstr::make(OpCode::PUSH, nullopt, -1),
+    VMInstr::make(OpCode::INCL, VMValue(0), -1),
+    VMInstr::make(OpCode::GETF_Q, VMValue("x"), 0),
+  };
+  for (const VMInstr& instr : bad) {
+    VMFrameInfo main {"main", 0};
+    main.instructions.push_back(instr);
+    string err = load_saved_frame(main);
+    EXPECT_TRUE(err.starts_with("VM Error: invalid image: ")) << to_string(instr);
+  }
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::ALLOCS());
+  main.instructions.push_back(VMInstr::GETF("x", -1));
+  EXPECT_EQ("", load_saved_frame(main));
+}
+
+TEST(ImageVMTest, RejectsNegativeCounts) {
+  VMFrameInfo f {"f", -1};
+  f.instructions.push_back(VMInstr::RET());
+  EXPECT_EQ("VM Error: invalid image: negative arg or local count in f",
+            load_saved_frame(f));
+}
+
+TEST(ImageVMTest, BadImagesLeaveTheVMUnchanged) {
+  VMStructLayout point {"Point", {"x", "y"}};
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::STORE(999));
+  VM vm;
+  vm.add(point);
+  vm.add(main);
+  stringstream image;
+  save_image(vm, image);
+  // the STORE index is moved past the frame's 1000 locals
+  string data = image.str();
+  size_t index = data.find(string("\xe7\x03\x00\x00", 4));
+  ASSERT_NE(string::npos, index);
+  data[index + 1] = '\x10';
+  VM loaded;
+  try {
+    load_image(loaded, data.data(), data.size());
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: invalid variable index (in main at 1: STORE(4327))",
+              string(ex.what()));
+  }
+  EXPECT_EQ(to_string(VM()), to_string(loaded));
+}
+
+TEST(ImageVMTest, RejectsStackUnderflow) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::LOAD(0));
+  main.instructions.push_back(VMInstr::WRITE());
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::RET());
+  VM vm;
+  vm.add(main);
+  stringstream image;
+  save_image(vm, image);
+  // the LOAD (with no resolved index) becomes a CMPNE with no operands
+  // on the stack
+  string data = image.str();
+  string load = string(1, static_cast<char>(OpCode::LOAD)) + "\xff\xff\xff\xff";
+  size_t index = data.find(load);
+  ASSERT_NE(string::npos, index);
+  data[index] = static_cast<char>(OpCode::CMPNE);
+  VM loaded;
+  try {
+    load_image(loaded, data.data(), data.size());
+    FAIL();
+  } catch(MyPLException& ex) {
+    EXPECT_EQ("VM Error: stack underflow (in main at 0: CMPNE(0))",
+              string(ex.what()));
+  }
+  EXPECT_EQ(to_string(VM()), to_string(loaded));
+}
+
+TEST(ImageVMTest, RejectsInconsistentStackDepths) {
+  VMFrameInfo main {"main", 0};
+  main.instructions.push_back(VMInstr::PUSH(true));
+  main.instructions.push_back(VMInstr::JMPF(3));
+  main.instructions.push_back(VMInstr::PUSH(1));
+  main.instructions.push_back(VMInstr::PUSH(nullptr));
+  main.instructions.push_back(VMInstr::RET());
+  EXPECT_EQ("VM Error: inconsistent stack depth (in main at 2: PUSH(1))",
+            load_saved_frame(main));
+}
+
+TEST(ImageVMTest, LoadsImageFiles) {
+  VM vm;
+  add_image_program(vm);
+  string path = testing::TempDir() + "vm_tests_image.myplc";
+  {
+    ofstream file(path, ios::binary);
+    save_image(vm, file);
+  }
+  EXPECT_TRUE(is_image_file(path));
+  VM loaded;
+  load_image(loaded, path);
+  EXPECT_EQ(to_string(vm), to_string(loaded));
+  remove(path.c_str());
+  EXPECT_FALSE(is_image_file(path));
+  EXPECT_THROW(load_image(loaded, path), MyPLException);
+}
+
+
+//----------------------------------------------------------------------
+// Compile cache tests
+//----------------------------------------------------------------------
+
+// an empty cache directory for the test
+string empty_cache_dir()
+{
+  string dir = testing::TempDir() + "vm_tests_cache";
+  filesystem::remove_all(dir);
+  return dir;
+}
+
+TEST(CompileCacheVMTest, KeysDependOnEverySourceByte) {
+  string key = CompileCache::key("print(1)\n");
+  EXPECT_EQ(64, key.size());
+  EXPECT_EQ(string::npos, key.find_first_not_of("0123456789abcdef"));
+  EXPECT_EQ(key, CompileCache::key("print(1)\n"));
+  EXPECT_NE(key, CompileCache::key("print(2)\n"));
+  EXPECT_NE(key, CompileCache::key("print(1)"));
+  EXPECT_NE(CompileCache::key(""), CompileCache::key(string(1, '\0')));
+}
+
+TEST(CompileCacheVMTest, StoredProgramsAreHits) {
+  string dir = empty_cache_dir();
+  CompileCache cache(dir);
+  VM vm;
+  EXPECT_FALSE(cache.load("source", vm));
+  EXPECT_EQ(to_string(VM()), to_string(vm));
+  add_image_program(vm);
+  cache.store("source", vm);
+  VM loaded;
+  EXPECT_TRUE(cache.load("source", loaded));
+  EXPECT_EQ(to_string(vm), to_string(loaded));
+  VM other;
+  EXPECT_FALSE(CompileCache(dir).load("other source", other));
+  CompileCacheStats stats = cache.stats();
+  EXPECT_EQ(1, stats.hits);
+  EXPECT_EQ(2, stats.misses);
+  // only the entry and the counts (no temporary files)
+  int files = 0;
+  for (auto& entry : filesystem::directory_iterator(dir)) {
+    string name = entry.path().filename().string();
+    EXPECT_TRUE(name == "stats" or name == CompileCache::key("source") + ".myplc");
+    ++files;
+  }
+  EXPECT_EQ(2, files);
+  filesystem::remove_all(dir);
+}
+
+TEST(CompileCacheVMTest, CorruptEntriesAreMissesAndReplaced) {
+  string dir = empty_cache_dir();
+  filesystem::create_directories(dir);
+  string entry = dir + "/" + CompileCache::key("source") + ".myplc";
+  VM vm;
+  add_image_program(vm);
+  stringstream image;
+  save_image(vm, image);
+  {
+    ofstream file(entry, ios::binary);
+    file << image.str().substr(0, image.str().size() / 2);
+  }
+  CompileCache cache(dir);
+  VM loaded;
+  EXPECT_FALSE(cache.load("source", loaded));
+  EXPECT_EQ(to_string(VM()), to_string(loaded));
+  cache.store("source", vm);
+  EXPECT_TRUE(cache.load("source", loaded));
+  EXPECT_EQ(to_string(vm), to_string(loaded));
+  filesystem::remove_all(dir);
+}
+
+
 //----------------------------------------------------------------------
 // main
 //----------------------------------------------------------------------
 
+// Differential mode: every test runs twice, first interpreted and then
+// with every frame compiled by the jit on its first call (the jit
+// tests set their own jit settings)
 int main(int argc, char** argv)
 {
   testing::InitGoogleTest(&argc, argv);
-  return RUN_ALL_TESTS();
+  VM::set_jit_defaults(false, 0);
+  int interpreted = RUN_ALL_TESTS();
+  VM::set_jit_defaults(true, 0);
+  int compiled = RUN_ALL_TESTS();
+  return interpreted or compiled;
 }
 